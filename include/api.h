@@ -0,0 +1,16 @@
+#pragma once
+
+#include <ArduinoJson.h>
+#include <ESPAsyncWebServer.h>
+
+// Largest JSON request body accepted by /api/v1
+constexpr size_t API_MAX_BODY_SIZE = 1024;
+
+typedef std::function<void(AsyncWebServerRequest *request, JsonDocument &body)> ApiJsonHandler;
+
+void registerApiRoutes(AsyncWebServer &server);
+
+// Helpers shared by API modules
+void apiOnJson(AsyncWebServer &server, const char *path, WebRequestMethodComposite method, ApiJsonHandler handler);
+void apiSendJson(AsyncWebServerRequest *request, JsonDocument &doc, int code = 200);
+void apiSendError(AsyncWebServerRequest *request, int code, const char *message);
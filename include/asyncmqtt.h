@@ -0,0 +1,152 @@
+#pragma once
+
+#include <Arduino.h>
+#include <AsyncTCP.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#ifndef MQTT_MAX_PACKET_SIZE
+#define MQTT_MAX_PACKET_SIZE 1024
+#endif
+
+// Upper bound for bytes waiting in the outgoing queue; publish() fails beyond it
+#ifndef MQTT_MAX_QUEUED_BYTES
+#define MQTT_MAX_QUEUED_BYTES 16384
+#endif
+
+// Maximum number of QoS 1 publishes waiting for a PUBACK
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 8
+#endif
+
+// Called once a queued publish is done with its payload: for QoS 0 when the
+// TCP stack acknowledged the bytes, for QoS 1 when the broker sent PUBACK.
+// `delivered` is false if the message was dropped (disconnect, shutdown).
+typedef std::function<void(bool delivered)> MqttDoneCallback;
+typedef std::function<void(const char *topic, const uint8_t *payload, size_t length)> MqttMessageCallback;
+typedef std::function<void()> MqttConnectCallback;
+
+// Minimal event-driven MQTT 3.1.1 client on top of AsyncTCP.
+//
+// All public methods only enqueue work and return immediately; the socket is
+// driven from the AsyncTCP task. Callbacks run in the AsyncTCP task as well.
+class AsyncMqtt
+{
+public:
+    AsyncMqtt();
+    ~AsyncMqtt();
+
+    void setServer(const String &host, uint16_t port);
+    void setCredentials(const String &user, const String &pass);
+    void setWill(const String &topic, const char *payload, bool retain, uint8_t qos);
+    void setKeepAlive(uint16_t seconds);
+
+    void onConnect(MqttConnectCallback cb) { _connectCb = cb; }
+    void onMessage(MqttMessageCallback cb) { _messageCb = cb; }
+
+    bool connect(const String &clientId);
+    void disconnect();
+
+    bool connected() const { return _state == CONNECTED; }
+    bool connecting() const { return _state == TCP_CONNECTING || _state == MQTT_CONNECTING; }
+
+    // Copies topic and payload into the outgoing queue
+    bool publish(const char *topic, const char *payload, bool retain, uint8_t qos = 0, MqttDoneCallback done = nullptr);
+    bool publish(const char *topic, const uint8_t *payload, size_t length, bool retain, uint8_t qos = 0, MqttDoneCallback done = nullptr);
+
+    // Zero-copy publish: the payload is handed to the TCP stack by reference
+    // and must stay valid and unchanged until `done` has been called.
+    bool publishRef(const char *topic, const uint8_t *payload, size_t length, bool retain, uint8_t qos, MqttDoneCallback done);
+
+    bool subscribe(const char *topic, uint8_t qos = 0);
+
+    // Keep-alive and QoS 1 retransmission; never blocks
+    void loop();
+
+    size_t queuedBytes() const { return _queuedBytes; }
+    size_t inFlight() const { return _qosPending; }
+
+private:
+    enum ConnState
+    {
+        DISCONNECTED,
+        TCP_CONNECTING,
+        MQTT_CONNECTING,
+        CONNECTED
+    };
+
+    struct Frame
+    {
+        std::unique_ptr<uint8_t[]> head; // fixed + variable header, plus payload when copied
+        size_t headLen = 0;
+        const uint8_t *payload = nullptr; // caller-owned payload for zero-copy frames
+        size_t payloadLen = 0;
+        size_t sent = 0;       // bytes handed to TCP
+        uint32_t endOffset = 0; // stream offset of the last byte, valid once fully sent
+        uint32_t sentAt = 0;
+        uint16_t packetId = 0;
+        uint8_t qos = 0;
+        bool acked = false; // PUBACK seen before the TCP ack
+        MqttDoneCallback done;
+
+        size_t total() const { return headLen + payloadLen; }
+    };
+
+    typedef std::vector<MqttDoneCallback> DoneList;
+
+    bool enqueuePublish(const char *topic, const uint8_t *payload, size_t length, bool retain, uint8_t qos, bool copy, MqttDoneCallback done);
+    void enqueue(Frame &&frame, bool front = false);
+    void enqueueControl(uint8_t type, const uint8_t *body, size_t length, bool front = false);
+    void sendConnect();
+    void flush();
+
+    void handleTcpConnect();
+    void handleTcpDisconnect();
+    void handleAck(size_t len);
+    void handleData(const uint8_t *data, size_t len);
+    void handlePacket(uint8_t header, const uint8_t *body, size_t length);
+
+    void dropFrames(DoneList &dropped);
+    static void runDone(DoneList &list, bool delivered);
+
+    void lock() const;
+    void unlock() const;
+
+    AsyncClient _client;
+    SemaphoreHandle_t _mutex;
+
+    String _host;
+    uint16_t _port = 1883;
+    String _clientId;
+    String _user;
+    String _pass;
+    String _willTopic;
+    String _willPayload;
+    bool _willRetain = false;
+    uint8_t _willQos = 0;
+    uint16_t _keepAlive = 60;
+
+    volatile ConnState _state = DISCONNECTED;
+
+    std::deque<Frame> _outbox;   // waiting to be written
+    std::deque<Frame> _unacked;  // written, waiting for the TCP ack
+    std::deque<Frame> _inflight; // QoS 1, waiting for PUBACK
+    size_t _queuedBytes = 0;
+    size_t _qosPending = 0; // QoS 1 publishes not yet acknowledged by PUBACK
+
+    uint32_t _streamSent = 0;
+    uint32_t _streamAcked = 0;
+    uint16_t _nextPacketId = 1;
+
+    uint32_t _lastTx = 0;
+    uint32_t _lastRx = 0;
+    bool _pingOutstanding = false;
+
+    std::vector<uint8_t> _rx;
+
+    MqttConnectCallback _connectCb;
+    MqttMessageCallback _messageCb;
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "settle.h"
+
+// The zero is followed only while the settled reading is within the capture
+// band, and by at most the tracking rate
+constexpr float AUTOZERO_DEFAULT_BAND_G = 0.3f;
+constexpr float AUTOZERO_MAX_BAND_G = 2.0f;
+constexpr float AUTOZERO_DEFAULT_RATE_GPS = 0.02f;
+constexpr float AUTOZERO_MAX_RATE_GPS = 0.5f;
+
+// The pre-grind tare is skipped if the tracked zero read within this tolerance
+// no longer ago than AUTOZERO_FRESH_MS
+constexpr float AUTOZERO_SKIP_TARE_G = 0.05f;
+constexpr uint32_t AUTOZERO_FRESH_MS = 2000;
+
+struct AutoZeroConfig
+{
+    bool enabled;
+    float bandG;
+    float rateGps;
+};
+
+struct AutoZeroStatus
+{
+    float driftG;       // zero correction since the last tare
+    float driftRateGpm; // average over the time since the last tare, g/min
+    bool atZero;        // settled inside the capture band right now
+};
+
+void autoZeroConfigure(const AutoZeroConfig &config);
+AutoZeroConfig autoZeroConfig();
+
+// Called by the scale task for every sample while holding the scale lock;
+// returns the counts to add to the tare offset. allowed is false while grinding.
+long autoZeroStep(float grams, const SettleState &settle, long offset, float countsPerGram, uint32_t timeMs, bool allowed);
+// An explicit tare starts a new drift estimate
+void autoZeroTared(uint32_t timeMs);
+bool autoZeroCanSkipTare(uint32_t timeMs);
+AutoZeroStatus autoZeroStatus(uint32_t timeMs);
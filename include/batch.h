@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+// Doses per batch
+constexpr uint8_t BATCH_MAX_JOBS = 20;
+
+// Job with an explicit target instead of a preset
+constexpr uint8_t BATCH_NO_PRESET = 0xFF;
+
+enum BatchJobStatus : uint8_t
+{
+    BATCH_JOB_PENDING,
+    BATCH_JOB_GRINDING,
+    BATCH_JOB_DONE,
+    BATCH_JOB_ABORTED,
+};
+
+enum BatchPhase : uint8_t
+{
+    BATCH_NONE,         // no batch running
+    BATCH_WAIT_REMOVAL, // the finished dose is still on the scale
+    BATCH_WAIT_CUP,     // waiting for the next cup
+    BATCH_ARMED,        // cup tared, about to start
+    BATCH_GRINDING,
+};
+
+struct BatchJob
+{
+    uint16_t target; // 0.1 g, like the presets
+    uint8_t preset;  // preset table index or BATCH_NO_PRESET
+    BatchJobStatus status;
+    int16_t actual; // 0.01 g
+    uint32_t durationMs;
+};
+
+// Parse {"count": 5, "preset": "left"}, {"count": 3, "target": 18.0},
+// {"jobs": ["left", 18.0, {"preset": 2}, "Espresso"]} or a bare count of the
+// selected preset; presets are the button favourites, table indexes or names.
+// Returns an error message, nullptr on success.
+const char *batchFromJson(JsonVariantConst body, uint8_t selectedPreset, BatchJob *jobs, uint8_t *count);
+
+// Replaces a finished batch; false while one is running
+bool batchSubmit(const BatchJob *jobs, uint8_t count, BatchPhase phase);
+void batchCancel();
+bool batchActive();
+
+BatchPhase batchPhase();
+void batchSetPhase(BatchPhase phase);
+
+// Job being ground or next to grind
+bool batchCurrentJob(BatchJob *job);
+void batchJobStarted();
+// An incomplete job aborts the rest of the batch
+void batchJobFinished(int16_t actualCg, uint32_t durationMs, bool completed);
+
+// Progress and results of the current or last batch
+void batchToJson(JsonObject out);
+// Changes whenever the batch or one of its jobs changed
+uint32_t batchRevision();
+// 1-based number of the current job and the job count, 0/0 without a batch
+void batchProgress(uint8_t *current, uint8_t *count);
+
+const char *batchPhaseToString(BatchPhase phase);
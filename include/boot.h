@@ -0,0 +1,23 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Milestones from power-on to the first grind, in the order they usually occur
+enum BootPhase
+{
+    BOOT_SETUP,           // setup() entered
+    BOOT_DISPLAY,         // display initialised
+    BOOT_GRIND_READY,     // buttons, motor and scale running; grinding possible
+    BOOT_NETWORK_STARTED, // web server, OTA and MQTT client started
+    BOOT_WIFI_CONNECTED,
+    BOOT_MQTT_CONNECTED,
+    BOOT_TARE_VERIFIED,   // restored tare offset checked against the scale
+    BOOT_FIRST_GRIND,
+    BOOT_PHASE_COUNT
+};
+
+// Record the time of a phase; only the first call per phase counts
+void bootMark(BootPhase phase);
+// Milliseconds since power-on, 0 if the phase was not reached yet
+uint32_t bootTimestamp(BootPhase phase);
+const char *bootPhaseName(BootPhase phase);
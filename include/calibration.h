@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Reference weights per calibration, in addition to the zero point taken by the tare
+constexpr uint8_t CALIBRATION_MAX_POINTS = 8;
+
+// Re-measuring a reference within this distance replaces the earlier point
+constexpr float CALIBRATION_SAME_WEIGHT_G = 0.05f;
+
+// The fit minimises relative error, so 10 g counts as much as 100 g; below
+// this weight the error is treated as absolute
+constexpr float CALIBRATION_RELATIVE_FLOOR_G = 5.0f;
+
+// Heaviest reference the fixed-point model can represent
+constexpr float CALIBRATION_MAX_WEIGHT_G = 2000.0f;
+
+// All models pass through the tare point, which is measured rather than fitted
+enum CalibrationMode : uint8_t
+{
+    CALIBRATION_LINEAR,    // gain
+    CALIBRATION_QUADRATIC, // gain + curvature
+    CALIBRATION_TABLE,     // piecewise linear through every point
+};
+
+struct CalibrationPoint
+{
+    int32_t counts; // HX711 counts relative to the tare
+    float grams;    // reference weight
+    float residual; // g, model minus reference; leave-one-out for a table
+};
+
+// Snapshot of the active calibration for the API
+struct CalibrationInfo
+{
+    CalibrationMode mode;
+    uint8_t count;
+    CalibrationPoint points[CALIBRATION_MAX_POINTS];
+    int32_t zeroCounts; // raw reading of the empty scale when calibrated
+    float gain;         // g per count at zero load
+    float curvature;    // g per count^2
+    float rmsResidual;
+    float maxResidual;
+};
+
+// Loads the stored model; without one, falls back to the single legacy factor (counts/g)
+void setupCalibration(float legacyCountsPerGram);
+
+// Evaluate the active model in fixed point; net = raw - tare offset
+int32_t calibrationMicrograms(int32_t net);
+float calibrationGrams(int32_t net);
+// Slope at zero load, kept as the classic scale factor
+float calibrationCountsPerGram();
+CalibrationInfo calibrationInfo();
+
+// In-field session: begin with the tare just taken, add measured points, fit.
+// Failing calls return an error message and leave the active model untouched.
+void calibrationBegin(int32_t zeroCounts, bool keepPoints);
+const char *calibrationAddPoint(int32_t counts, float grams);
+const char *calibrationFit(CalibrationMode mode);
+uint8_t calibrationPendingPoints();
+
+const char *calibrationModeToString(CalibrationMode mode);
+bool calibrationModeFromString(const char *name, CalibrationMode *mode);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "settle.h"
+
+// Anything lighter is not taken for a cup
+constexpr float CUP_DEFAULT_MIN_WEIGHT_G = 30.0f;
+constexpr float CUP_MIN_WEIGHT_LOW_G = 5.0f;
+constexpr float CUP_MIN_WEIGHT_HIGH_G = 500.0f;
+
+// Time between the tare after placing a cup and the automatic start
+constexpr uint16_t CUP_DEFAULT_ARM_DELAY_MS = 1500;
+constexpr uint16_t CUP_MAX_ARM_DELAY_MS = 10000;
+
+// Consecutive samples below half the cup weight that count as a removal
+constexpr uint8_t CUP_REMOVE_SAMPLES = 2;
+
+struct CupDetectConfig
+{
+    bool enabled;
+    float minWeightG;
+    uint16_t armDelayMs;
+};
+
+enum CupEvent : uint8_t
+{
+    CUP_NONE,
+    CUP_PLACED,  // step up that has settled
+    CUP_REMOVED, // step down, reported without waiting for settle
+};
+
+void cupDetectConfigure(const CupDetectConfig &config);
+CupDetectConfig cupDetectConfig();
+
+// Called by the scale task for every sample
+void cupDetectPush(int32_t raw, const SettleState &settle, float countsPerGram);
+// Latest event since the last call, whether or not the auto-start mode is enabled
+CupEvent cupDetectTakeEvent();
+bool cupDetectPresent();
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "presets.h"
+
+// One entry per slot of the preset table
+constexpr uint8_t STATS_PRESETS = PRESET_MAX_COUNT;
+
+// Dose error histogram: -2.00 ... +2.00 g in 0.05 g bins, plus one bin below and above
+constexpr int16_t STATS_ERROR_MIN_CG = -200;
+constexpr int16_t STATS_ERROR_BIN_CG = 5;
+constexpr uint8_t STATS_ERROR_BINS = 80;
+
+// Grind time histogram: 0 ... 60 s in 0.5 s bins, plus one bin above
+constexpr uint16_t STATS_TIME_BIN_MS = 500;
+constexpr uint8_t STATS_TIME_BINS = 120;
+
+// Statistics are written to NVS after this many grinds
+constexpr uint8_t STATS_PERSIST_GRINDS = 5;
+
+// Summary of all finished grinds of one preset
+struct DoseStatsSummary
+{
+    uint32_t count;
+    float errorMean; // g, final weight - target
+    float errorStddev;
+    float errorP50;
+    float errorP95;
+    float errorP99;
+    float timeMean; // s
+    float timeStddev;
+    float timeP50;
+    float timeP95;
+    float timeP99;
+};
+
+void setupDoseStats();
+void doseStatsRecord(uint8_t preset, int32_t errorCg, uint32_t durationMs);
+DoseStatsSummary doseStatsSummary(uint8_t preset);
+// Move the statistics along with a rearranged preset table: entry i was at
+// previous[i], or is PRESET_NEW and starts empty; slots past count are cleared
+void doseStatsRemap(const uint8_t *previous, uint8_t count);
+// Changes whenever a grind was recorded or the preset table rearranged
+uint32_t doseStatsRevision();
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Number of grind events kept while the broker is unreachable
+constexpr uint8_t EVENT_QUEUE_SIZE = 16;
+
+// One completed grind, stored as a fixed-size record in NVS
+struct GrindEvent
+{
+    uint32_t seq;        // monotonically increasing, 0 = empty slot
+    uint32_t timestamp;  // Unix time, 0 while the clock is not synced
+    uint32_t durationMs;
+    uint32_t ackedSeq;   // highest sequence acknowledged by the broker when written
+    uint16_t target;     // 0.1 g, like the presets
+    int16_t actual;      // 0.01 g
+    uint8_t preset;      // preset table index
+    uint8_t reserved[3];
+};
+
+void setupEventQueue();
+void eventQueuePush(GrindEvent event);
+void loopEventQueue();
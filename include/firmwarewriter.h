@@ -0,0 +1,130 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Update.h>
+
+#include <esp32/rom/miniz.h>
+
+// Flash erase unit; uploads are handed to the flash in blocks of this size
+constexpr size_t FIRMWARE_SECTOR_SIZE = 4096;
+
+// Longest gzip header (with file name or comment) we are willing to skip
+constexpr size_t GZIP_MAX_HEADER = 128;
+
+// Feeds a firmware image into the inactive OTA slot.
+//
+// Images starting with the gzip magic are inflated while they arrive, using
+// the ROM inflater with a fixed TINFL_LZ_DICT_SIZE (32 KB) window, so the
+// compressed image never has to be held in memory. Anything else is written
+// unchanged.
+class FirmwareWriter
+{
+public:
+    ~FirmwareWriter();
+
+    // `size` is the transfer size, used as the image size for raw images
+    void begin(size_t size = UPDATE_SIZE_UNKNOWN);
+    bool write(const uint8_t *data, size_t len);
+    bool end();
+    void abort();
+
+    bool compressed() const { return _mode == GZIP; }
+    bool failed() const { return _error != nullptr; }
+    const char *error() const { return _error ? _error : ""; }
+    size_t received() const { return _received; }
+    size_t written() const { return _written; }
+
+private:
+    enum Mode
+    {
+        DETECT,
+        RAW,
+        GZIP
+    };
+
+    enum GzipStage
+    {
+        GZ_HEADER,
+        GZ_DEFLATE,
+        GZ_TRAILER,
+        GZ_DONE
+    };
+
+    bool start();
+    bool flash(const uint8_t *data, size_t len);
+    bool inflate(const uint8_t *data, size_t len);
+    bool fail(const char *error);
+    void release();
+
+    Mode _mode = DETECT;
+    GzipStage _stage = GZ_HEADER;
+    size_t _size = UPDATE_SIZE_UNKNOWN;
+    size_t _received = 0;
+    size_t _written = 0;
+    const char *_error = nullptr;
+
+    // Magic bytes, gzip header and trailer are collected here across writes
+    uint8_t _head[GZIP_MAX_HEADER];
+    size_t _headLen = 0;
+
+    tinfl_decompressor *_inflator = nullptr;
+    uint8_t *_dict = nullptr;
+    size_t _dictOfs = 0;
+    uint32_t _crc = 0;
+};
+
+struct FirmwareWriteStats
+{
+    size_t received;    // bytes accepted from the network
+    size_t written;     // bytes written to flash (after inflating)
+    uint32_t elapsedMs; // since begin()
+    uint32_t flashMs;   // time spent in the flash writer
+    uint32_t stalls;    // times the receiver had to wait for a free buffer
+};
+
+// FirmwareWriter behind two sector-sized buffers and its own task.
+//
+// write() only copies into the current buffer; full buffers are written to
+// flash by the task while the next one is being filled, so flash erase and
+// program time overlaps with reception instead of adding to it.
+class BufferedFirmwareWriter
+{
+public:
+    void begin(size_t size = UPDATE_SIZE_UNKNOWN);
+    bool write(const uint8_t *data, size_t len);
+    bool end();
+    // Drop an unfinished upload and release the update partition
+    void abort();
+
+    bool failed() const { return _writer.failed(); }
+    const char *error() const { return _writer.error(); }
+    FirmwareWriteStats stats() const;
+
+private:
+    struct Block
+    {
+        uint8_t data[FIRMWARE_SECTOR_SIZE];
+        size_t len;
+    };
+
+    static constexpr uint8_t BLOCK_STOP = 0xFF;
+
+    static void writerTask(void *pvParameters);
+    void submit();
+    void stopTask();
+
+    FirmwareWriter _writer;
+    Block _blocks[2];
+    int8_t _fill = -1;  // block being filled, -1 = none
+    uint8_t _next = 0;  // block to take next
+
+    QueueHandle_t _full = nullptr;       // block indices ready for flash
+    SemaphoreHandle_t _free = nullptr;   // counts blocks available for filling
+    SemaphoreHandle_t _stopped = nullptr;
+    TaskHandle_t _task = nullptr;
+
+    size_t _received = 0;
+    uint32_t _startMs = 0;
+    volatile uint32_t _flashMs = 0;
+    uint32_t _stalls = 0;
+};
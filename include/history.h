@@ -0,0 +1,63 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+
+// A segment is closed once it reaches this size; the oldest one is deleted beyond the cap
+constexpr size_t HISTORY_SEGMENT_SIZE = 16 * 1024;
+constexpr uint8_t HISTORY_MAX_SEGMENTS = 16;
+// Records per /api/v1/history page
+constexpr uint16_t HISTORY_PAGE_SIZE = 50;
+constexpr uint16_t HISTORY_PAGE_MAX = 200;
+
+enum GrindEndReason : uint8_t
+{
+    GRIND_END_FINISHED,
+    GRIND_END_EMPTY,
+    GRIND_END_PAUSED,
+    GRIND_END_BURST_LIMIT // pulse finishing gave up short of the target
+};
+
+// One grind as stored on LittleFS (little endian, packed, append only)
+struct __attribute__((packed)) GrindRecord
+{
+    uint32_t seq;        // assigned by historyAppend, increasing across segments
+    uint32_t timestamp;  // Unix time, 0 while the clock is not synced
+    uint32_t durationMs;
+    uint16_t target;     // 0.1 g, like the presets
+    int16_t actual;      // 0.01 g
+    int16_t overshoot;   // actual - target, 0.01 g
+    uint16_t peakFlow;   // 0.01 g/s
+    uint8_t preset;      // preset table index
+    uint8_t reason;      // GrindEndReason
+    uint8_t version;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(GrindRecord) == 24, "GrindRecord is part of the file format");
+
+void setupHistory();
+void historyAppend(GrindRecord record);
+const char *grindEndReasonToString(uint8_t reason);
+
+// Walks the stored records in order without loading a segment into RAM.
+// Records written while reading are picked up.
+class HistoryReader
+{
+public:
+    // Only records with seq > afterSeq; from/to are Unix times, 0 = open,
+    // records without timestamp are skipped if either bound is set
+    HistoryReader(uint32_t afterSeq, uint32_t from, uint32_t to);
+
+    bool next(GrindRecord &record);
+
+private:
+    bool openNextSegment();
+    bool matches(const GrindRecord &record) const;
+
+    File _file;
+    uint32_t _segment;
+    uint32_t _afterSeq;
+    uint32_t _from;
+    uint32_t _to;
+};
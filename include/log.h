@@ -0,0 +1,74 @@
+#pragma once
+
+#include <Arduino.h>
+
+#ifndef ENABLE_LOGGING
+#define ENABLE_LOGGING true
+#endif
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+// Messages above this level are compiled out
+#ifndef LOG_LEVEL
+#if ENABLE_LOGGING
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#else
+#define LOG_LEVEL LOG_LEVEL_NONE
+#endif
+#endif
+
+// Log calls never block: messages are copied into a lock-free ring and written
+// to Serial and telnet by a low-priority task. If the ring is full the message
+// is dropped and counted. LOG/LOGF log at info level.
+#if LOG_LEVEL > LOG_LEVEL_NONE
+void logPrint();
+void logPrint(const String &msg);
+void logPrint(const __FlashStringHelper *msg);
+void logPrint(const char *msg);
+void logPrintf(const char *fmt, ...);
+void logPrintLevel(uint8_t level, const char *fmt, ...);
+
+#define LOG(...) logPrint(__VA_ARGS__)
+#define LOGF(fmt, ...) logPrintf((fmt), ##__VA_ARGS__)
+#else
+#define LOG(...)
+#define LOGF(fmt, ...)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOGE(fmt, ...) logPrintLevel(LOG_LEVEL_ERROR, (fmt), ##__VA_ARGS__)
+#else
+#define LOGE(fmt, ...)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOGW(fmt, ...) logPrintLevel(LOG_LEVEL_WARN, (fmt), ##__VA_ARGS__)
+#else
+#define LOGW(fmt, ...)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOGI(fmt, ...) logPrintLevel(LOG_LEVEL_INFO, (fmt), ##__VA_ARGS__)
+#else
+#define LOGI(fmt, ...)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOGD(fmt, ...) logPrintLevel(LOG_LEVEL_DEBUG, (fmt), ##__VA_ARGS__)
+#else
+#define LOGD(fmt, ...)
+#endif
+
+// Start the drain task; call right after Serial.begin()
+void setupLog();
+// Accept telnet log clients on port 23 once the network is up
+void startLogServer();
+
+// Runtime filter below the compile-time LOG_LEVEL
+void logSetLevel(uint8_t level);
+uint8_t logGetLevel();
+uint32_t logDropped();
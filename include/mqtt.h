@@ -2,8 +2,12 @@
 
 #include <Arduino.h>
 
+#ifndef MQTT_BENCHMARK
+#define MQTT_BENCHMARK false
+#endif
+
 void setupMqtt();
-void publishConfigsForHA();
 void loopMqtt();
+void mqttGetConfig(String &server, uint16_t &port, String &user);
 
 void mqttPublishState();
\ No newline at end of file
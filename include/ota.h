@@ -2,4 +2,40 @@
 
 #include <ArduinoOTA.h>
 
-void setupOTA();
\ No newline at end of file
+// Release manifest queried by the auto-update, in GitHub release API format
+#define OTA_DEFAULT_SOURCE "https://api.github.com/repos/danyial/CoffeeGrinder/releases/latest"
+
+// Firmware is downloaded, hashed and written one flash sector at a time
+constexpr size_t OTA_CHUNK_SIZE = 4096;
+// Abort the download if no data arrived for this long
+constexpr unsigned long OTA_STALL_TIMEOUT_MS = 15000;
+
+enum OtaPhase
+{
+    OTA_IDLE,
+    OTA_CHECKING,
+    OTA_DOWNLOADING,
+    OTA_VERIFYING,
+    OTA_DONE,
+    OTA_UP_TO_DATE,
+    OTA_FAILED
+};
+
+struct OtaStatus
+{
+    OtaPhase phase;
+    uint32_t written;
+    uint32_t total;
+    char version[24];
+    char error[48];
+};
+
+void setupOTA();
+
+// Start the background auto-update; false if the grinder is busy
+bool otaStartUpdate();
+OtaStatus otaGetStatus();
+const char *otaPhaseToString(OtaPhase phase);
+
+String otaGetSource();
+void otaSetSource(const String &url);
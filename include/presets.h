@@ -0,0 +1,87 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#include "profile.h"
+#include "types.h"
+
+constexpr uint8_t PRESET_MAX_COUNT = 8;
+// Including the terminator
+constexpr uint8_t PRESET_NAME_SIZE = 16;
+
+// Motor profile of a new preset, the one all presets shared before the table
+constexpr uint16_t PRESET_DEFAULT_MAX_THROTTLE = 1200;
+constexpr uint16_t PRESET_DEFAULT_SLOW_THROTTLE = PRESET_DEFAULT_MAX_THROTTLE / 2;
+constexpr uint16_t PRESET_DEFAULT_SLOWDOWN_CG = 70;
+
+// Entry of a replaced table that has no counterpart in the old one
+constexpr uint8_t PRESET_NEW = 0xFF;
+
+// Accepted DShot throttle and slowdown window
+constexpr uint16_t PRESET_MIN_THROTTLE = 100;
+constexpr uint16_t PRESET_MAX_THROTTLE = 2047;
+constexpr uint16_t PRESET_MAX_SLOWDOWN_CG = 1000;
+
+// Share of a grind's error added to the compensation, and its range
+constexpr float PRESET_LEARN_RATE = 0.3f;
+constexpr int16_t PRESET_MAX_COMPENSATION_CG = 300;
+// Learned compensation is written to NVS after this many grinds
+constexpr uint8_t PRESET_PERSIST_GRINDS = 5;
+
+enum PresetCurve : uint8_t
+{
+    PRESET_CURVE_STEP,   // slow throttle as soon as the slowdown window is reached
+    PRESET_CURVE_LINEAR, // throttle falls linearly through the slowdown window
+};
+
+struct Preset
+{
+    char name[PRESET_NAME_SIZE];
+    uint16_t target;        // 0.1 g
+    uint16_t maxThrottle;   // DShot throttle before the slowdown
+    uint16_t slowThrottle;  // DShot throttle at the stop point
+    uint16_t slowdownCg;    // slowdown window before the stop point, 0.01 g
+    PresetCurve curve;
+    bool learn;             // adapt the compensation after every grind
+    int16_t compensationCg; // the motor stops this much early for the grounds still falling
+    uint8_t profile;        // grind profile slot replacing the throttle settings, or PROFILE_NONE
+    uint8_t reserved;
+};
+
+// Loads the table; on first boot it is made from the two fixed presets of older firmware
+void setupPresets(uint16_t legacyLeft, uint16_t legacyRight);
+
+uint8_t presetCount();
+// Copy of an entry, false if index is past the table
+bool presetGet(uint8_t index, Preset *preset);
+Preset presetDefaults();
+
+// Replace the whole table; returns an error message, nullptr on success.
+// Entries are matched to the old table by name, and the favourites, statistics
+// and burst yields kept per table index follow them; a new name starts from
+// scratch. previous receives the old index of every slot, or PRESET_NEW.
+const char *presetsReplace(const Preset *presets, uint8_t count, uint8_t *previous);
+// Target of a single entry, e.g. from the buttons; clamped to the preset range
+void presetSetTarget(uint8_t index, uint16_t target);
+
+// Table entry behind the left (SMALL) or right (LARGE) button
+uint8_t presetFavourite(PresetSelection button);
+void presetSetFavourite(PresetSelection button, uint8_t index);
+
+// Throttle with gramsRemaining left to the stop point
+uint16_t presetThrottle(const Preset &preset, float gramsRemaining);
+// Error of a grind that stopped at the compensated point, final weight - target
+void presetLearn(uint8_t index, int32_t errorCg);
+
+// Write the table to NVS if it changed since the last commit
+void presetsCommit();
+// Changes whenever an entry or a favourite changed
+uint32_t presetsRevision();
+
+void presetToJson(const Preset &preset, JsonObject out);
+// Fields left out keep their value in preset; returns an error message, nullptr on success
+const char *presetFromJson(JsonVariantConst value, Preset *preset);
+
+const char *presetCurveToString(PresetCurve curve);
+bool presetCurveFromString(const char *text, PresetCurve *curve);
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+constexpr uint8_t PROFILE_MAX_COUNT = 4;
+constexpr uint8_t PROFILE_MAX_POINTS = 8;
+// Including the terminator
+constexpr uint8_t PROFILE_NAME_SIZE = 16;
+// Preset without a profile, driven by its own throttle settings
+constexpr uint8_t PROFILE_NONE = 0xFF;
+
+// Cells of the compiled lookup table over the profile's range
+constexpr uint8_t PROFILE_LUT_CELLS = 64;
+
+// Flow output: throttle change per second and g/s of flow error
+constexpr float PROFILE_FLOW_GAIN = 1000.0f;
+constexpr uint16_t PROFILE_MAX_FLOW_CGPS = 1000;
+// Pulse on and off times, 10 ms steps
+constexpr uint16_t PROFILE_MIN_PULSE_MS = 10;
+constexpr uint16_t PROFILE_MAX_PULSE_MS = 2550;
+
+enum ProfileAxis : uint8_t
+{
+    PROFILE_AXIS_REMAINING, // grams left to the stop point
+    PROFILE_AXIS_ELAPSED,   // time since the grind started
+};
+
+enum ProfileOutput : uint8_t
+{
+    PROFILE_OUTPUT_THROTTLE, // DShot throttle
+    PROFILE_OUTPUT_FLOW,     // target flow, the throttle follows it
+};
+
+struct ProfilePoint
+{
+    uint16_t at;      // 0.01 g remaining or 10 ms elapsed, ascending
+    uint16_t value;   // DShot throttle or 0.01 g/s
+    uint8_t pulseOn;  // 10 ms; 0 runs continuously up to the next point
+    uint8_t pulseOff; // 10 ms
+};
+
+struct GrindProfile
+{
+    char name[PROFILE_NAME_SIZE];
+    ProfileAxis axis;
+    ProfileOutput output;
+    uint8_t count; // 0 for an empty slot
+    ProfilePoint points[PROFILE_MAX_POINTS];
+};
+
+// Lookup form of a profile: each cell names the segment at its start, and the
+// value is interpolated from the exact breakpoints, so a control tick costs the
+// same whatever the number of breakpoints and boundaries are not quantized
+struct CompiledProfile
+{
+    ProfileAxis axis;
+    ProfileOutput output;
+    uint8_t count;
+    uint16_t cellWidth; // axis units per cell
+    ProfilePoint points[PROFILE_MAX_POINTS];
+    uint8_t segments[PROFILE_LUT_CELLS]; // last point at or before the cell start, 0 before the first
+};
+
+// State of one grind, reset with profileStart()
+struct ProfileRun
+{
+    float throttle; // flow controller
+    uint32_t lastMs;
+    uint32_t pulseSinceMs;
+    bool pulsing;
+};
+
+struct ProfileCommand
+{
+    uint16_t throttle; // 0 while a pulse is off
+    bool pulse;        // switch at once instead of ramping
+};
+
+void setupProfiles();
+
+// Copy of a slot, false if it is empty
+bool profileGet(uint8_t slot, GrindProfile *profile);
+bool profileCompiled(uint8_t slot, CompiledProfile *compiled);
+// Validates, compiles and stores a profile; an empty profile clears the slot.
+// Returns an error message, nullptr on success.
+const char *profilePut(uint8_t slot, const GrindProfile &profile);
+
+void profileStart(ProfileRun &run, uint16_t startThrottle, uint32_t nowMs);
+// Called per control tick; throttles are limited to minThrottle ... maxThrottle
+ProfileCommand profileEvaluate(const CompiledProfile &profile, float remainingG, float flowGps, uint32_t nowMs,
+                               uint32_t elapsedMs, uint16_t minThrottle, uint16_t maxThrottle, ProfileRun &run);
+
+// {"name": ..., "axis": "remaining", "output": "throttle", "points": [[at, value], [at, value, onMs, offMs]]}
+// with at in g or s and value a throttle or g/s. Returns an error message, nullptr on success.
+const char *profileFromJson(JsonVariantConst value, GrindProfile *profile);
+void profileToJson(const GrindProfile &profile, JsonObject out);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "presets.h"
+
+// Grams before the target where continuous grinding hands over to bursts
+constexpr float PULSE_DEFAULT_BAND_G = 0.5f;
+constexpr float PULSE_MAX_BAND_G = 3.0f;
+
+// Length of one burst at the preset's slow throttle
+constexpr uint16_t PULSE_DEFAULT_MS = 80;
+constexpr uint16_t PULSE_MIN_MS = 20;
+constexpr uint16_t PULSE_MAX_MS = 500;
+
+// Yield of a burst before anything was learned, and the range it is kept in
+constexpr float PULSE_DEFAULT_GRAMS = 0.05f;
+constexpr float PULSE_MIN_GRAMS = 0.005f;
+constexpr float PULSE_MAX_GRAMS = 1.0f;
+// Share of a burst's measured yield taken into the learned yield
+constexpr float PULSE_LEARN_RATE = 0.3f;
+// Learned yields are written to NVS after this many bursts
+constexpr uint8_t PULSE_PERSIST_PULSES = 20;
+
+// A burst that adds less than this counts as dry; this many in a row, or more
+// bursts than PULSE_MAX_COUNT, take the hopper for empty
+constexpr float PULSE_DRY_G = 0.01f;
+constexpr uint8_t PULSE_MAX_DRY = 3;
+constexpr uint8_t PULSE_MAX_COUNT = 40;
+
+struct PulseFinishConfig
+{
+    bool enabled;
+    float bandG;
+    uint16_t pulseMs;
+};
+
+// Loads the learned yields
+void setupPulseFinish();
+
+// A new burst length invalidates the learned yields
+void pulseFinishConfigure(const PulseFinishConfig &config);
+PulseFinishConfig pulseFinishConfig();
+
+// Learned grams per burst of a preset table entry
+float pulseFinishGrams(uint8_t preset);
+// Another burst gets closer to the target than stopping with gramsRemaining left
+bool pulseFinishNeeded(uint8_t preset, float gramsRemaining);
+// Measured yield of one burst, weight settled after it minus settled before
+void pulseFinishLearn(uint8_t preset, float yieldG);
+// Move the learned yields along with a rearranged preset table, see doseStatsRemap()
+void pulseFinishRemap(const uint8_t *previous, uint8_t count);
+
+// Write the learned yields to NVS if they changed since the last commit
+void pulseFinishCommit();
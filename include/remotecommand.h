@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include "batch.h"
+#include "calibration.h"
+#include "presets.h"
+#include "types.h"
+
+// Commands that wait for the scale or change the grind state must not run in
+// the web server's or MQTT client's callbacks; they are queued for loop() instead
+constexpr uint8_t REMOTE_QUEUE_LENGTH = 4;
+
+enum RemoteCommandType : uint8_t
+{
+    REMOTE_START,             // start, or resume a paused or stalled grind
+    REMOTE_TARE,
+    REMOTE_FAVOURITE,         // select the favourite of a button, which tares
+    REMOTE_SELECT,            // select a table entry, which tares
+    REMOTE_CALIBRATE,         // tare the empty scale for a new calibration
+    REMOTE_CALIBRATION_POINT, // measure a reference and/or fit the points
+    REMOTE_BATCH,             // queue doses for the cup flow
+    REMOTE_PRESETS,           // move the selection along with a replaced preset table
+};
+
+struct RemoteCommand
+{
+    RemoteCommandType type;
+    PresetSelection button; // REMOTE_FAVOURITE
+    uint8_t preset;         // REMOTE_SELECT: table index; REMOTE_PRESETS: entry to select, PRESET_NEW to follow
+    bool start;             // REMOTE_FAVOURITE, REMOTE_SELECT: start grinding afterwards
+    bool keep;              // REMOTE_CALIBRATE: re-measure on top of the active points
+    bool finish;            // REMOTE_CALIBRATION_POINT: fit the points afterwards
+    float weight;           // REMOTE_CALIBRATION_POINT: known weight, 0 to only fit
+    CalibrationMode mode;   // REMOTE_CALIBRATION_POINT: model of the fit
+    uint8_t jobCount;       // REMOTE_BATCH, parsed by the caller
+    BatchJob jobs[BATCH_MAX_JOBS];
+    uint8_t previous[PRESET_MAX_COUNT]; // REMOTE_PRESETS, from presetsReplace()
+};
+
+// Implemented in main.cpp; false while the queue is full
+bool postRemoteCommand(const RemoteCommand &command);
+// Error of the last queued calibration step, nullptr if it succeeded
+const char *remoteCalibrationError();
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Changes are written once no further commit arrived for this long...
+constexpr uint32_t SETTINGS_QUIET_MS = 2000;
+// ...but no later than this after the first unwritten change
+constexpr uint32_t SETTINGS_MAX_DELAY_MS = 30000;
+// Distinct keys cached from the "coffee" namespace; the known keys in
+// settings.cpp must fit, further ones are written through
+constexpr uint8_t SETTINGS_MAX_KEYS = 24;
+
+// Start the background writer; call before the first settingsGet*/settingsPut*
+void setupSettings();
+
+// Read once from NVS, then served from RAM
+uint8_t settingsGetUChar(const char *key, uint8_t defaultValue);
+uint16_t settingsGetUShort(const char *key, uint16_t defaultValue);
+uint32_t settingsGetUInt(const char *key, uint32_t defaultValue);
+int32_t settingsGetLong(const char *key, int32_t defaultValue);
+float settingsGetFloat(const char *key, float defaultValue);
+
+// Update the cached value; the key is only marked dirty if the value changed
+void settingsPutUChar(const char *key, uint8_t value);
+void settingsPutUShort(const char *key, uint16_t value);
+void settingsPutUInt(const char *key, uint32_t value);
+void settingsPutLong(const char *key, int32_t value);
+void settingsPutFloat(const char *key, float value);
+
+// Schedule dirty keys to be written after the quiet period
+void settingsCommit();
+// Write dirty keys now, e.g. before a restart or firmware update
+void settingsFlush();
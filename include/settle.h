@@ -0,0 +1,33 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Samples the verdict is computed over
+constexpr uint8_t SETTLE_WINDOW = 8;
+// Stable means both the noise and the trend over the window are below these
+constexpr float SETTLE_MAX_STDDEV_G = 0.05f;
+constexpr float SETTLE_MAX_SLOPE_GPS = 0.1f;
+// A wait only succeeds after this many samples taken since it started
+constexpr uint8_t SETTLE_MIN_FRESH = 4;
+
+// Limits for the configurable maximum wait
+constexpr uint16_t SETTLE_DEFAULT_TIMEOUT_MS = 1500;
+constexpr uint16_t SETTLE_MIN_TIMEOUT_MS = 200;
+constexpr uint16_t SETTLE_MAX_TIMEOUT_MS = 5000;
+
+struct SettleState
+{
+    bool settled;
+    float stddev;    // g
+    float slope;     // g/s
+    float meanRaw;   // HX711 counts, averaged over the window
+    uint32_t sample; // number of samples seen so far
+};
+
+// Feed every HX711 conversion; countsPerGram is the current scale factor
+void settlePush(int32_t raw, uint32_t timeMs, float countsPerGram);
+SettleState settleState();
+
+// Block until the scale is stable or timeoutMs passed; the returned state is
+// the last one seen either way
+bool settleWait(uint32_t timeoutMs, SettleState *state = nullptr);
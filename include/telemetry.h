@@ -0,0 +1,20 @@
+#pragma once
+
+#include <ESPAsyncWebServer.h>
+
+constexpr uint8_t TELEMETRY_MIN_RATE_HZ = 1;
+constexpr uint8_t TELEMETRY_MAX_RATE_HZ = 50;
+
+// Live frame pushed to every WebSocket client on /ws (little endian, packed)
+struct __attribute__((packed)) TelemetryFrame
+{
+    uint8_t version;
+    uint8_t state;     // State enum value
+    uint16_t throttle; // DShot value, 0 when stopped
+    uint32_t timeMs;
+    float weight;      // g
+    float flow;        // g/s
+};
+
+void setupTelemetry(AsyncWebServer &server);
+void telemetryBroadcastText(const char *message);
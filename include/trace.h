@@ -0,0 +1,96 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+
+#ifndef ENABLE_TRACING
+#define ENABLE_TRACING true
+#endif
+
+// Records per core; captured until full, then further records are counted as dropped
+constexpr uint32_t TRACE_BUFFER_RECORDS = 1024;
+
+// Ids are part of the dump format, append only (see tools/trace2perfetto.py)
+enum TraceEvent : uint8_t
+{
+    TRACE_SYNC,           // arg0/arg1 = esp_timer time in us, low/high word
+    TRACE_LOOP,
+    TRACE_MOTOR_RAMP,     // arg0 = target throttle, arg1 = step
+    TRACE_DISPLAY_DRAW,   // arg0 = state
+    TRACE_MQTT_STATE,
+    TRACE_SCALE_READ,     // end: arg0 = raw counts, arg1 = weight in 0.01 g
+    TRACE_TARGET_REACHED, // arg0 = weight in 0.01 g, arg1 = target in 0.1 g
+    TRACE_SETTLED,        // arg0 = stddev in mg, arg1 = slope in mg/s
+    TRACE_EVENT_COUNT
+};
+
+enum TraceKind : uint8_t
+{
+    TRACE_BEGIN,
+    TRACE_END,
+    TRACE_INSTANT
+};
+
+// One record as stored and downloaded (little endian)
+struct __attribute__((packed)) TraceRecord
+{
+    uint32_t cycles; // CPU cycle counter of the recording core
+    uint8_t event;
+    uint8_t kind;
+    uint16_t reserved;
+    uint32_t arg0;
+    uint32_t arg1;
+};
+
+static_assert(sizeof(TraceRecord) == 16, "TraceRecord must stay 16 bytes");
+
+// Dump header; followed by counts[0] records of core 0, then counts[1] of core 1
+struct __attribute__((packed)) TraceDumpHeader
+{
+    char magic[4]; // "CGTR"
+    uint8_t version;
+    uint8_t cores;
+    uint16_t recordSize;
+    uint32_t cpuMhz;
+    uint32_t counts[2];
+    uint32_t dropped[2];
+};
+
+#if ENABLE_TRACING
+// Safe from any task or ISR; returns immediately unless the event is being captured
+void traceWrite(TraceEvent event, TraceKind kind, uint32_t arg0 = 0, uint32_t arg1 = 0);
+#else
+inline void traceWrite(TraceEvent, TraceKind, uint32_t = 0, uint32_t = 0)
+{
+}
+#endif
+
+// Registers /trace/start and /trace
+void setupTrace(AsyncWebServer &server);
+
+// Begin/end pair around a scope; result() sets the arguments of the end record
+class TraceSpan
+{
+public:
+    explicit TraceSpan(TraceEvent event, uint32_t arg0 = 0, uint32_t arg1 = 0)
+        : _event(event)
+    {
+        traceWrite(event, TRACE_BEGIN, arg0, arg1);
+    }
+
+    ~TraceSpan()
+    {
+        traceWrite(_event, TRACE_END, _arg0, _arg1);
+    }
+
+    void result(uint32_t arg0, uint32_t arg1 = 0)
+    {
+        _arg0 = arg0;
+        _arg1 = arg1;
+    }
+
+private:
+    TraceEvent _event;
+    uint32_t _arg0 = 0;
+    uint32_t _arg1 = 0;
+};
@@ -2,23 +2,11 @@
 
 #include <Arduino.h>
 
-#ifndef ENABLE_LOGGING
-#define ENABLE_LOGGING true
-#endif
+#include "log.h"
 
-#if ENABLE_LOGGING
-void logPrint();
-void logPrint(const String &msg);
-void logPrint(const __FlashStringHelper *msg);
-void logPrint(const char *msg);
-void logPrintf(const char *fmt, ...);
-
-#define LOG(...) logPrint(__VA_ARGS__)
-#define LOGF(fmt, ...) logPrintf((fmt), ##__VA_ARGS__)
-#else
-#define LOG(...)
-#define LOGF(fmt, ...)
-#endif
+// Preset weights are stored in 0.1 g steps, 0.1 ... 180 g
+constexpr uint16_t MIN_PRESET_WEIGHT = 1;
+constexpr uint16_t MAX_PRESET_WEIGHT = 1800;
 
 enum PresetSelection {
     SMALL,
@@ -33,6 +21,7 @@ enum State
     IDLE,
     MEASURING,
     PAUSED,
+    PULSING,
     RUNNING,
     SAVING,
     SET_LEFT,
@@ -1,4 +1,4 @@
 #pragma once
 
-void startWifi();
-void setupWebServer();
\ No newline at end of file
+void setupWebServer();
+void startConfigPortal();
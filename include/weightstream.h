@@ -0,0 +1,29 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Samples per MQTT publish on the stream topic
+constexpr uint8_t STREAM_BATCH_SIZE = 20;
+
+// One scale sample as sent on the wire (little endian, packed)
+struct __attribute__((packed)) StreamSample
+{
+    uint32_t timeMs;
+    int32_t raw;       // HX711 counts
+    float weight;      // grams as used by the control loop
+    uint16_t throttle; // DShot value sent to the ESC
+};
+
+// Frame header; followed by `count` StreamSample entries
+struct __attribute__((packed)) StreamFrameHeader
+{
+    uint8_t version;
+    uint8_t count;
+    uint16_t seq;
+};
+
+void setWeightStreamEnabled(bool enabled);
+bool weightStreamEnabled();
+
+void streamPushSample(int32_t raw, float weight, uint16_t throttle);
+void loopWeightStream();
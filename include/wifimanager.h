@@ -0,0 +1,23 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Retry delays after a failed or lost connection double up to the maximum
+constexpr unsigned long WIFI_RETRY_MIN_MS = 500;
+constexpr unsigned long WIFI_RETRY_MAX_MS = 30000;
+// Give up on an attempt that produced neither an IP nor a disconnect event
+constexpr unsigned long WIFI_ATTEMPT_TIMEOUT_MS = 15000;
+
+struct WifiStats
+{
+    uint32_t bootConnectMs;  // boot until the first IP, 0 until connected
+    uint32_t reconnectMs;    // duration of the last reconnect
+    uint32_t reconnects;
+    uint32_t attempts;
+};
+
+// Start joining the stored network without blocking; opens the config
+// portal when no credentials are stored
+void startWifi();
+bool wifiConnected();
+WifiStats wifiGetStats();
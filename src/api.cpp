@@ -0,0 +1,957 @@
+#include <Arduino.h>
+
+#include <memory>
+
+#include "api.h"
+#include "boot.h"
+#include "dosestats.h"
+#include "autozero.h"
+#include "batch.h"
+#include "calibration.h"
+#include "cupdetect.h"
+#include "history.h"
+#include "settle.h"
+#include "ota.h"
+#include "presets.h"
+#include "profile.h"
+#include "pulsefinish.h"
+#include "remotecommand.h"
+#include "telemetry.h"
+#include "types.h"
+#include "version.h"
+#include "wifimanager.h"
+
+// -----------------------------------------------------------------------------
+// External state & APIs provided by the rest of the application
+// -----------------------------------------------------------------------------
+
+extern volatile State state;
+extern uint8_t selectedPreset;
+extern uint16_t remaining;
+extern float weight;
+extern float flowRate;
+extern float scaleFactor;
+extern float blockThreshold;
+extern uint8_t telemetryRateHz;
+extern uint16_t settleTimeoutMs;
+
+extern unsigned long presetSmallRuns;
+extern unsigned long presetLargeRuns;
+extern float totalWeight;
+
+extern String stateToString(State s);
+extern uint16_t motorThrottle();
+extern void savePreferences();
+extern void setState(State s);
+extern void cancelBatch();
+
+// -----------------------------------------------------------------------------
+// Request & response helpers
+// -----------------------------------------------------------------------------
+
+// Collect the request body into a single buffer owned by the request;
+// AsyncWebServer frees _tempObject together with the request.
+static void collectBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+    if (total > API_MAX_BODY_SIZE)
+    {
+        return;
+    }
+
+    if (index == 0)
+    {
+        request->_tempObject = malloc(total);
+    }
+
+    if (request->_tempObject && index + len <= total)
+    {
+        memcpy(static_cast<uint8_t *>(request->_tempObject) + index, data, len);
+    }
+}
+
+static bool parseBody(AsyncWebServerRequest *request, JsonDocument &body)
+{
+    size_t length = request->contentLength();
+    if (length == 0)
+    {
+        return true;
+    }
+
+    if (length > API_MAX_BODY_SIZE || !request->_tempObject)
+    {
+        apiSendError(request, 413, "body too large");
+        return false;
+    }
+
+    // Parse straight from the collected bytes without building a String
+    DeserializationError error = deserializeJson(body, static_cast<const char *>(request->_tempObject), length);
+    if (error)
+    {
+        apiSendError(request, 400, error.c_str());
+        return false;
+    }
+
+    if (!body.is<JsonObject>())
+    {
+        apiSendError(request, 400, "expected a JSON object");
+        return false;
+    }
+    return true;
+}
+
+void apiOnJson(AsyncWebServer &server, const char *path, WebRequestMethodComposite method, ApiJsonHandler handler)
+{
+    server.on(path, method, [handler](AsyncWebServerRequest *request) {
+        JsonDocument body;
+        if (parseBody(request, body))
+        {
+            handler(request, body);
+        }
+    }, nullptr, collectBody);
+}
+
+// Serialise directly into the response stream
+void apiSendJson(AsyncWebServerRequest *request, JsonDocument &doc, int code)
+{
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->setCode(code);
+    serializeJson(doc, *response);
+    request->send(response);
+}
+
+void apiSendError(AsyncWebServerRequest *request, int code, const char *message)
+{
+    JsonDocument doc;
+    doc["error"] = message;
+    apiSendJson(request, doc, code);
+}
+
+// Validate a preset in grams and convert it to the stored 0.1 g steps
+static bool targetFromJson(JsonVariant value, uint16_t &preset)
+{
+    if (!value.is<float>())
+    {
+        return false;
+    }
+
+    long steps = lroundf(value.as<float>() * 10.0f);
+    if (steps < MIN_PRESET_WEIGHT || steps > MAX_PRESET_WEIGHT)
+    {
+        return false;
+    }
+
+    preset = static_cast<uint16_t>(steps);
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Resources
+// -----------------------------------------------------------------------------
+
+// "left"/"right" for the favourite of a button, otherwise a table index
+static bool presetIndexFromJson(JsonVariant value, uint8_t count, uint8_t &index)
+{
+    if (value.is<const char *>())
+    {
+        const char *name = value.as<const char *>();
+        if (strcmp(name, "left") != 0 && strcmp(name, "right") != 0)
+        {
+            return false;
+        }
+        index = presetFavourite(strcmp(name, "left") == 0 ? SMALL : LARGE);
+        return true;
+    }
+
+    int number = value | -1;
+    index = static_cast<uint8_t>(number);
+    return value.is<int>() && number >= 0 && number < count;
+}
+
+static void writePresets(JsonDocument &doc)
+{
+    uint8_t left = presetFavourite(SMALL);
+    uint8_t right = presetFavourite(LARGE);
+    Preset preset;
+
+    doc["selected"] = selectedPreset;
+    doc["favourites"]["left"] = left;
+    doc["favourites"]["right"] = right;
+    doc["left"] = presetGet(left, &preset) ? preset.target / 10.0f : 0.0f;
+    doc["right"] = presetGet(right, &preset) ? preset.target / 10.0f : 0.0f;
+    doc["min"] = MIN_PRESET_WEIGHT / 10.0f;
+    doc["max"] = MAX_PRESET_WEIGHT / 10.0f;
+    doc["maxCount"] = PRESET_MAX_COUNT;
+
+    JsonArray table = doc["table"].to<JsonArray>();
+    for (uint8_t i = 0; presetGet(i, &preset); i++)
+    {
+        presetToJson(preset, table.add<JsonObject>());
+    }
+}
+
+static void writeSettings(JsonDocument &doc)
+{
+    doc["blockThreshold"] = blockThreshold;
+    doc["telemetryRate"] = telemetryRateHz;
+    doc["logLevel"] = logGetLevel();
+    doc["settleTimeout"] = settleTimeoutMs;
+
+    AutoZeroConfig autoZero = autoZeroConfig();
+    doc["autoZero"] = autoZero.enabled;
+    doc["zeroBand"] = autoZero.bandG;
+    doc["zeroRate"] = autoZero.rateGps;
+
+    CupDetectConfig cup = cupDetectConfig();
+    doc["cupDetect"] = cup.enabled;
+    doc["cupMinWeight"] = cup.minWeightG;
+    doc["cupArmDelay"] = cup.armDelayMs;
+
+    PulseFinishConfig pulse = pulseFinishConfig();
+    doc["pulseFinish"] = pulse.enabled;
+    doc["pulseBand"] = pulse.bandG;
+    doc["pulseMs"] = pulse.pulseMs;
+}
+
+static void registerStateRoutes(AsyncWebServer &server)
+{
+    server.on("/api/v1/state", HTTP_GET, [](AsyncWebServerRequest *request) {
+        JsonDocument doc;
+        doc["state"] = stateToString(state);
+        doc["weight"] = weight;
+        doc["flow"] = flowRate;
+        doc["throttle"] = motorThrottle();
+        doc["target"] = remaining / 10.0f;
+        doc["preset"] = selectedPreset;
+        doc["runs"]["left"] = presetSmallRuns;
+        doc["runs"]["right"] = presetLargeRuns;
+        doc["totalWeight"] = totalWeight;
+
+        AutoZeroStatus zero = autoZeroStatus(millis());
+        doc["zero"]["drift"] = zero.driftG;
+        doc["zero"]["driftRate"] = zero.driftRateGpm;
+        doc["zero"]["tracking"] = zero.atZero;
+        doc["cup"] = cupDetectPresent();
+
+        doc["version"] = CURRENT_VERSION;
+        apiSendJson(request, doc);
+    });
+}
+
+static void registerPresetRoutes(AsyncWebServer &server)
+{
+    server.on("/api/v1/presets", HTTP_GET, [](AsyncWebServerRequest *request) {
+        JsonDocument doc;
+        writePresets(doc);
+        apiSendJson(request, doc);
+    });
+
+    // All fields are optional; nothing is applied unless every given field is valid.
+    // "table" replaces the whole table, entry i keeping the fields it leaves out
+    // from the current entry i; the rest is applied to the new table.
+    apiOnJson(server, "/api/v1/presets", HTTP_POST | HTTP_PUT, [](AsyncWebServerRequest *request, JsonDocument &body) {
+        Preset table[PRESET_MAX_COUNT];
+        uint8_t count = 0;
+        while (count < PRESET_MAX_COUNT && presetGet(count, &table[count]))
+        {
+            count++;
+        }
+
+        if (!body["table"].isNull())
+        {
+            JsonArray entries = body["table"].as<JsonArray>();
+            if (entries.isNull() || entries.size() == 0 || entries.size() > PRESET_MAX_COUNT)
+            {
+                apiSendError(request, 422, "table needs 1 to maxCount presets");
+                return;
+            }
+
+            uint8_t i = 0;
+            for (JsonVariant entry : entries)
+            {
+                if (i >= count)
+                {
+                    table[i] = presetDefaults();
+                }
+                const char *error = presetFromJson(entry, &table[i]);
+                if (error != nullptr)
+                {
+                    apiSendError(request, 422, error);
+                    return;
+                }
+                i++;
+            }
+            count = i;
+        }
+
+        uint8_t index;
+        if (!body["favourites"]["left"].isNull() && !presetIndexFromJson(body["favourites"]["left"], count, index))
+        {
+            apiSendError(request, 422, "favourites.left is not a preset");
+            return;
+        }
+        if (!body["favourites"]["right"].isNull() && !presetIndexFromJson(body["favourites"]["right"], count, index))
+        {
+            apiSendError(request, 422, "favourites.right is not a preset");
+            return;
+        }
+
+        uint16_t targets[2] = {};
+        if (!body["left"].isNull() && !targetFromJson(body["left"], targets[SMALL]))
+        {
+            apiSendError(request, 422, "left out of range");
+            return;
+        }
+        if (!body["right"].isNull() && !targetFromJson(body["right"], targets[LARGE]))
+        {
+            apiSendError(request, 422, "right out of range");
+            return;
+        }
+
+        if (!body["selected"].isNull() && !presetIndexFromJson(body["selected"], count, index))
+        {
+            apiSendError(request, 422, "selected is not a preset");
+            return;
+        }
+
+        RemoteCommand command = {};
+        command.type = REMOTE_PRESETS;
+        const char *error = presetsReplace(table, count, command.previous);
+        if (error != nullptr)
+        {
+            apiSendError(request, 422, error);
+            return;
+        }
+
+        // The favourites followed their entries; "left"/"right" now name them in the new table
+        uint8_t favourites[2] = {presetFavourite(SMALL), presetFavourite(LARGE)};
+        if (!body["favourites"]["left"].isNull())
+        {
+            presetIndexFromJson(body["favourites"]["left"], count, favourites[SMALL]);
+        }
+        if (!body["favourites"]["right"].isNull())
+        {
+            presetIndexFromJson(body["favourites"]["right"], count, favourites[LARGE]);
+        }
+        for (PresetSelection button : {SMALL, LARGE})
+        {
+            presetSetFavourite(button, favourites[button]);
+            if (targets[button] != 0)
+            {
+                presetSetTarget(favourites[button], targets[button]);
+            }
+        }
+
+        // The selection belongs to the main loop, which moves it with its entry
+        command.preset = PRESET_NEW;
+        if (!body["selected"].isNull())
+        {
+            presetIndexFromJson(body["selected"], count, command.preset);
+        }
+        if (!postRemoteCommand(command))
+        {
+            LOGW("[PRESETS] Command queue full, selection not moved\n");
+        }
+
+        JsonDocument doc;
+        writePresets(doc);
+        apiSendJson(request, doc, 202);
+    });
+}
+
+static void writeProfiles(JsonDocument &doc)
+{
+    JsonArray slots = doc["slots"].to<JsonArray>();
+    for (uint8_t i = 0; i < PROFILE_MAX_COUNT; i++)
+    {
+        GrindProfile profile;
+        if (profileGet(i, &profile))
+        {
+            profileToJson(profile, slots.add<JsonObject>());
+        }
+        else
+        {
+            slots.add(nullptr);
+        }
+    }
+    doc["maxPoints"] = PROFILE_MAX_POINTS;
+}
+
+// Grind profiles, referenced by presets through their slot
+static void registerProfileRoutes(AsyncWebServer &server)
+{
+    server.on("/api/v1/profiles", HTTP_GET, [](AsyncWebServerRequest *request) {
+        JsonDocument doc;
+        writeProfiles(doc);
+        apiSendJson(request, doc);
+    });
+
+    // {"slot": 0, "profile": {...}} stores a profile, "profile": null clears the slot
+    apiOnJson(server, "/api/v1/profiles", HTTP_POST | HTTP_PUT, [](AsyncWebServerRequest *request, JsonDocument &body) {
+        int slot = body["slot"] | -1;
+        if (!body["slot"].is<int>() || slot < 0 || slot >= PROFILE_MAX_COUNT)
+        {
+            apiSendError(request, 422, "slot out of range");
+            return;
+        }
+
+        GrindProfile profile;
+        const char *error = profileFromJson(body["profile"], &profile);
+        if (error == nullptr)
+        {
+            error = profilePut(static_cast<uint8_t>(slot), profile);
+        }
+        if (error != nullptr)
+        {
+            apiSendError(request, 422, error);
+            return;
+        }
+
+        JsonDocument doc;
+        writeProfiles(doc);
+        apiSendJson(request, doc);
+    });
+}
+
+static void registerSettingsRoutes(AsyncWebServer &server)
+{
+    server.on("/api/v1/settings", HTTP_GET, [](AsyncWebServerRequest *request) {
+        JsonDocument doc;
+        writeSettings(doc);
+        apiSendJson(request, doc);
+    });
+
+    apiOnJson(server, "/api/v1/settings", HTTP_POST | HTTP_PUT, [](AsyncWebServerRequest *request, JsonDocument &body) {
+        float threshold = body["blockThreshold"] | blockThreshold;
+        int rate = body["telemetryRate"] | static_cast<int>(telemetryRateHz);
+        int level = body["logLevel"] | static_cast<int>(logGetLevel());
+        int settleTimeout = body["settleTimeout"] | static_cast<int>(settleTimeoutMs);
+        AutoZeroConfig autoZero = autoZeroConfig();
+        autoZero.enabled = body["autoZero"] | autoZero.enabled;
+        autoZero.bandG = body["zeroBand"] | autoZero.bandG;
+        autoZero.rateGps = body["zeroRate"] | autoZero.rateGps;
+        CupDetectConfig cup = cupDetectConfig();
+        cup.enabled = body["cupDetect"] | cup.enabled;
+        cup.minWeightG = body["cupMinWeight"] | cup.minWeightG;
+        int armDelay = body["cupArmDelay"] | static_cast<int>(cup.armDelayMs);
+        PulseFinishConfig pulse = pulseFinishConfig();
+        pulse.enabled = body["pulseFinish"] | pulse.enabled;
+        pulse.bandG = body["pulseBand"] | pulse.bandG;
+        int pulseMs = body["pulseMs"] | static_cast<int>(pulse.pulseMs);
+
+        if (threshold <= 0.0f || threshold > 10.0f)
+        {
+            apiSendError(request, 422, "blockThreshold out of range");
+            return;
+        }
+        if (rate < TELEMETRY_MIN_RATE_HZ || rate > TELEMETRY_MAX_RATE_HZ)
+        {
+            apiSendError(request, 422, "telemetryRate out of range");
+            return;
+        }
+        if (level < LOG_LEVEL_NONE || level > LOG_LEVEL_DEBUG)
+        {
+            apiSendError(request, 422, "logLevel out of range");
+            return;
+        }
+        if (settleTimeout < SETTLE_MIN_TIMEOUT_MS || settleTimeout > SETTLE_MAX_TIMEOUT_MS)
+        {
+            apiSendError(request, 422, "settleTimeout out of range");
+            return;
+        }
+        if (autoZero.bandG < 0.0f || autoZero.bandG > AUTOZERO_MAX_BAND_G)
+        {
+            apiSendError(request, 422, "zeroBand out of range");
+            return;
+        }
+        if (autoZero.rateGps < 0.0f || autoZero.rateGps > AUTOZERO_MAX_RATE_GPS)
+        {
+            apiSendError(request, 422, "zeroRate out of range");
+            return;
+        }
+        if (cup.minWeightG < CUP_MIN_WEIGHT_LOW_G || cup.minWeightG > CUP_MIN_WEIGHT_HIGH_G)
+        {
+            apiSendError(request, 422, "cupMinWeight out of range");
+            return;
+        }
+        if (armDelay < 0 || armDelay > CUP_MAX_ARM_DELAY_MS)
+        {
+            apiSendError(request, 422, "cupArmDelay out of range");
+            return;
+        }
+        if (pulse.bandG <= 0.0f || pulse.bandG > PULSE_MAX_BAND_G)
+        {
+            apiSendError(request, 422, "pulseBand out of range");
+            return;
+        }
+        if (pulseMs < PULSE_MIN_MS || pulseMs > PULSE_MAX_MS)
+        {
+            apiSendError(request, 422, "pulseMs out of range");
+            return;
+        }
+
+        blockThreshold = threshold;
+        telemetryRateHz = rate;
+        logSetLevel(level);
+        settleTimeoutMs = settleTimeout;
+        autoZeroConfigure(autoZero);
+        cup.armDelayMs = armDelay;
+        cupDetectConfigure(cup);
+        pulse.pulseMs = pulseMs;
+        pulseFinishConfigure(pulse);
+        savePreferences();
+
+        JsonDocument doc;
+        writeSettings(doc);
+        apiSendJson(request, doc);
+    });
+}
+
+static void writeCalibration(JsonDocument &doc)
+{
+    CalibrationInfo info = calibrationInfo();
+
+    doc["scaleFactor"] = scaleFactor;
+    doc["active"] = state == CALIBRATE;
+    doc["pending"] = calibrationPendingPoints();
+    doc["error"] = remoteCalibrationError(); // last queued step, null if it succeeded
+    doc["mode"] = calibrationModeToString(info.mode);
+    doc["zeroCounts"] = info.zeroCounts;
+    doc["gain"] = info.gain;
+    doc["curvature"] = info.curvature;
+    doc["rmsResidual"] = info.rmsResidual;
+    doc["maxResidual"] = info.maxResidual;
+
+    JsonArray points = doc["points"].to<JsonArray>();
+    for (uint8_t i = 0; i < info.count; i++)
+    {
+        JsonObject point = points.add<JsonObject>();
+        point["weight"] = info.points[i].grams;
+        point["counts"] = info.points[i].counts;
+        point["residual"] = info.points[i].residual;
+    }
+}
+
+// Queue a command for the main loop; answers 503 and returns false while the queue is full
+static bool apiPostCommand(AsyncWebServerRequest *request, const RemoteCommand &command)
+{
+    if (!postRemoteCommand(command))
+    {
+        apiSendError(request, 503, "command queue full");
+        return false;
+    }
+    return true;
+}
+
+static void registerCalibrationRoutes(AsyncWebServer &server)
+{
+    server.on("/api/v1/calibration", HTTP_GET, [](AsyncWebServerRequest *request) {
+        JsonDocument doc;
+        writeCalibration(doc);
+        apiSendJson(request, doc);
+    });
+
+    // {"action": "start", "keep": false} tares; {"action": "point", "weight": g}
+    // measures one reference; {"action": "finish", "mode": "linear"} fits them.
+    // A weight on finish measures it first, as a single-point calibration.
+    // Steps that wait for the scale are answered with 202 and run by the main
+    // loop; "error" in GET reports how the last one ended.
+    apiOnJson(server, "/api/v1/calibration", HTTP_POST, [](AsyncWebServerRequest *request, JsonDocument &body) {
+        const char *action = body["action"] | "";
+        RemoteCommand command = {};
+        int code = 200;
+
+        if (strcmp(action, "start") == 0)
+        {
+            command.type = REMOTE_CALIBRATE;
+            command.keep = body["keep"] | false;
+            if (!apiPostCommand(request, command))
+            {
+                return;
+            }
+            code = 202;
+        }
+        else if (strcmp(action, "point") == 0 || strcmp(action, "finish") == 0)
+        {
+            bool finish = strcmp(action, "finish") == 0;
+            float known = body["weight"] | 0.0f;
+            CalibrationMode mode = CALIBRATION_LINEAR;
+
+            if (state != CALIBRATE)
+            {
+                apiSendError(request, 409, "calibration not started");
+                return;
+            }
+            if (!finish && known <= 0.0f)
+            {
+                apiSendError(request, 422, "weight must be positive");
+                return;
+            }
+            if (finish && !calibrationModeFromString(body["mode"] | "linear", &mode))
+            {
+                apiSendError(request, 422, "mode must be linear, quadratic or table");
+                return;
+            }
+
+            command.type = REMOTE_CALIBRATION_POINT;
+            command.finish = finish;
+            command.weight = known;
+            command.mode = mode;
+            if (!apiPostCommand(request, command))
+            {
+                return;
+            }
+            code = 202;
+        }
+        else if (strcmp(action, "cancel") == 0)
+        {
+            if (state == CALIBRATE)
+            {
+                setState(IDLE);
+            }
+        }
+        else
+        {
+            apiSendError(request, 422, "action must be start, point, finish or cancel");
+            return;
+        }
+
+        JsonDocument doc;
+        writeCalibration(doc);
+        apiSendJson(request, doc, code);
+    });
+}
+
+static void registerCommandRoutes(AsyncWebServer &server)
+{
+    apiOnJson(server, "/api/v1/commands", HTTP_POST, [](AsyncWebServerRequest *request, JsonDocument &body) {
+        const char *cmd = body["cmd"] | "";
+        RemoteCommand command = {};
+        int code = 202;
+
+        if (strcmp(cmd, "start") == 0)
+        {
+            if (state == UPDATING)
+            {
+                apiSendError(request, 409, "update in progress");
+                return;
+            }
+            if (state != IDLE && state != PAUSED && state != EMPTY)
+            {
+                apiSendError(request, 409, "grinder busy");
+                return;
+            }
+            command.type = REMOTE_START;
+        }
+        else if (strcmp(cmd, "stop") == 0)
+        {
+            if (state == RUNNING || state == PULSING)
+            {
+                setState(PAUSED);
+            }
+            code = 200;
+        }
+        else if (strcmp(cmd, "left") == 0 || strcmp(cmd, "right") == 0)
+        {
+            command.type = REMOTE_FAVOURITE;
+            command.button = strcmp(cmd, "left") == 0 ? SMALL : LARGE;
+        }
+        else if (strcmp(cmd, "tare") == 0)
+        {
+            command.type = REMOTE_TARE;
+        }
+        else
+        {
+            apiSendError(request, 422, "unknown cmd");
+            return;
+        }
+
+        if (code == 202 && !apiPostCommand(request, command))
+        {
+            return;
+        }
+
+        JsonDocument doc;
+        doc["state"] = stateToString(state);
+        apiSendJson(request, doc, code);
+    });
+}
+
+static void registerBatchRoutes(AsyncWebServer &server)
+{
+    server.on("/api/v1/batch", HTTP_GET, [](AsyncWebServerRequest *request) {
+        JsonDocument doc;
+        batchToJson(doc.to<JsonObject>());
+        apiSendJson(request, doc);
+    });
+
+    // {"count": 5, "preset": "left"} or {"jobs": ["left", 18.0, ...]}
+    // Parsed here, started by the main loop; GET reports the progress
+    apiOnJson(server, "/api/v1/batch", HTTP_POST, [](AsyncWebServerRequest *request, JsonDocument &body) {
+        if (state != IDLE || batchActive())
+        {
+            apiSendError(request, 409, state != IDLE ? "grinder busy" : "batch already running");
+            return;
+        }
+
+        RemoteCommand command = {};
+        command.type = REMOTE_BATCH;
+        const char *error = batchFromJson(body.as<JsonVariantConst>(), selectedPreset, command.jobs, &command.jobCount);
+        if (error != nullptr)
+        {
+            apiSendError(request, 422, error);
+            return;
+        }
+        if (!apiPostCommand(request, command))
+        {
+            return;
+        }
+
+        JsonDocument doc;
+        doc["queued"] = command.jobCount;
+        apiSendJson(request, doc, 202);
+    });
+
+    server.on("/api/v1/batch", HTTP_DELETE, [](AsyncWebServerRequest *request) {
+        cancelBatch();
+
+        JsonDocument doc;
+        batchToJson(doc.to<JsonObject>());
+        apiSendJson(request, doc);
+    });
+}
+
+static void registerBootRoutes(AsyncWebServer &server)
+{
+    server.on("/api/v1/boot", HTTP_GET, [](AsyncWebServerRequest *request) {
+        JsonDocument doc;
+
+        // Milliseconds since power-on, null for phases not reached yet
+        JsonObject phases = doc["phases"].to<JsonObject>();
+        for (uint8_t i = 0; i < BOOT_PHASE_COUNT; i++)
+        {
+            BootPhase phase = static_cast<BootPhase>(i);
+            uint32_t ms = bootTimestamp(phase);
+            if (ms)
+            {
+                phases[bootPhaseName(phase)] = ms;
+            }
+            else
+            {
+                phases[bootPhaseName(phase)] = nullptr;
+            }
+        }
+        doc["uptime"] = millis();
+
+        WifiStats wifi = wifiGetStats();
+        doc["wifi"]["connected"] = wifiConnected();
+        doc["wifi"]["bootConnectMs"] = wifi.bootConnectMs;
+        doc["wifi"]["reconnectMs"] = wifi.reconnectMs;
+        doc["wifi"]["reconnects"] = wifi.reconnects;
+        doc["wifi"]["attempts"] = wifi.attempts;
+
+        apiSendJson(request, doc);
+    });
+}
+
+static void writeDoseStats(JsonObject out, uint8_t preset)
+{
+    DoseStatsSummary s = doseStatsSummary(preset);
+    out["count"] = s.count;
+    out["error"]["mean"] = s.errorMean;
+    out["error"]["stddev"] = s.errorStddev;
+    out["error"]["p50"] = s.errorP50;
+    out["error"]["p95"] = s.errorP95;
+    out["error"]["p99"] = s.errorP99;
+    out["time"]["mean"] = s.timeMean;
+    out["time"]["stddev"] = s.timeStddev;
+    out["time"]["p50"] = s.timeP50;
+    out["time"]["p95"] = s.timeP95;
+    out["time"]["p99"] = s.timeP99;
+}
+
+// Dose error (g) and grind time (s) of finished grinds per preset
+static void registerStatsRoutes(AsyncWebServer &server)
+{
+    server.on("/api/v1/stats", HTTP_GET, [](AsyncWebServerRequest *request) {
+        JsonDocument doc;
+        writeDoseStats(doc["left"].to<JsonObject>(), presetFavourite(SMALL));
+        writeDoseStats(doc["right"].to<JsonObject>(), presetFavourite(LARGE));
+
+        JsonArray presets = doc["presets"].to<JsonArray>();
+        Preset preset;
+        for (uint8_t i = 0; presetGet(i, &preset); i++)
+        {
+            JsonObject entry = presets.add<JsonObject>();
+            entry["name"] = preset.name;
+            writeDoseStats(entry, i);
+        }
+        apiSendJson(request, doc);
+    });
+}
+
+// Serializes one page of history into the chunks requested by the server,
+// one record at a time
+class HistoryPage
+{
+public:
+    HistoryPage(uint32_t after, uint32_t from, uint32_t to, uint16_t limit)
+        : _reader(after, from, to), _limit(limit)
+    {
+    }
+
+    size_t fill(uint8_t *buffer, size_t maxLen)
+    {
+        size_t written = 0;
+        while (written < maxLen)
+        {
+            if (_pos == _len && !produce())
+            {
+                break;
+            }
+
+            size_t chunk = min(_len - _pos, maxLen - written);
+            memcpy(buffer + written, _text + _pos, chunk);
+            _pos += chunk;
+            written += chunk;
+        }
+        return written;
+    }
+
+private:
+    // Format the next piece of the response into _text; false when done
+    bool produce()
+    {
+        GrindRecord record;
+        int len = 0;
+
+        if (_stage == 0)
+        {
+            len = snprintf(_text, sizeof(_text), "{\"records\":[");
+            _stage = 1;
+        }
+        else if (_stage == 1 && _count < _limit && _reader.next(record))
+        {
+            len = snprintf(_text, sizeof(_text),
+                           "%s{\"seq\":%lu,\"ts\":%lu,\"preset\":%u,\"target\":%.1f,\"actual\":%.2f,"
+                           "\"overshoot\":%.2f,\"duration_ms\":%lu,\"peak_flow\":%.2f,\"reason\":\"%s\"}",
+                           _count ? "," : "", static_cast<unsigned long>(record.seq), static_cast<unsigned long>(record.timestamp),
+                           record.preset, record.target / 10.0f, record.actual / 100.0f,
+                           record.overshoot / 100.0f, static_cast<unsigned long>(record.durationMs), record.peakFlow / 100.0f,
+                           grindEndReasonToString(record.reason));
+            _lastSeq = record.seq;
+            _count++;
+        }
+        else if (_stage == 1)
+        {
+            // Only point to a next page if there is one
+            bool more = _count == _limit && _reader.next(record);
+            len = more ? snprintf(_text, sizeof(_text), "],\"next\":%lu}", static_cast<unsigned long>(_lastSeq))
+                       : snprintf(_text, sizeof(_text), "],\"next\":null}");
+            _stage = 2;
+        }
+        else
+        {
+            return false;
+        }
+
+        _len = min(static_cast<size_t>(max(len, 0)), sizeof(_text) - 1);
+        _pos = 0;
+        return true;
+    }
+
+    HistoryReader _reader;
+    uint16_t _limit;
+    uint16_t _count = 0;
+    uint32_t _lastSeq = 0;
+    uint8_t _stage = 0;
+    char _text[256];
+    size_t _len = 0;
+    size_t _pos = 0;
+};
+
+static uint32_t uintParam(AsyncWebServerRequest *request, const char *name, uint32_t defaultValue)
+{
+    return request->hasParam(name) ? strtoul(request->getParam(name)->value().c_str(), nullptr, 10) : defaultValue;
+}
+
+// GET /api/v1/history?after=<seq>&from=<unix>&to=<unix>&limit=<n>; pass the
+// returned "next" as after to get the following page
+static void registerHistoryRoutes(AsyncWebServer &server)
+{
+    server.on("/api/v1/history", HTTP_GET, [](AsyncWebServerRequest *request) {
+        uint32_t limit = uintParam(request, "limit", HISTORY_PAGE_SIZE);
+        if (limit == 0 || limit > HISTORY_PAGE_MAX)
+        {
+            apiSendError(request, 422, "limit out of range");
+            return;
+        }
+
+        auto page = std::make_shared<HistoryPage>(uintParam(request, "after", 0), uintParam(request, "from", 0),
+                                                  uintParam(request, "to", 0), limit);
+        request->send(request->beginChunkedResponse("application/json", [page](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+            return page->fill(buffer, maxLen);
+        }));
+    });
+}
+
+static void writeUpdate(JsonDocument &doc)
+{
+    OtaStatus status = otaGetStatus();
+    doc["phase"] = otaPhaseToString(status.phase);
+    doc["written"] = status.written;
+    doc["total"] = status.total;
+    doc["progress"] = status.total ? static_cast<uint8_t>(100ULL * status.written / status.total) : 0;
+    doc["version"] = status.version;
+    doc["error"] = status.error;
+    doc["current"] = CURRENT_VERSION;
+    doc["source"] = otaGetSource();
+}
+
+static void registerUpdateRoutes(AsyncWebServer &server)
+{
+    server.on("/api/v1/update", HTTP_GET, [](AsyncWebServerRequest *request) {
+        JsonDocument doc;
+        writeUpdate(doc);
+        apiSendJson(request, doc);
+    });
+
+    // {"source": url} changes the release manifest ("" restores the default),
+    // {"start": true} begins the background update
+    apiOnJson(server, "/api/v1/update", HTTP_POST, [](AsyncWebServerRequest *request, JsonDocument &body) {
+        if (body["source"].is<const char *>())
+        {
+            String source = body["source"].as<const char *>();
+            if (source.length() && !source.startsWith("http://") && !source.startsWith("https://"))
+            {
+                apiSendError(request, 422, "source must be an http(s) URL");
+                return;
+            }
+            otaSetSource(source);
+        }
+
+        if ((body["start"] | false) && !otaStartUpdate())
+        {
+            apiSendError(request, 409, "grinder busy");
+            return;
+        }
+
+        JsonDocument doc;
+        writeUpdate(doc);
+        apiSendJson(request, doc, 202);
+    });
+}
+
+void registerApiRoutes(AsyncWebServer &server)
+{
+    registerStateRoutes(server);
+    registerPresetRoutes(server);
+    registerProfileRoutes(server);
+    registerSettingsRoutes(server);
+    registerCalibrationRoutes(server);
+    registerCommandRoutes(server);
+    registerBatchRoutes(server);
+    registerUpdateRoutes(server);
+    registerBootRoutes(server);
+    registerHistoryRoutes(server);
+    registerStatsRoutes(server);
+}
@@ -0,0 +1,776 @@
+#include "asyncmqtt.h"
+#include "types.h"
+
+// -----------------------------------------------------------------------------
+// Protocol constants
+// -----------------------------------------------------------------------------
+
+constexpr uint8_t MQTT_CONNECT = 0x10;
+constexpr uint8_t MQTT_CONNACK = 0x20;
+constexpr uint8_t MQTT_PUBLISH = 0x30;
+constexpr uint8_t MQTT_PUBACK = 0x40;
+constexpr uint8_t MQTT_SUBSCRIBE = 0x82;
+constexpr uint8_t MQTT_SUBACK = 0x90;
+constexpr uint8_t MQTT_PINGREQ = 0xC0;
+constexpr uint8_t MQTT_PINGRESP = 0xD0;
+constexpr uint8_t MQTT_DISCONNECT = 0xE0;
+
+constexpr uint8_t MQTT_FLAG_DUP = 0x08;
+constexpr uint8_t MQTT_FLAG_RETAIN = 0x01;
+
+// Resend a QoS 1 publish when no PUBACK arrived within this time
+constexpr uint32_t MQTT_RETRY_MS = 10000;
+// Give up on a TCP/MQTT handshake that does not complete
+constexpr uint32_t MQTT_CONNECT_TIMEOUT_MS = 10000;
+
+// -----------------------------------------------------------------------------
+// Encoding helpers
+// -----------------------------------------------------------------------------
+
+static size_t remainingLengthSize(size_t length)
+{
+    size_t n = 1;
+    while (length >= 128)
+    {
+        length /= 128;
+        n++;
+    }
+    return n;
+}
+
+static uint8_t *writeRemainingLength(uint8_t *p, size_t length)
+{
+    do
+    {
+        uint8_t digit = length % 128;
+        length /= 128;
+        if (length > 0)
+        {
+            digit |= 0x80;
+        }
+        *p++ = digit;
+    } while (length > 0);
+    return p;
+}
+
+static uint8_t *writeU16(uint8_t *p, uint16_t value)
+{
+    *p++ = value >> 8;
+    *p++ = value & 0xFF;
+    return p;
+}
+
+static uint8_t *writeString(uint8_t *p, const char *s, size_t length)
+{
+    p = writeU16(p, length);
+    memcpy(p, s, length);
+    return p + length;
+}
+
+// -----------------------------------------------------------------------------
+// Construction & configuration
+// -----------------------------------------------------------------------------
+
+AsyncMqtt::AsyncMqtt()
+{
+    _mutex = xSemaphoreCreateRecursiveMutex();
+
+    _client.setNoDelay(true);
+    _client.onConnect([](void *arg, AsyncClient *) { static_cast<AsyncMqtt *>(arg)->handleTcpConnect(); }, this);
+    _client.onDisconnect([](void *arg, AsyncClient *) { static_cast<AsyncMqtt *>(arg)->handleTcpDisconnect(); }, this);
+    _client.onError([](void *arg, AsyncClient *, int8_t error) {
+        LOGW("[MQTT] TCP error: %s\n", AsyncClient::errorToString(error));
+        static_cast<AsyncMqtt *>(arg)->handleTcpDisconnect();
+    }, this);
+    _client.onAck([](void *arg, AsyncClient *, size_t len, uint32_t) { static_cast<AsyncMqtt *>(arg)->handleAck(len); }, this);
+    _client.onData([](void *arg, AsyncClient *, void *data, size_t len) {
+        static_cast<AsyncMqtt *>(arg)->handleData(static_cast<const uint8_t *>(data), len);
+    }, this);
+}
+
+AsyncMqtt::~AsyncMqtt()
+{
+    _client.abort();
+}
+
+void AsyncMqtt::setServer(const String &host, uint16_t port)
+{
+    _host = host;
+    _port = port;
+}
+
+void AsyncMqtt::setCredentials(const String &user, const String &pass)
+{
+    _user = user;
+    _pass = pass;
+}
+
+void AsyncMqtt::setWill(const String &topic, const char *payload, bool retain, uint8_t qos)
+{
+    _willTopic = topic;
+    _willPayload = payload;
+    _willRetain = retain;
+    _willQos = qos;
+}
+
+void AsyncMqtt::setKeepAlive(uint16_t seconds)
+{
+    _keepAlive = seconds;
+}
+
+void AsyncMqtt::lock() const
+{
+    xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+}
+
+void AsyncMqtt::unlock() const
+{
+    xSemaphoreGiveRecursive(_mutex);
+}
+
+// -----------------------------------------------------------------------------
+// Connection lifecycle
+// -----------------------------------------------------------------------------
+
+bool AsyncMqtt::connect(const String &clientId)
+{
+    if (_host.isEmpty() || _state != DISCONNECTED)
+    {
+        return false;
+    }
+
+    _clientId = clientId;
+    _state = TCP_CONNECTING;
+    _lastTx = millis();
+
+    if (!_client.connect(_host.c_str(), _port))
+    {
+        _state = DISCONNECTED;
+        return false;
+    }
+    return true;
+}
+
+void AsyncMqtt::disconnect()
+{
+    if (_state == DISCONNECTED)
+    {
+        return;
+    }
+
+    lock();
+    if (_state == CONNECTED)
+    {
+        enqueueControl(MQTT_DISCONNECT, nullptr, 0);
+        flush();
+    }
+    unlock();
+
+    _client.close();
+}
+
+void AsyncMqtt::sendConnect()
+{
+    size_t clientIdLen = _clientId.length();
+    size_t willTopicLen = _willTopic.length();
+    size_t willPayloadLen = _willPayload.length();
+    size_t userLen = _user.length();
+    size_t passLen = _pass.length();
+
+    size_t length = 10 + 2 + clientIdLen;
+    uint8_t flags = 0x02; // clean session
+    if (willTopicLen)
+    {
+        length += 2 + willTopicLen + 2 + willPayloadLen;
+        flags |= 0x04 | (_willQos << 3) | (_willRetain ? 0x20 : 0);
+    }
+    if (userLen)
+    {
+        length += 2 + userLen;
+        flags |= 0x80;
+        if (passLen)
+        {
+            length += 2 + passLen;
+            flags |= 0x40;
+        }
+    }
+
+    Frame frame;
+    frame.headLen = 1 + remainingLengthSize(length) + length;
+    frame.head.reset(new uint8_t[frame.headLen]);
+
+    uint8_t *p = frame.head.get();
+    *p++ = MQTT_CONNECT;
+    p = writeRemainingLength(p, length);
+    p = writeString(p, "MQTT", 4);
+    *p++ = 4; // protocol level 3.1.1
+    *p++ = flags;
+    p = writeU16(p, _keepAlive);
+    p = writeString(p, _clientId.c_str(), clientIdLen);
+    if (willTopicLen)
+    {
+        p = writeString(p, _willTopic.c_str(), willTopicLen);
+        p = writeString(p, _willPayload.c_str(), willPayloadLen);
+    }
+    if (userLen)
+    {
+        p = writeString(p, _user.c_str(), userLen);
+        if (passLen)
+        {
+            p = writeString(p, _pass.c_str(), passLen);
+        }
+    }
+
+    enqueue(std::move(frame), true);
+}
+
+void AsyncMqtt::handleTcpConnect()
+{
+    lock();
+    _state = MQTT_CONNECTING;
+    _rx.clear();
+    _streamSent = 0;
+    _streamAcked = 0;
+    _pingOutstanding = false;
+    _lastRx = millis();
+
+    // Unfinished QoS 1 publishes from the previous session go out again
+    for (auto it = _inflight.rbegin(); it != _inflight.rend(); ++it)
+    {
+        it->head[0] |= MQTT_FLAG_DUP;
+        it->sent = 0;
+        _queuedBytes += it->total();
+        _outbox.push_front(std::move(*it));
+    }
+    _inflight.clear();
+
+    sendConnect();
+    flush();
+    unlock();
+}
+
+void AsyncMqtt::handleTcpDisconnect()
+{
+    DoneList dropped;
+
+    lock();
+    if (_state == DISCONNECTED)
+    {
+        unlock();
+        return;
+    }
+    _state = DISCONNECTED;
+    dropFrames(dropped);
+    unlock();
+
+    LOG("[MQTT] Disconnected");
+    runDone(dropped, false);
+}
+
+// Drop everything except QoS 1 publishes, which are retried after reconnect
+void AsyncMqtt::dropFrames(DoneList &dropped)
+{
+    auto keep = [&](std::deque<Frame> &queue) {
+        for (auto &frame : queue)
+        {
+            if (frame.qos > 0 && frame.packetId)
+            {
+                frame.sent = 0;
+                frame.acked = false;
+                _inflight.push_back(std::move(frame));
+            }
+            else if (frame.done)
+            {
+                dropped.push_back(frame.done);
+            }
+        }
+        queue.clear();
+    };
+
+    keep(_unacked);
+    keep(_outbox);
+    _queuedBytes = 0;
+}
+
+void AsyncMqtt::runDone(DoneList &list, bool delivered)
+{
+    for (auto &done : list)
+    {
+        done(delivered);
+    }
+    list.clear();
+}
+
+// -----------------------------------------------------------------------------
+// Outgoing queue
+// -----------------------------------------------------------------------------
+
+void AsyncMqtt::enqueue(Frame &&frame, bool front)
+{
+    _queuedBytes += frame.total();
+    if (front)
+    {
+        // Never jump ahead of a partially written frame
+        auto pos = _outbox.begin();
+        if (pos != _outbox.end() && pos->sent > 0)
+        {
+            ++pos;
+        }
+        _outbox.insert(pos, std::move(frame));
+    }
+    else
+    {
+        _outbox.push_back(std::move(frame));
+    }
+}
+
+void AsyncMqtt::enqueueControl(uint8_t type, const uint8_t *body, size_t length, bool front)
+{
+    Frame frame;
+    frame.headLen = 1 + remainingLengthSize(length) + length;
+    frame.head.reset(new uint8_t[frame.headLen]);
+
+    uint8_t *p = frame.head.get();
+    *p++ = type;
+    p = writeRemainingLength(p, length);
+    if (length)
+    {
+        memcpy(p, body, length);
+    }
+
+    enqueue(std::move(frame), front);
+}
+
+bool AsyncMqtt::enqueuePublish(const char *topic, const uint8_t *payload, size_t length, bool retain, uint8_t qos, bool copy, MqttDoneCallback done)
+{
+    qos = qos > 1 ? 1 : qos;
+    size_t topicLen = strlen(topic);
+    size_t remaining = 2 + topicLen + (qos ? 2 : 0) + length;
+
+    if (_state != CONNECTED)
+    {
+        return false;
+    }
+
+    lock();
+    if (_queuedBytes + remaining > MQTT_MAX_QUEUED_BYTES || (qos && _qosPending >= MQTT_MAX_INFLIGHT))
+    {
+        unlock();
+        return false;
+    }
+
+    Frame frame;
+    frame.qos = qos;
+    frame.done = done;
+    frame.headLen = 1 + remainingLengthSize(remaining) + remaining - (copy ? 0 : length);
+    frame.head.reset(new uint8_t[frame.headLen]);
+
+    uint8_t *p = frame.head.get();
+    *p++ = MQTT_PUBLISH | (qos << 1) | (retain ? MQTT_FLAG_RETAIN : 0);
+    p = writeRemainingLength(p, remaining);
+    p = writeString(p, topic, topicLen);
+    if (qos)
+    {
+        frame.packetId = _nextPacketId++;
+        if (_nextPacketId == 0)
+        {
+            _nextPacketId = 1;
+        }
+        p = writeU16(p, frame.packetId);
+        _qosPending++;
+    }
+
+    if (copy)
+    {
+        memcpy(p, payload, length);
+    }
+    else
+    {
+        frame.payload = payload;
+        frame.payloadLen = length;
+    }
+
+    enqueue(std::move(frame));
+    flush();
+    unlock();
+    return true;
+}
+
+bool AsyncMqtt::publish(const char *topic, const char *payload, bool retain, uint8_t qos, MqttDoneCallback done)
+{
+    return enqueuePublish(topic, reinterpret_cast<const uint8_t *>(payload), strlen(payload), retain, qos, true, done);
+}
+
+bool AsyncMqtt::publish(const char *topic, const uint8_t *payload, size_t length, bool retain, uint8_t qos, MqttDoneCallback done)
+{
+    return enqueuePublish(topic, payload, length, retain, qos, true, done);
+}
+
+bool AsyncMqtt::publishRef(const char *topic, const uint8_t *payload, size_t length, bool retain, uint8_t qos, MqttDoneCallback done)
+{
+    return enqueuePublish(topic, payload, length, retain, qos, false, done);
+}
+
+bool AsyncMqtt::subscribe(const char *topic, uint8_t qos)
+{
+    if (_state != CONNECTED)
+    {
+        return false;
+    }
+
+    size_t topicLen = strlen(topic);
+    std::unique_ptr<uint8_t[]> body(new uint8_t[2 + 2 + topicLen + 1]);
+
+    lock();
+    uint8_t *p = writeU16(body.get(), _nextPacketId++);
+    if (_nextPacketId == 0)
+    {
+        _nextPacketId = 1;
+    }
+    p = writeString(p, topic, topicLen);
+    *p++ = qos > 1 ? 1 : qos;
+
+    enqueueControl(MQTT_SUBSCRIBE, body.get(), p - body.get());
+    flush();
+    unlock();
+    return true;
+}
+
+// Hand as much of the outbox to TCP as the send window allows.
+// Data is added without copying; frames stay alive until acknowledged.
+void AsyncMqtt::flush()
+{
+    if (_state != CONNECTED && _state != MQTT_CONNECTING)
+    {
+        return;
+    }
+
+    bool added = false;
+    while (!_outbox.empty())
+    {
+        // Only the CONNECT frame may go out before CONNACK
+        if (_state == MQTT_CONNECTING && _outbox.front().head[0] != MQTT_CONNECT)
+        {
+            break;
+        }
+
+        size_t space = _client.space();
+        if (space == 0)
+        {
+            break;
+        }
+
+        Frame &frame = _outbox.front();
+        const uint8_t *part;
+        size_t partLen;
+        if (frame.sent < frame.headLen)
+        {
+            part = frame.head.get() + frame.sent;
+            partLen = frame.headLen - frame.sent;
+        }
+        else
+        {
+            part = frame.payload + (frame.sent - frame.headLen);
+            partLen = frame.total() - frame.sent;
+        }
+
+        size_t n = _client.add(reinterpret_cast<const char *>(part), std::min(space, partLen), 0);
+        if (n == 0)
+        {
+            break;
+        }
+
+        added = true;
+        frame.sent += n;
+        _streamSent += n;
+
+        if (frame.sent == frame.total())
+        {
+            frame.endOffset = _streamSent;
+            frame.sentAt = millis();
+            _queuedBytes -= frame.total();
+            _unacked.push_back(std::move(frame));
+            _outbox.pop_front();
+        }
+    }
+
+    if (added)
+    {
+        _client.send();
+        _lastTx = millis();
+    }
+}
+
+void AsyncMqtt::handleAck(size_t len)
+{
+    DoneList delivered;
+
+    lock();
+    _streamAcked += len;
+    while (!_unacked.empty() && static_cast<int32_t>(_streamAcked - _unacked.front().endOffset) >= 0)
+    {
+        Frame &frame = _unacked.front();
+        if (frame.qos > 0 && frame.packetId && !frame.acked)
+        {
+            _inflight.push_back(std::move(frame));
+        }
+        else
+        {
+            if (frame.packetId)
+            {
+                _qosPending--;
+            }
+            if (frame.done)
+            {
+                delivered.push_back(frame.done);
+            }
+        }
+        _unacked.pop_front();
+    }
+    flush();
+    unlock();
+
+    runDone(delivered, true);
+}
+
+// -----------------------------------------------------------------------------
+// Incoming packets
+// -----------------------------------------------------------------------------
+
+void AsyncMqtt::handleData(const uint8_t *data, size_t len)
+{
+    _lastRx = millis();
+    _rx.insert(_rx.end(), data, data + len);
+
+    size_t pos = 0;
+    while (_rx.size() - pos >= 2)
+    {
+        size_t length = 0;
+        size_t multiplier = 1;
+        size_t i = pos + 1;
+        bool complete = false;
+        for (; i < _rx.size() && i < pos + 5; i++)
+        {
+            length += (_rx[i] & 0x7F) * multiplier;
+            multiplier *= 128;
+            if (!(_rx[i] & 0x80))
+            {
+                complete = true;
+                i++;
+                break;
+            }
+        }
+
+        if (!complete)
+        {
+            if (i >= pos + 5)
+            {
+                LOG("[MQTT] Malformed packet, closing");
+                _rx.clear();
+                _client.close();
+                return;
+            }
+            break;
+        }
+
+        if (length > MQTT_MAX_PACKET_SIZE)
+        {
+            LOGF("[MQTT] Packet of %u bytes exceeds MQTT_MAX_PACKET_SIZE, closing\n", length);
+            _rx.clear();
+            _client.close();
+            return;
+        }
+
+        if (_rx.size() - i < length)
+        {
+            break;
+        }
+
+        handlePacket(_rx[pos], _rx.data() + i, length);
+        pos = i + length;
+    }
+
+    _rx.erase(_rx.begin(), _rx.begin() + pos);
+}
+
+void AsyncMqtt::handlePacket(uint8_t header, const uint8_t *body, size_t length)
+{
+    switch (header & 0xF0)
+    {
+    case MQTT_CONNACK:
+    {
+        uint8_t rc = length >= 2 ? body[1] : 0xFF;
+        if (rc != 0)
+        {
+            LOGF("[MQTT] Connection refused, code %u\n", rc);
+            _client.close();
+            return;
+        }
+
+        lock();
+        _state = CONNECTED;
+        flush();
+        unlock();
+
+        if (_connectCb)
+        {
+            _connectCb();
+        }
+        break;
+    }
+
+    case MQTT_PUBLISH:
+    {
+        if (length < 2)
+        {
+            return;
+        }
+
+        uint8_t qos = (header >> 1) & 0x03;
+        size_t topicLen = (body[0] << 8) | body[1];
+        size_t offset = 2 + topicLen + (qos ? 2 : 0);
+        if (offset > length)
+        {
+            return;
+        }
+
+        uint8_t packetId[2] = {0, 0};
+        if (qos)
+        {
+            packetId[0] = body[2 + topicLen];
+            packetId[1] = body[3 + topicLen];
+        }
+
+        char topic[topicLen + 1];
+        memcpy(topic, body + 2, topicLen);
+        topic[topicLen] = '\0';
+
+        if (_messageCb)
+        {
+            _messageCb(topic, body + offset, length - offset);
+        }
+
+        if (qos)
+        {
+            lock();
+            enqueueControl(MQTT_PUBACK, packetId, 2, true);
+            flush();
+            unlock();
+        }
+        break;
+    }
+
+    case MQTT_PUBACK:
+    {
+        if (length < 2)
+        {
+            return;
+        }
+
+        uint16_t packetId = (body[0] << 8) | body[1];
+        DoneList delivered;
+
+        lock();
+        bool found = false;
+        for (auto it = _inflight.begin(); it != _inflight.end(); ++it)
+        {
+            if (it->packetId == packetId)
+            {
+                if (it->done)
+                {
+                    delivered.push_back(it->done);
+                }
+                _inflight.erase(it);
+                _qosPending--;
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+        {
+            // PUBACK overtook the TCP ack; release on the ack instead
+            for (auto &frame : _unacked)
+            {
+                if (frame.packetId == packetId)
+                {
+                    frame.acked = true;
+                    break;
+                }
+            }
+        }
+        flush();
+        unlock();
+
+        runDone(delivered, true);
+        break;
+    }
+
+    case MQTT_SUBACK:
+        break;
+
+    case MQTT_PINGRESP:
+        _pingOutstanding = false;
+        break;
+
+    default:
+        break;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Periodic housekeeping
+// -----------------------------------------------------------------------------
+
+void AsyncMqtt::loop()
+{
+    uint32_t now = millis();
+
+    if (connecting())
+    {
+        if (now - _lastTx >= MQTT_CONNECT_TIMEOUT_MS)
+        {
+            LOGW("[MQTT] Connect timeout\n");
+            _client.close(true);
+            handleTcpDisconnect();
+        }
+        return;
+    }
+
+    if (_state != CONNECTED)
+    {
+        return;
+    }
+
+    lock();
+
+    uint32_t keepAliveMs = static_cast<uint32_t>(_keepAlive) * 1000;
+    if (keepAliveMs)
+    {
+        if (_pingOutstanding && now - _lastRx >= keepAliveMs + keepAliveMs / 2)
+        {
+            unlock();
+            LOGW("[MQTT] Keep-alive timeout\n");
+            _client.close(true);
+            return;
+        }
+
+        if (!_pingOutstanding && now - _lastTx >= keepAliveMs * 3 / 4)
+        {
+            enqueueControl(MQTT_PINGREQ, nullptr, 0);
+            _pingOutstanding = true;
+        }
+    }
+
+    // Retransmit QoS 1 publishes whose PUBACK is overdue
+    while (!_inflight.empty() && now - _inflight.front().sentAt >= MQTT_RETRY_MS)
+    {
+        Frame frame = std::move(_inflight.front());
+        _inflight.pop_front();
+        frame.head[0] |= MQTT_FLAG_DUP;
+        frame.sent = 0;
+        enqueue(std::move(frame));
+    }
+
+    flush();
+    unlock();
+}
@@ -0,0 +1,101 @@
+#include <cmath>
+
+#include "autozero.h"
+#include "types.h"
+
+// -----------------------------------------------------------------------------
+// Automatic zero tracking
+//
+// Temperature and creep move the empty reading slowly. While the scale is
+// idle, settled and close to zero, the tare offset is nudged towards the
+// settled mean, by no more than the configured rate so a slowly added load is
+// never swallowed. Fractions of a count are carried between samples.
+// -----------------------------------------------------------------------------
+
+// Longest gap between samples that is still credited to the rate limit
+static constexpr uint32_t MAX_STEP_INTERVAL_MS = 100;
+
+static AutoZeroConfig config = {true, AUTOZERO_DEFAULT_BAND_G, AUTOZERO_DEFAULT_RATE_GPS};
+static portMUX_TYPE autoZeroMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Owned by the scale task
+static uint32_t lastStepMs = 0;
+// Written under the lock, a tare resets them from another task
+static float carryCounts = 0.0f;
+static uint32_t lastZeroMs = 0; // 0 = not at zero
+static float lastZeroG = 0.0f;
+static float driftG = 0.0f;
+static uint32_t taredMs = 0;
+
+void autoZeroConfigure(const AutoZeroConfig &next)
+{
+    portENTER_CRITICAL(&autoZeroMux);
+    config = next;
+    portEXIT_CRITICAL(&autoZeroMux);
+}
+
+AutoZeroConfig autoZeroConfig()
+{
+    portENTER_CRITICAL(&autoZeroMux);
+    AutoZeroConfig current = config;
+    portEXIT_CRITICAL(&autoZeroMux);
+    return current;
+}
+
+long autoZeroStep(float grams, const SettleState &settle, long offset, float countsPerGram, uint32_t timeMs, bool allowed)
+{
+    AutoZeroConfig c = autoZeroConfig();
+
+    uint32_t elapsedMs = min(timeMs - lastStepMs, MAX_STEP_INTERVAL_MS);
+    lastStepMs = timeMs;
+
+    float netCounts = settle.meanRaw - offset;
+    float netG = countsPerGram != 0.0f ? netCounts / countsPerGram : 0.0f;
+    bool atZero = settle.settled && fabsf(netG) <= c.bandG && fabsf(grams) <= c.bandG;
+
+    long step = 0;
+    portENTER_CRITICAL(&autoZeroMux);
+    if (atZero && allowed && c.enabled)
+    {
+        float limit = c.rateGps * elapsedMs / 1000.0f * fabsf(countsPerGram);
+        carryCounts += constrain(netCounts, -limit, limit);
+        step = static_cast<long>(carryCounts);
+        carryCounts -= step;
+    }
+    lastZeroMs = atZero ? timeMs : 0;
+    lastZeroG = netG;
+    driftG += step / countsPerGram;
+    portEXIT_CRITICAL(&autoZeroMux);
+
+    return step;
+}
+
+void autoZeroTared(uint32_t timeMs)
+{
+    portENTER_CRITICAL(&autoZeroMux);
+    driftG = 0.0f;
+    taredMs = timeMs;
+    carryCounts = 0.0f;
+    portEXIT_CRITICAL(&autoZeroMux);
+}
+
+bool autoZeroCanSkipTare(uint32_t timeMs)
+{
+    portENTER_CRITICAL(&autoZeroMux);
+    bool skip = config.enabled && lastZeroMs != 0 && timeMs - lastZeroMs <= AUTOZERO_FRESH_MS && fabsf(lastZeroG) <= AUTOZERO_SKIP_TARE_G;
+    portEXIT_CRITICAL(&autoZeroMux);
+    return skip;
+}
+
+AutoZeroStatus autoZeroStatus(uint32_t timeMs)
+{
+    AutoZeroStatus status;
+    portENTER_CRITICAL(&autoZeroMux);
+    status.driftG = driftG;
+    status.atZero = lastZeroMs != 0;
+    uint32_t sinceTareMs = timeMs - taredMs;
+    portEXIT_CRITICAL(&autoZeroMux);
+
+    status.driftRateGpm = sinceTareMs > 0 ? status.driftG * 60000.0f / sinceTareMs : 0.0f;
+    return status;
+}
@@ -0,0 +1,314 @@
+#include "batch.h"
+#include "presets.h"
+#include "types.h"
+
+// -----------------------------------------------------------------------------
+// Batch grinding
+//
+// A list of doses ground back to back. This module only keeps the queue and
+// its results; the main loop moves through the phases, driven by the cup
+// detector, and grinds each job like a normal start.
+// -----------------------------------------------------------------------------
+
+static BatchJob jobs[BATCH_MAX_JOBS];
+static uint8_t jobCount = 0;
+static uint32_t batchId = 0;
+static BatchPhase phase = BATCH_NONE;
+static uint32_t revision = 0;
+static portMUX_TYPE batchMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Index of the first job not done yet, jobCount if none; call with batchMux held
+static uint8_t currentIndex()
+{
+    uint8_t i = 0;
+    while (i < jobCount && jobs[i].status != BATCH_JOB_PENDING && jobs[i].status != BATCH_JOB_GRINDING)
+    {
+        i++;
+    }
+    return i;
+}
+
+// "left"/"right" for the favourites, a preset name or a table index
+static bool presetIndexFromJson(JsonVariantConst value, uint8_t *index)
+{
+    if (value.is<int>())
+    {
+        int number = value.as<int>();
+        *index = static_cast<uint8_t>(number);
+        return number >= 0 && number < presetCount();
+    }
+
+    const char *name = value.as<const char *>();
+    if (strcmp(name, "left") == 0 || strcmp(name, "right") == 0)
+    {
+        *index = presetFavourite(strcmp(name, "left") == 0 ? SMALL : LARGE);
+        return true;
+    }
+
+    Preset preset;
+    for (uint8_t i = 0; presetGet(i, &preset); i++)
+    {
+        if (strcmp(name, preset.name) == 0)
+        {
+            *index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool jobFromJson(JsonVariantConst value, BatchJob &job)
+{
+    // A bare number is a target; an index needs {"preset": n}
+    bool object = value.is<JsonObjectConst>();
+    JsonVariantConst preset = object ? value["preset"] : value;
+    JsonVariantConst target = object ? value["target"] : value;
+
+    job = {};
+    if (preset.is<const char *>() || (object && preset.is<int>()))
+    {
+        Preset entry;
+        if (!presetIndexFromJson(preset, &job.preset) || !presetGet(job.preset, &entry))
+        {
+            return false;
+        }
+        job.target = entry.target;
+        return true;
+    }
+
+    if (!target.is<float>())
+    {
+        return false;
+    }
+    long steps = lroundf(target.as<float>() * 10.0f);
+    if (steps < MIN_PRESET_WEIGHT || steps > MAX_PRESET_WEIGHT)
+    {
+        return false;
+    }
+    job.preset = BATCH_NO_PRESET;
+    job.target = static_cast<uint16_t>(steps);
+    return true;
+}
+
+const char *batchFromJson(JsonVariantConst body, uint8_t selectedPreset, BatchJob *out, uint8_t *count)
+{
+    *count = 0;
+
+    if (body["jobs"].is<JsonArrayConst>())
+    {
+        for (JsonVariantConst value : body["jobs"].as<JsonArrayConst>())
+        {
+            if (*count >= BATCH_MAX_JOBS)
+            {
+                return "too many jobs";
+            }
+            if (!jobFromJson(value, out[*count]))
+            {
+                return "job needs a preset (left/right, name or index) or a target in grams";
+            }
+            (*count)++;
+        }
+        return *count > 0 ? nullptr : "no jobs";
+    }
+
+    // N times the same dose
+    int repeat = body.is<int>() ? body.as<int>() : (body["count"] | 0);
+    if (repeat < 1 || repeat > BATCH_MAX_JOBS)
+    {
+        return "count out of range";
+    }
+
+    Preset selected = presetDefaults();
+    presetGet(selectedPreset, &selected);
+    BatchJob job = {};
+    job.preset = selectedPreset;
+    job.target = selected.target;
+    if (body.is<JsonObjectConst>() && (!body["preset"].isNull() || !body["target"].isNull()) && !jobFromJson(body, job))
+    {
+        return "job needs a preset (left/right, name or index) or a target in grams";
+    }
+
+    for (uint8_t i = 0; i < repeat; i++)
+    {
+        out[i] = job;
+    }
+    *count = repeat;
+    return nullptr;
+}
+
+bool batchSubmit(const BatchJob *next, uint8_t count, BatchPhase first)
+{
+    portENTER_CRITICAL(&batchMux);
+    bool busy = phase != BATCH_NONE;
+    if (!busy)
+    {
+        jobCount = min(count, BATCH_MAX_JOBS);
+        for (uint8_t i = 0; i < jobCount; i++)
+        {
+            jobs[i] = next[i];
+            jobs[i].status = BATCH_JOB_PENDING;
+        }
+        batchId++;
+        phase = first;
+        revision++;
+    }
+    portEXIT_CRITICAL(&batchMux);
+
+    if (!busy)
+    {
+        LOGF("[BATCH] %u doses queued\n", count);
+    }
+    return !busy;
+}
+
+void batchCancel()
+{
+    portENTER_CRITICAL(&batchMux);
+    for (uint8_t i = currentIndex(); i < jobCount; i++)
+    {
+        jobs[i].status = BATCH_JOB_ABORTED;
+    }
+    phase = BATCH_NONE;
+    revision++;
+    portEXIT_CRITICAL(&batchMux);
+}
+
+bool batchActive()
+{
+    return batchPhase() != BATCH_NONE;
+}
+
+BatchPhase batchPhase()
+{
+    portENTER_CRITICAL(&batchMux);
+    BatchPhase current = phase;
+    portEXIT_CRITICAL(&batchMux);
+    return current;
+}
+
+void batchSetPhase(BatchPhase next)
+{
+    portENTER_CRITICAL(&batchMux);
+    if (phase != BATCH_NONE && phase != next)
+    {
+        phase = next;
+        revision++;
+    }
+    portEXIT_CRITICAL(&batchMux);
+}
+
+bool batchCurrentJob(BatchJob *job)
+{
+    portENTER_CRITICAL(&batchMux);
+    uint8_t i = currentIndex();
+    bool found = phase != BATCH_NONE && i < jobCount;
+    if (found)
+    {
+        *job = jobs[i];
+    }
+    portEXIT_CRITICAL(&batchMux);
+    return found;
+}
+
+void batchJobStarted()
+{
+    portENTER_CRITICAL(&batchMux);
+    uint8_t i = currentIndex();
+    if (phase != BATCH_NONE && i < jobCount)
+    {
+        jobs[i].status = BATCH_JOB_GRINDING;
+        phase = BATCH_GRINDING;
+        revision++;
+    }
+    portEXIT_CRITICAL(&batchMux);
+}
+
+void batchJobFinished(int16_t actualCg, uint32_t durationMs, bool completed)
+{
+    portENTER_CRITICAL(&batchMux);
+    uint8_t i = currentIndex();
+    if (phase != BATCH_NONE && i < jobCount)
+    {
+        jobs[i].status = completed ? BATCH_JOB_DONE : BATCH_JOB_ABORTED;
+        jobs[i].actual = actualCg;
+        jobs[i].durationMs = durationMs;
+
+        if (!completed)
+        {
+            for (uint8_t k = i + 1; k < jobCount; k++)
+            {
+                jobs[k].status = BATCH_JOB_ABORTED;
+            }
+        }
+        phase = currentIndex() < jobCount ? BATCH_WAIT_REMOVAL : BATCH_NONE;
+        revision++;
+    }
+    portEXIT_CRITICAL(&batchMux);
+}
+
+void batchToJson(JsonObject out)
+{
+    BatchJob copy[BATCH_MAX_JOBS];
+    portENTER_CRITICAL(&batchMux);
+    uint8_t count = jobCount;
+    uint32_t id = batchId;
+    BatchPhase current = phase;
+    memcpy(copy, jobs, sizeof(copy));
+    portEXIT_CRITICAL(&batchMux);
+
+    static const char *const STATUS_NAMES[] = {"pending", "grinding", "done", "aborted"};
+
+    uint8_t done = 0;
+    out["id"] = id;
+    out["phase"] = batchPhaseToString(current);
+    out["count"] = count;
+    JsonArray list = out["jobs"].to<JsonArray>();
+    for (uint8_t i = 0; i < count; i++)
+    {
+        const BatchJob &job = copy[i];
+        JsonObject entry = list.add<JsonObject>();
+        entry["target"] = job.target / 10.0f;
+        if (job.preset != BATCH_NO_PRESET)
+        {
+            entry["preset"] = job.preset;
+        }
+        entry["status"] = STATUS_NAMES[job.status];
+        if (job.status == BATCH_JOB_DONE || (job.status == BATCH_JOB_ABORTED && job.durationMs > 0))
+        {
+            entry["actual"] = job.actual / 100.0f;
+            entry["duration_ms"] = job.durationMs;
+        }
+        done += job.status == BATCH_JOB_DONE;
+    }
+    out["done"] = done;
+}
+
+uint32_t batchRevision()
+{
+    portENTER_CRITICAL(&batchMux);
+    uint32_t current = revision;
+    portEXIT_CRITICAL(&batchMux);
+    return current;
+}
+
+void batchProgress(uint8_t *current, uint8_t *count)
+{
+    portENTER_CRITICAL(&batchMux);
+    bool active = phase != BATCH_NONE;
+    *current = active ? min<uint8_t>(currentIndex() + 1, jobCount) : 0;
+    *count = active ? jobCount : 0;
+    portEXIT_CRITICAL(&batchMux);
+}
+
+const char *batchPhaseToString(BatchPhase value)
+{
+    switch (value)
+    {
+    case BATCH_NONE: return "none";
+    case BATCH_WAIT_REMOVAL: return "wait_removal";
+    case BATCH_WAIT_CUP: return "wait_cup";
+    case BATCH_ARMED: return "armed";
+    case BATCH_GRINDING: return "grinding";
+    }
+    return "unknown";
+}
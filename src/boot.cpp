@@ -0,0 +1,39 @@
+#include <atomic>
+
+#include "boot.h"
+#include "types.h"
+
+static std::atomic<uint32_t> marks[BOOT_PHASE_COUNT];
+
+void bootMark(BootPhase phase)
+{
+    // millis() can still be 0 right after reset, which would read as "not reached"
+    uint32_t now = max<uint32_t>(millis(), 1);
+    uint32_t expected = 0;
+    if (marks[phase].compare_exchange_strong(expected, now))
+    {
+        LOGF("[BOOT] %s after %lu ms\n", bootPhaseName(phase), now);
+    }
+}
+
+uint32_t bootTimestamp(BootPhase phase)
+{
+    return marks[phase];
+}
+
+const char *bootPhaseName(BootPhase phase)
+{
+    switch (phase)
+    {
+    case BOOT_SETUP: return "setup";
+    case BOOT_DISPLAY: return "display";
+    case BOOT_GRIND_READY: return "grind_ready";
+    case BOOT_NETWORK_STARTED: return "network_started";
+    case BOOT_WIFI_CONNECTED: return "wifi_connected";
+    case BOOT_MQTT_CONNECTED: return "mqtt_connected";
+    case BOOT_TARE_VERIFIED: return "tare_verified";
+    case BOOT_FIRST_GRIND: return "first_grind";
+    case BOOT_PHASE_COUNT: break;
+    }
+    return "unknown";
+}
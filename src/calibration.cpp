@@ -0,0 +1,492 @@
+#include <Preferences.h>
+
+#include <cmath>
+
+#include "calibration.h"
+#include "types.h"
+
+// -----------------------------------------------------------------------------
+// Scale calibration
+//
+// Reference weights are measured as HX711 counts relative to a settled tare,
+// so every model passes through the tare point and the scale keeps reading 0 g
+// after each tare. The fit is done once in double precision; per sample the
+// model is evaluated in integers (micrograms, Q16 slopes), which costs a few
+// multiplies and matches the residuals reported for the fit to the microgram.
+// -----------------------------------------------------------------------------
+
+static constexpr uint8_t CALIBRATION_VERSION = 1;
+static constexpr uint8_t MAX_KNOTS = CALIBRATION_MAX_POINTS + 1;
+
+// HX711 conversions are 24-bit; anything outside is a read error
+static constexpr int32_t MAX_NET_COUNTS = 1L << 23;
+// Keeps net * slope inside int64 for any model we accept
+static constexpr int64_t MAX_SLOPE_Q16 = 1LL << 39;
+
+// What is written to NVS: the points and the fitted coefficients
+struct StoredCalibration
+{
+    uint8_t version;
+    CalibrationMode mode;
+    uint8_t count;
+    uint8_t reserved;
+    int32_t zeroCounts;
+    float gain;      // g/count
+    float curvature; // g/count^2
+    CalibrationPoint points[CALIBRATION_MAX_POINTS];
+};
+
+// What the scale task evaluates
+struct FixedModel
+{
+    CalibrationMode mode;
+    uint8_t knots;
+    int32_t knotCounts[MAX_KNOTS];
+    int32_t knotMicrograms[MAX_KNOTS];
+    int64_t knotSlope[MAX_KNOTS]; // Q16 ug/count towards the next knot
+    int64_t gain;                 // Q16 ug/count
+    int32_t curve;                // ug/count^2, scaled by 2^curveShift
+    uint8_t curveShift;
+    float countsPerGram;
+};
+
+static StoredCalibration active;
+static FixedModel model;
+static portMUX_TYPE calibrationMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Points of the session in progress, sorted by weight
+static CalibrationPoint pending[CALIBRATION_MAX_POINTS];
+static uint8_t pendingCount = 0;
+static int32_t pendingZero = 0;
+
+// -----------------------------------------------------------------------------
+// Fixed-point model
+// -----------------------------------------------------------------------------
+
+static int32_t evaluate(const FixedModel &m, int32_t net)
+{
+    net = constrain(net, -MAX_NET_COUNTS, MAX_NET_COUNTS);
+
+    int64_t ug;
+    if (m.mode == CALIBRATION_TABLE)
+    {
+        // Outside the table the first and last segments are extended
+        uint8_t i = 0;
+        while (i + 2 < m.knots && net >= m.knotCounts[i + 1])
+        {
+            i++;
+        }
+        ug = m.knotMicrograms[i] + ((static_cast<int64_t>(net - m.knotCounts[i]) * m.knotSlope[i]) >> 16);
+    }
+    else
+    {
+        // Horner: net * (gain + curve * net)
+        int64_t slope = m.gain + ((static_cast<int64_t>(net) * m.curve) >> (m.curveShift - 16));
+        slope = constrain(slope, -MAX_SLOPE_Q16, MAX_SLOPE_Q16);
+        ug = (static_cast<int64_t>(net) * slope) >> 16;
+    }
+
+    return static_cast<int32_t>(constrain(ug, static_cast<int64_t>(INT32_MIN), static_cast<int64_t>(INT32_MAX)));
+}
+
+// Zero knot plus every point, ascending by counts
+static uint8_t collectKnots(const StoredCalibration &c, int32_t *counts, float *grams)
+{
+    uint8_t n = 0;
+    counts[n] = 0;
+    grams[n] = 0.0f;
+    n++;
+    for (uint8_t i = 0; i < c.count; i++)
+    {
+        uint8_t j = n++;
+        while (j > 0 && counts[j - 1] > c.points[i].counts)
+        {
+            counts[j] = counts[j - 1];
+            grams[j] = grams[j - 1];
+            j--;
+        }
+        counts[j] = c.points[i].counts;
+        grams[j] = c.points[i].grams;
+    }
+    return n;
+}
+
+static FixedModel buildModel(const StoredCalibration &c)
+{
+    FixedModel m = {};
+    m.mode = c.mode;
+
+    if (c.mode == CALIBRATION_TABLE)
+    {
+        float grams[MAX_KNOTS];
+        m.knots = collectKnots(c, m.knotCounts, grams);
+
+        uint8_t zero = 0;
+        for (uint8_t i = 0; i < m.knots; i++)
+        {
+            m.knotMicrograms[i] = lroundf(grams[i] * 1e6f);
+            if (m.knotCounts[i] == 0)
+            {
+                zero = i;
+            }
+        }
+        for (uint8_t i = 0; i + 1 < m.knots; i++)
+        {
+            int64_t ug = static_cast<int64_t>(m.knotMicrograms[i + 1]) - m.knotMicrograms[i];
+            m.knotSlope[i] = ug * 65536 / (m.knotCounts[i + 1] - m.knotCounts[i]);
+        }
+        m.knotSlope[m.knots - 1] = m.knotSlope[m.knots - 2];
+
+        // Slope of the segment above the tare, or below it if all points are negative
+        uint8_t a = zero + 1 < m.knots ? zero : zero - 1;
+        m.countsPerGram = (m.knotCounts[a + 1] - m.knotCounts[a]) / (grams[a + 1] - grams[a]);
+        return m;
+    }
+
+    m.gain = llround(static_cast<double>(c.gain) * 1e6 * 65536.0);
+
+    // As many fractional bits as fit in 32 bits, but at least Q16
+    double curve = static_cast<double>(c.curvature) * 1e6;
+    m.curveShift = 48;
+    while (m.curveShift > 16 && fabs(ldexp(curve, m.curveShift)) >= 2147483647.0)
+    {
+        m.curveShift--;
+    }
+    m.curve = static_cast<int32_t>(constrain(llround(ldexp(curve, m.curveShift)), -2147483647LL, 2147483647LL));
+
+    m.countsPerGram = 1.0f / c.gain;
+    return m;
+}
+
+// -----------------------------------------------------------------------------
+// Fitting
+// -----------------------------------------------------------------------------
+
+// Weighted least squares through the tare point: minimise sum w (a n + b n^2 - g)^2
+static const char *fitPolynomial(StoredCalibration &c)
+{
+    double range = 0.0;
+    for (uint8_t i = 0; i < c.count; i++)
+    {
+        range = max(range, fabs(static_cast<double>(c.points[i].counts)));
+    }
+
+    // Counts are normalised to [-1, 1] to keep the normal equations well conditioned
+    double s11 = 0.0, s12 = 0.0, s22 = 0.0, s1g = 0.0, s2g = 0.0;
+    for (uint8_t i = 0; i < c.count; i++)
+    {
+        double t = c.points[i].counts / range;
+        double g = c.points[i].grams;
+        double relativeTo = max(g, static_cast<double>(CALIBRATION_RELATIVE_FLOOR_G));
+        double w = 1.0 / (relativeTo * relativeTo);
+        s11 += w * t * t;
+        s12 += w * t * t * t;
+        s22 += w * t * t * t * t;
+        s1g += w * t * g;
+        s2g += w * t * t * g;
+    }
+
+    double a = 0.0, b = 0.0;
+    if (c.mode == CALIBRATION_LINEAR)
+    {
+        a = s1g / s11;
+    }
+    else
+    {
+        double det = s11 * s22 - s12 * s12;
+        if (fabs(det) < 1e-9 * s11 * s22)
+        {
+            return "references too close together for a quadratic fit";
+        }
+        a = (s1g * s22 - s2g * s12) / det;
+        b = (s11 * s2g - s12 * s1g) / det;
+    }
+
+    if (!std::isfinite(a) || a == 0.0 || fabs(a / range) > 1.0)
+    {
+        return "references read less than one count per gram";
+    }
+    if (fabs(b) > 0.5 * fabs(a))
+    {
+        return "readings too curved for a quadratic fit, use a table";
+    }
+
+    c.gain = static_cast<float>(a / range);
+    c.curvature = static_cast<float>(b / (range * range));
+    return nullptr;
+}
+
+static const char *checkTable(const StoredCalibration &c)
+{
+    int32_t counts[MAX_KNOTS];
+    float grams[MAX_KNOTS];
+    uint8_t n = collectKnots(c, counts, grams);
+
+    float direction = grams[1] - grams[0];
+    for (uint8_t i = 0; i + 1 < n; i++)
+    {
+        if (counts[i + 1] == counts[i])
+        {
+            return "two references read the same";
+        }
+        if ((grams[i + 1] - grams[i]) * direction <= 0.0f)
+        {
+            return "readings are not monotonic";
+        }
+    }
+    return nullptr;
+}
+
+// Model minus reference at every point; a table passes through its points, so
+// each interior point is predicted from its neighbours instead
+static void computeResiduals(StoredCalibration &c, const FixedModel &m)
+{
+    int32_t counts[MAX_KNOTS];
+    float grams[MAX_KNOTS];
+    uint8_t n = c.mode == CALIBRATION_TABLE ? collectKnots(c, counts, grams) : 0;
+
+    for (uint8_t i = 0; i < c.count; i++)
+    {
+        CalibrationPoint &p = c.points[i];
+        if (c.mode != CALIBRATION_TABLE)
+        {
+            p.residual = evaluate(m, p.counts) / 1e6f - p.grams;
+            continue;
+        }
+
+        p.residual = 0.0f;
+        for (uint8_t k = 1; k + 1 < n; k++)
+        {
+            if (counts[k] == p.counts)
+            {
+                float fraction = static_cast<float>(counts[k] - counts[k - 1]) / (counts[k + 1] - counts[k - 1]);
+                p.residual = grams[k - 1] + fraction * (grams[k + 1] - grams[k - 1]) - p.grams;
+            }
+        }
+    }
+}
+
+static float residualRms(const StoredCalibration &c)
+{
+    float sumSquares = 0.0f;
+    for (uint8_t i = 0; i < c.count; i++)
+    {
+        sumSquares += c.points[i].residual * c.points[i].residual;
+    }
+    return c.count > 0 ? sqrtf(sumSquares / c.count) : 0.0f;
+}
+
+static float residualMax(const StoredCalibration &c)
+{
+    float largest = 0.0f;
+    for (uint8_t i = 0; i < c.count; i++)
+    {
+        largest = max(largest, fabsf(c.points[i].residual));
+    }
+    return largest;
+}
+
+// -----------------------------------------------------------------------------
+// Persistence
+// -----------------------------------------------------------------------------
+
+static void persist(const StoredCalibration &c)
+{
+    Preferences store;
+    store.begin("calib", false);
+    store.putBytes("model", &c, sizeof(c));
+    store.end();
+}
+
+void setupCalibration(float legacyCountsPerGram)
+{
+    StoredCalibration c = {};
+
+    Preferences store;
+    store.begin("calib", true);
+    bool loaded = store.getBytes("model", &c, sizeof(c)) == sizeof(c) && c.version == CALIBRATION_VERSION &&
+                  c.count <= CALIBRATION_MAX_POINTS && c.mode <= CALIBRATION_TABLE && (c.mode != CALIBRATION_TABLE || c.count > 0);
+    store.end();
+
+    if (!loaded)
+    {
+        // Single factor from before multi-point calibration
+        memset(&c, 0, sizeof(c));
+        c.version = CALIBRATION_VERSION;
+        c.mode = CALIBRATION_LINEAR;
+        c.gain = 1.0f / (legacyCountsPerGram != 0.0f ? legacyCountsPerGram : 1.0f);
+    }
+
+    active = c;
+    model = buildModel(c);
+
+    LOGF("[CALIBRATION] %s, %u points, %.2f counts/g\n", calibrationModeToString(c.mode), c.count, model.countsPerGram);
+}
+
+// -----------------------------------------------------------------------------
+// Evaluation
+// -----------------------------------------------------------------------------
+
+int32_t calibrationMicrograms(int32_t net)
+{
+    portENTER_CRITICAL(&calibrationMux);
+    int32_t ug = evaluate(model, net);
+    portEXIT_CRITICAL(&calibrationMux);
+    return ug;
+}
+
+float calibrationGrams(int32_t net)
+{
+    return calibrationMicrograms(net) / 1e6f;
+}
+
+float calibrationCountsPerGram()
+{
+    portENTER_CRITICAL(&calibrationMux);
+    float countsPerGram = model.countsPerGram;
+    portEXIT_CRITICAL(&calibrationMux);
+    return countsPerGram;
+}
+
+CalibrationInfo calibrationInfo()
+{
+    StoredCalibration c;
+    portENTER_CRITICAL(&calibrationMux);
+    c = active;
+    portEXIT_CRITICAL(&calibrationMux);
+
+    CalibrationInfo info = {};
+    info.mode = c.mode;
+    info.count = c.count;
+    info.zeroCounts = c.zeroCounts;
+    info.gain = c.mode == CALIBRATION_TABLE ? 1.0f / calibrationCountsPerGram() : c.gain;
+    info.curvature = c.curvature;
+
+    memcpy(info.points, c.points, sizeof(info.points));
+    info.rmsResidual = residualRms(c);
+    info.maxResidual = residualMax(c);
+    return info;
+}
+
+// -----------------------------------------------------------------------------
+// Calibration session
+// -----------------------------------------------------------------------------
+
+void calibrationBegin(int32_t zeroCounts, bool keepPoints)
+{
+    pendingZero = zeroCounts;
+    pendingCount = 0;
+    if (!keepPoints)
+    {
+        return;
+    }
+
+    portENTER_CRITICAL(&calibrationMux);
+    pendingCount = active.count;
+    memcpy(pending, active.points, sizeof(pending));
+    portEXIT_CRITICAL(&calibrationMux);
+}
+
+const char *calibrationAddPoint(int32_t counts, float grams)
+{
+    if (!(grams > 0.0f) || grams > CALIBRATION_MAX_WEIGHT_G)
+    {
+        return "weight out of range";
+    }
+    if (fabsf(static_cast<float>(counts)) < grams)
+    {
+        return "no load detected";
+    }
+
+    CalibrationPoint point = {counts, grams, 0.0f};
+
+    for (uint8_t i = 0; i < pendingCount; i++)
+    {
+        if (fabsf(pending[i].grams - grams) <= CALIBRATION_SAME_WEIGHT_G)
+        {
+            pending[i] = point;
+            LOGF("[CALIBRATION] %.2f g = %ld counts (replaced)\n", grams, static_cast<long>(counts));
+            return nullptr;
+        }
+    }
+
+    if (pendingCount >= CALIBRATION_MAX_POINTS)
+    {
+        return "too many points";
+    }
+
+    uint8_t j = pendingCount++;
+    while (j > 0 && pending[j - 1].grams > grams)
+    {
+        pending[j] = pending[j - 1];
+        j--;
+    }
+    pending[j] = point;
+
+    LOGF("[CALIBRATION] %.2f g = %ld counts\n", grams, static_cast<long>(counts));
+    return nullptr;
+}
+
+const char *calibrationFit(CalibrationMode mode)
+{
+    StoredCalibration c = {};
+    c.version = CALIBRATION_VERSION;
+    c.mode = mode;
+    c.count = pendingCount;
+    c.zeroCounts = pendingZero;
+    memcpy(c.points, pending, sizeof(c.points));
+
+    if (c.count < (mode == CALIBRATION_QUADRATIC ? 2 : 1))
+    {
+        return mode == CALIBRATION_QUADRATIC ? "quadratic fit needs two references" : "no reference measured";
+    }
+
+    const char *error = mode == CALIBRATION_TABLE ? checkTable(c) : fitPolynomial(c);
+    if (error != nullptr)
+    {
+        return error;
+    }
+
+    FixedModel m = buildModel(c);
+    computeResiduals(c, m);
+
+    portENTER_CRITICAL(&calibrationMux);
+    active = c;
+    model = m;
+    portEXIT_CRITICAL(&calibrationMux);
+
+    persist(c);
+
+    LOGF("[CALIBRATION] %s fit over %u points: %.2f counts/g, residual rms %.3f g, max %.3f g\n", calibrationModeToString(mode), c.count,
+         m.countsPerGram, residualRms(c), residualMax(c));
+    return nullptr;
+}
+
+uint8_t calibrationPendingPoints()
+{
+    return pendingCount;
+}
+
+const char *calibrationModeToString(CalibrationMode mode)
+{
+    switch (mode)
+    {
+    case CALIBRATION_LINEAR: return "linear";
+    case CALIBRATION_QUADRATIC: return "quadratic";
+    case CALIBRATION_TABLE: return "table";
+    }
+    return "unknown";
+}
+
+bool calibrationModeFromString(const char *name, CalibrationMode *mode)
+{
+    for (uint8_t i = CALIBRATION_LINEAR; i <= CALIBRATION_TABLE; i++)
+    {
+        if (strcmp(name, calibrationModeToString(static_cast<CalibrationMode>(i))) == 0)
+        {
+            *mode = static_cast<CalibrationMode>(i);
+            return true;
+        }
+    }
+    return false;
+}
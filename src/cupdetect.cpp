@@ -0,0 +1,126 @@
+#include <atomic>
+#include <cmath>
+
+#include "cupdetect.h"
+#include "types.h"
+
+// -----------------------------------------------------------------------------
+// Cup detection
+//
+// Works on raw counts against its own reference of the empty scale, so tares
+// taken in between do not matter. Placing a cup is a step up that is reported
+// once the scale has settled; lifting it is reported after CUP_REMOVE_SAMPLES
+// samples, without waiting for anything to settle.
+// -----------------------------------------------------------------------------
+
+enum DetectorState : uint8_t
+{
+    DETECT_EMPTY,
+    DETECT_PLACING,
+    DETECT_CUP,
+};
+
+static CupDetectConfig config = {false, CUP_DEFAULT_MIN_WEIGHT_G, CUP_DEFAULT_ARM_DELAY_MS};
+static portMUX_TYPE cupMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Owned by the scale task
+static DetectorState detector = DETECT_EMPTY;
+static bool haveEmptyRaw = false;
+static float emptyRaw = 0.0f;
+static uint8_t belowSamples = 0;
+
+static std::atomic<uint8_t> pendingEvent{CUP_NONE};
+static std::atomic<bool> present{false};
+
+void cupDetectConfigure(const CupDetectConfig &next)
+{
+    portENTER_CRITICAL(&cupMux);
+    config = next;
+    portEXIT_CRITICAL(&cupMux);
+}
+
+CupDetectConfig cupDetectConfig()
+{
+    portENTER_CRITICAL(&cupMux);
+    CupDetectConfig current = config;
+    portEXIT_CRITICAL(&cupMux);
+    return current;
+}
+
+static void post(CupEvent event)
+{
+    pendingEvent = event;
+    present = event == CUP_PLACED;
+}
+
+void cupDetectPush(int32_t raw, const SettleState &settle, float countsPerGram)
+{
+    if (countsPerGram == 0.0f)
+    {
+        return;
+    }
+
+    if (!haveEmptyRaw)
+    {
+        haveEmptyRaw = settle.settled;
+        emptyRaw = settle.meanRaw;
+        return;
+    }
+
+    float half = cupDetectConfig().minWeightG / 2.0f;
+    float grossG = (raw - emptyRaw) / countsPerGram;
+
+    // Below half the cup weight with a cup, or that far below the reference
+    // when a cup was already there before the reference was taken
+    float removedBelow = detector == DETECT_CUP ? half : -half;
+    belowSamples = grossG < removedBelow ? min<uint8_t>(belowSamples + 1, UINT8_MAX) : 0;
+
+    switch (detector)
+    {
+    case DETECT_EMPTY:
+        if (grossG >= 2.0f * half)
+        {
+            detector = DETECT_PLACING;
+        }
+        else if (belowSamples == CUP_REMOVE_SAMPLES)
+        {
+            post(CUP_REMOVED);
+        }
+        else if (settle.settled)
+        {
+            emptyRaw = settle.meanRaw;
+        }
+        break;
+
+    case DETECT_PLACING:
+        if (grossG < half)
+        {
+            detector = DETECT_EMPTY;
+        }
+        else if (settle.settled && (settle.meanRaw - emptyRaw) / countsPerGram >= 2.0f * half)
+        {
+            detector = DETECT_CUP;
+            post(CUP_PLACED);
+        }
+        break;
+
+    case DETECT_CUP:
+        if (belowSamples >= CUP_REMOVE_SAMPLES)
+        {
+            detector = DETECT_EMPTY;
+            belowSamples = 0;
+            post(CUP_REMOVED);
+        }
+        break;
+    }
+}
+
+CupEvent cupDetectTakeEvent()
+{
+    return static_cast<CupEvent>(pendingEvent.exchange(CUP_NONE));
+}
+
+bool cupDetectPresent()
+{
+    return present;
+}
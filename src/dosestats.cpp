@@ -0,0 +1,266 @@
+#include <Preferences.h>
+
+#include <cmath>
+
+#include "dosestats.h"
+#include "types.h"
+
+// -----------------------------------------------------------------------------
+// Dose statistics
+//
+// Constant memory per preset, however many grinds: Welford's running mean and
+// variance plus fixed-bin histograms for the percentiles. When a bin would
+// overflow, all bins of that histogram are halved, which keeps the shape and
+// slowly favours recent grinds.
+// -----------------------------------------------------------------------------
+
+struct RunningStats
+{
+    uint32_t count;
+    double mean;
+    double m2;
+
+    void add(double x)
+    {
+        count++;
+        double delta = x - mean;
+        mean += delta / count;
+        m2 += delta * (x - mean);
+    }
+
+    float stddev() const
+    {
+        return count > 1 ? static_cast<float>(sqrt(m2 / (count - 1))) : 0.0f;
+    }
+};
+
+template <uint8_t N>
+struct Histogram
+{
+    uint16_t bins[N + 2]; // [0] below range, [N + 1] above
+
+    void add(int32_t bin)
+    {
+        uint8_t index = static_cast<uint8_t>(constrain(bin + 1, 0L, static_cast<long>(N + 1)));
+        if (bins[index] == UINT16_MAX)
+        {
+            for (auto &count : bins)
+            {
+                count /= 2;
+            }
+        }
+        bins[index]++;
+    }
+
+    // Quantile in bin units relative to the lower range edge, interpolated within the bin
+    float quantile(float q) const
+    {
+        uint32_t total = 0;
+        for (auto count : bins)
+        {
+            total += count;
+        }
+        if (total == 0)
+        {
+            return 0.0f;
+        }
+
+        float rank = q * total;
+        uint32_t below = 0;
+        for (uint8_t i = 0; i < N + 2; i++)
+        {
+            if (below + bins[i] >= rank && bins[i] > 0)
+            {
+                // Out-of-range bins report the range edge
+                if (i == 0)
+                {
+                    return 0.0f;
+                }
+                if (i == N + 1)
+                {
+                    return N;
+                }
+                return (i - 1) + (rank - below) / bins[i];
+            }
+            below += bins[i];
+        }
+        return N;
+    }
+};
+
+struct PresetStats
+{
+    uint8_t version;
+    RunningStats error; // g
+    RunningStats time;  // s
+    Histogram<STATS_ERROR_BINS> errorBins;
+    Histogram<STATS_TIME_BINS> timeBins;
+};
+
+static constexpr uint8_t STATS_VERSION = 1;
+
+static PresetStats stats[STATS_PRESETS];
+static portMUX_TYPE statsMux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t revision = 0;
+static uint8_t unsavedGrinds = 0;
+static uint8_t unsavedPresets = 0; // bit per preset recorded since the last write
+static_assert(STATS_PRESETS <= 8, "unsavedPresets holds one bit per preset");
+
+static void statsKey(char *key, size_t size, uint8_t preset)
+{
+    snprintf(key, size, "p%u", preset);
+}
+
+void setupDoseStats()
+{
+    Preferences store;
+    store.begin("stats", true);
+    for (uint8_t i = 0; i < STATS_PRESETS; i++)
+    {
+        char key[8];
+        statsKey(key, sizeof(key), i);
+        if (store.getBytes(key, &stats[i], sizeof(PresetStats)) != sizeof(PresetStats) || stats[i].version != STATS_VERSION)
+        {
+            memset(&stats[i], 0, sizeof(PresetStats));
+            stats[i].version = STATS_VERSION;
+        }
+    }
+    store.end();
+
+    unsigned long grinds = 0;
+    for (const PresetStats &s : stats)
+    {
+        grinds += s.error.count;
+    }
+    LOGF("[STATS] %lu grinds\n", grinds);
+}
+
+// Only presets with new grinds are written
+static void persist()
+{
+    Preferences store;
+    store.begin("stats", false);
+    for (uint8_t i = 0; i < STATS_PRESETS; i++)
+    {
+        PresetStats copy;
+        portENTER_CRITICAL(&statsMux);
+        bool changed = (unsavedPresets & (1u << i)) != 0;
+        unsavedPresets &= ~(1u << i);
+        copy = stats[i];
+        portEXIT_CRITICAL(&statsMux);
+
+        if (!changed)
+        {
+            continue;
+        }
+
+        char key[8];
+        statsKey(key, sizeof(key), i);
+        store.putBytes(key, &copy, sizeof(copy));
+    }
+    store.end();
+}
+
+// Called once per finished grind; up to STATS_PERSIST_GRINDS - 1 grinds are lost on power loss
+void doseStatsRecord(uint8_t preset, int32_t errorCg, uint32_t durationMs)
+{
+    if (preset >= STATS_PRESETS)
+    {
+        return;
+    }
+
+    int32_t errorBin = errorCg - STATS_ERROR_MIN_CG;
+    errorBin = errorBin < 0 ? -1 : errorBin / STATS_ERROR_BIN_CG;
+
+    portENTER_CRITICAL(&statsMux);
+    PresetStats &s = stats[preset];
+    s.error.add(errorCg / 100.0);
+    s.time.add(durationMs / 1000.0);
+    s.errorBins.add(errorBin);
+    s.timeBins.add(durationMs / STATS_TIME_BIN_MS);
+    unsavedPresets |= 1u << preset;
+    revision++;
+    portEXIT_CRITICAL(&statsMux);
+
+    if (++unsavedGrinds >= STATS_PERSIST_GRINDS)
+    {
+        unsavedGrinds = 0;
+        persist();
+    }
+}
+
+void doseStatsRemap(const uint8_t *previous, uint8_t count)
+{
+    // Too large for the stack of the web server task
+    static PresetStats moved[STATS_PRESETS];
+
+    portENTER_CRITICAL(&statsMux);
+    for (uint8_t i = 0; i < STATS_PRESETS; i++)
+    {
+        uint8_t from = i < count ? previous[i] : PRESET_NEW;
+        if (from < STATS_PRESETS)
+        {
+            moved[i] = stats[from];
+        }
+        else
+        {
+            memset(&moved[i], 0, sizeof(PresetStats));
+            moved[i].version = STATS_VERSION;
+        }
+
+        if (memcmp(&moved[i], &stats[i], sizeof(PresetStats)) != 0)
+        {
+            unsavedPresets |= 1u << i;
+        }
+    }
+    memcpy(stats, moved, sizeof(stats));
+    revision++;
+    bool changed = unsavedPresets != 0;
+    portEXIT_CRITICAL(&statsMux);
+
+    if (changed)
+    {
+        unsavedGrinds = 0;
+        persist();
+    }
+}
+
+DoseStatsSummary doseStatsSummary(uint8_t preset)
+{
+    DoseStatsSummary summary = {};
+    if (preset >= STATS_PRESETS)
+    {
+        return summary;
+    }
+
+    PresetStats s;
+    portENTER_CRITICAL(&statsMux);
+    s = stats[preset];
+    portEXIT_CRITICAL(&statsMux);
+
+    // Errors are whole centigrams, so a bin holds values from its edge - 0.5 cg
+    auto errorAt = [&](float q) {
+        return (STATS_ERROR_MIN_CG - 0.5f + s.errorBins.quantile(q) * STATS_ERROR_BIN_CG) / 100.0f;
+    };
+    auto timeAt = [&](float q) {
+        return s.timeBins.quantile(q) * STATS_TIME_BIN_MS / 1000.0f;
+    };
+
+    summary.count = s.error.count;
+    summary.errorMean = s.error.mean;
+    summary.errorStddev = s.error.stddev();
+    summary.errorP50 = errorAt(0.50f);
+    summary.errorP95 = errorAt(0.95f);
+    summary.errorP99 = errorAt(0.99f);
+    summary.timeMean = s.time.mean;
+    summary.timeStddev = s.time.stddev();
+    summary.timeP50 = timeAt(0.50f);
+    summary.timeP95 = timeAt(0.95f);
+    summary.timeP99 = timeAt(0.99f);
+    return summary;
+}
+
+uint32_t doseStatsRevision()
+{
+    return revision;
+}
@@ -0,0 +1,147 @@
+#include <ArduinoJson.h>
+#include <Preferences.h>
+
+#include <atomic>
+
+#include "asyncmqtt.h"
+#include "eventqueue.h"
+#include "presets.h"
+#include "types.h"
+
+// -----------------------------------------------------------------------------
+// Store-and-forward queue for completed grinds
+//
+// Every grind is written as exactly one NVS record into a ring of
+// EVENT_QUEUE_SIZE slots. Acknowledgements are not written separately: each
+// new record carries the acknowledgement watermark at the time it was written,
+// so delivery is at-least-once across reboots without extra flash writes.
+// -----------------------------------------------------------------------------
+
+extern AsyncMqtt mqttClient;
+extern String mqttIdentifier;
+
+static GrindEvent events[EVENT_QUEUE_SIZE];
+static uint32_t headSeq = 0; // last sequence written
+static std::atomic<uint32_t> ackedSeq{0};
+static std::atomic<uint32_t> sendingSeq{0}; // waiting for PUBACK, 0 = none
+static portMUX_TYPE eventsMux = portMUX_INITIALIZER_UNLOCKED;
+
+static void slotKey(char *key, size_t size, uint32_t slot)
+{
+    snprintf(key, size, "e%u", static_cast<unsigned>(slot));
+}
+
+// Load the ring and recover the head and acknowledgement watermark
+void setupEventQueue()
+{
+    Preferences store;
+    store.begin("events", true);
+
+    uint32_t acked = 0;
+    for (uint8_t i = 0; i < EVENT_QUEUE_SIZE; i++)
+    {
+        char key[8];
+        slotKey(key, sizeof(key), i);
+        if (store.getBytes(key, &events[i], sizeof(GrindEvent)) != sizeof(GrindEvent))
+        {
+            memset(&events[i], 0, sizeof(GrindEvent));
+            continue;
+        }
+
+        headSeq = max(headSeq, events[i].seq);
+        acked = max(acked, events[i].ackedSeq);
+    }
+
+    store.end();
+
+    if (headSeq > EVENT_QUEUE_SIZE && acked < headSeq - EVENT_QUEUE_SIZE)
+    {
+        acked = headSeq - EVENT_QUEUE_SIZE;
+    }
+    ackedSeq = acked;
+
+    LOGF("[EVENTS] %u pending grind events\n", headSeq - acked);
+}
+
+// Assign a sequence number and persist the event with a single NVS write
+void eventQueuePush(GrindEvent event)
+{
+    portENTER_CRITICAL(&eventsMux);
+    event.seq = ++headSeq;
+    event.ackedSeq = ackedSeq;
+    events[event.seq % EVENT_QUEUE_SIZE] = event;
+    portEXIT_CRITICAL(&eventsMux);
+
+    char key[8];
+    slotKey(key, sizeof(key), event.seq % EVENT_QUEUE_SIZE);
+
+    Preferences store;
+    store.begin("events", false);
+    store.putBytes(key, &event, sizeof(event));
+    store.end();
+
+    if (event.seq > EVENT_QUEUE_SIZE && ackedSeq < event.seq - EVENT_QUEUE_SIZE)
+    {
+        LOGW("[EVENTS] Queue full, dropped event %u\n", ackedSeq + 1);
+        ackedSeq = event.seq - EVENT_QUEUE_SIZE;
+    }
+}
+
+// Publish the oldest unacknowledged event; one at a time to keep the order
+void loopEventQueue()
+{
+    if (!mqttClient.connected() || sendingSeq != 0)
+    {
+        return;
+    }
+
+    uint32_t next = ackedSeq + 1;
+    GrindEvent event;
+
+    portENTER_CRITICAL(&eventsMux);
+    bool pending = next <= headSeq;
+    event = events[next % EVENT_QUEUE_SIZE];
+    portEXIT_CRITICAL(&eventsMux);
+
+    if (!pending)
+    {
+        return;
+    }
+
+    if (event.seq != next)
+    {
+        // Overwritten while offline
+        ackedSeq = next;
+        return;
+    }
+
+    JsonDocument doc;
+    doc["seq"] = event.seq;
+    doc["ts"] = event.timestamp;
+    Preset preset;
+    if (presetGet(event.preset, &preset))
+    {
+        doc["preset"] = preset.name;
+    }
+    doc["preset_index"] = event.preset;
+    doc["target"] = event.target / 10.0f;
+    doc["actual"] = event.actual / 100.0f;
+    doc["duration_ms"] = event.durationMs;
+
+    char payload[160];
+    serializeJson(doc, payload);
+
+    sendingSeq = next;
+    bool queued = mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/grind_event").c_str(), payload, false, 1, [next](bool delivered) {
+        if (delivered && ackedSeq < next)
+        {
+            ackedSeq = next;
+        }
+        sendingSeq = 0;
+    });
+
+    if (!queued)
+    {
+        sendingSeq = 0;
+    }
+}
@@ -0,0 +1,456 @@
+#include <esp_rom_crc.h>
+
+#include "firmwarewriter.h"
+#include "types.h"
+
+static const uint8_t GZIP_MAGIC[] = {0x1f, 0x8b};
+constexpr size_t GZIP_TRAILER_SIZE = 8; // CRC32 + uncompressed size
+
+enum GzipFlags : uint8_t
+{
+    GZIP_FHCRC = 0x02,
+    GZIP_FEXTRA = 0x04,
+    GZIP_FNAME = 0x08,
+    GZIP_FCOMMENT = 0x10
+};
+
+// Length of the gzip member header, 0 if more bytes are needed, -1 if invalid
+static int gzipHeaderLength(const uint8_t *buf, size_t len)
+{
+    if (len < 10)
+    {
+        return 0;
+    }
+
+    // Only deflate (method 8) exists in practice
+    if (buf[0] != GZIP_MAGIC[0] || buf[1] != GZIP_MAGIC[1] || buf[2] != 8)
+    {
+        return -1;
+    }
+
+    uint8_t flags = buf[3];
+    size_t pos = 10;
+
+    if (flags & GZIP_FEXTRA)
+    {
+        if (len < pos + 2)
+        {
+            return 0;
+        }
+        pos += 2 + (buf[pos] | (buf[pos + 1] << 8));
+    }
+
+    for (uint8_t field : {GZIP_FNAME, GZIP_FCOMMENT})
+    {
+        if (flags & field)
+        {
+            while (pos < len && buf[pos] != 0)
+            {
+                pos++;
+            }
+            if (pos >= len)
+            {
+                return 0;
+            }
+            pos++;
+        }
+    }
+
+    if (flags & GZIP_FHCRC)
+    {
+        pos += 2;
+    }
+
+    return pos <= len ? static_cast<int>(pos) : 0;
+}
+
+static uint32_t readLe32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+FirmwareWriter::~FirmwareWriter()
+{
+    release();
+}
+
+void FirmwareWriter::begin(size_t size)
+{
+    release();
+    _mode = DETECT;
+    _stage = GZ_HEADER;
+    _size = size;
+    _received = 0;
+    _written = 0;
+    _error = nullptr;
+    _headLen = 0;
+}
+
+bool FirmwareWriter::write(const uint8_t *data, size_t len)
+{
+    if (_error)
+    {
+        return false;
+    }
+    _received += len;
+
+    if (_mode == DETECT)
+    {
+        size_t take = min(len, sizeof(GZIP_MAGIC) - _headLen);
+        memcpy(_head + _headLen, data, take);
+        _headLen += take;
+        data += take;
+        len -= take;
+
+        if (_headLen < sizeof(GZIP_MAGIC))
+        {
+            return true;
+        }
+
+        if (!start())
+        {
+            return false;
+        }
+
+        if (_mode == RAW)
+        {
+            _headLen = 0;
+            if (!flash(_head, sizeof(GZIP_MAGIC)))
+            {
+                return false;
+            }
+        }
+    }
+
+    return _mode == RAW ? flash(data, len) : inflate(data, len);
+}
+
+bool FirmwareWriter::end()
+{
+    if (_error)
+    {
+        return false;
+    }
+
+    if (_mode == DETECT)
+    {
+        return fail("empty image");
+    }
+
+    if (_mode == GZIP && _stage != GZ_DONE)
+    {
+        return fail("truncated gzip image");
+    }
+
+    release();
+    if (!Update.end(true))
+    {
+        return fail(Update.errorString());
+    }
+
+    LOGF("[FW] %u bytes received, %u bytes written\n", _received, _written);
+    return true;
+}
+
+void FirmwareWriter::abort()
+{
+    if (_mode != DETECT)
+    {
+        Update.abort();
+    }
+    release();
+}
+
+// Pick raw or gzip from the first bytes and open the update partition
+bool FirmwareWriter::start()
+{
+    _mode = memcmp(_head, GZIP_MAGIC, sizeof(GZIP_MAGIC)) == 0 ? GZIP : RAW;
+
+    // The inflated size is only known at the end; reserve the whole slot
+    if (!Update.begin(_mode == GZIP ? UPDATE_SIZE_UNKNOWN : _size))
+    {
+        return fail(Update.errorString());
+    }
+
+    if (_mode == GZIP)
+    {
+        _inflator = static_cast<tinfl_decompressor *>(malloc(sizeof(tinfl_decompressor)));
+        _dict = static_cast<uint8_t *>(malloc(TINFL_LZ_DICT_SIZE));
+        if (!_inflator || !_dict)
+        {
+            return fail("out of memory");
+        }
+        tinfl_init(_inflator);
+        _dictOfs = 0;
+        _crc = 0;
+        _stage = GZ_HEADER;
+    }
+
+    LOGF("[FW] Receiving %s image\n", _mode == GZIP ? "gzip" : "raw");
+    return true;
+}
+
+bool FirmwareWriter::flash(const uint8_t *data, size_t len)
+{
+    if (len == 0)
+    {
+        return true;
+    }
+
+    if (Update.write(const_cast<uint8_t *>(data), len) != len)
+    {
+        return fail(Update.errorString());
+    }
+    _written += len;
+    return true;
+}
+
+bool FirmwareWriter::inflate(const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        switch (_stage)
+        {
+        case GZ_HEADER:
+        {
+            size_t take = min(len, GZIP_MAX_HEADER - _headLen);
+            memcpy(_head + _headLen, data, take);
+            _headLen += take;
+
+            int headerLen = gzipHeaderLength(_head, _headLen);
+            if (headerLen < 0)
+            {
+                return fail("invalid gzip header");
+            }
+            if (headerLen == 0)
+            {
+                return _headLen < GZIP_MAX_HEADER ? true : fail("gzip header too long");
+            }
+
+            // Bytes past the header already belong to the deflate stream
+            size_t used = take - (_headLen - headerLen);
+            data += used;
+            len -= used;
+            _headLen = 0;
+            _stage = GZ_DEFLATE;
+            break;
+        }
+
+        case GZ_DEFLATE:
+            while (true)
+            {
+                size_t inSize = len;
+                size_t outSize = TINFL_LZ_DICT_SIZE - _dictOfs;
+                tinfl_status status = tinfl_decompress(_inflator, data, &inSize, _dict, _dict + _dictOfs, &outSize, TINFL_FLAG_HAS_MORE_INPUT);
+                data += inSize;
+                len -= inSize;
+
+                if (outSize > 0)
+                {
+                    _crc = esp_rom_crc32_le(_crc, _dict + _dictOfs, outSize);
+                    if (!flash(_dict + _dictOfs, outSize))
+                    {
+                        return false;
+                    }
+                    _dictOfs = (_dictOfs + outSize) & (TINFL_LZ_DICT_SIZE - 1);
+                }
+
+                if (status < TINFL_STATUS_DONE)
+                {
+                    return fail("corrupt gzip data");
+                }
+                if (status == TINFL_STATUS_DONE)
+                {
+                    _stage = GZ_TRAILER;
+                    break;
+                }
+                if (status == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0)
+                {
+                    return true;
+                }
+            }
+            break;
+
+        case GZ_TRAILER:
+        {
+            size_t take = min(len, GZIP_TRAILER_SIZE - _headLen);
+            memcpy(_head + _headLen, data, take);
+            _headLen += take;
+            data += take;
+            len -= take;
+
+            if (_headLen == GZIP_TRAILER_SIZE)
+            {
+                if (readLe32(_head) != _crc || readLe32(_head + 4) != static_cast<uint32_t>(_written))
+                {
+                    return fail("gzip CRC mismatch");
+                }
+                _stage = GZ_DONE;
+            }
+            break;
+        }
+
+        case GZ_DONE:
+            // Trailing padding after the gzip member is ignored
+            return true;
+        }
+    }
+    return true;
+}
+
+bool FirmwareWriter::fail(const char *error)
+{
+    _error = error;
+    LOGE("[FW] %s\n", error);
+    abort();
+    return false;
+}
+
+void FirmwareWriter::release()
+{
+    free(_inflator);
+    free(_dict);
+    _inflator = nullptr;
+    _dict = nullptr;
+}
+
+// -----------------------------------------------------------------------------
+// Double-buffered writer
+// -----------------------------------------------------------------------------
+
+void BufferedFirmwareWriter::begin(size_t size)
+{
+    if (!_full)
+    {
+        _full = xQueueCreate(3, sizeof(uint8_t));
+        _free = xSemaphoreCreateCounting(2, 2);
+        _stopped = xSemaphoreCreateBinary();
+    }
+
+    // A previous upload may have been cut off before its final chunk
+    if (_task)
+    {
+        stopTask();
+        _writer.abort();
+    }
+
+    _writer.begin(size);
+    _fill = -1;
+    _next = 0;
+    _received = 0;
+    _startMs = millis();
+    _flashMs = 0;
+    _stalls = 0;
+
+    xTaskCreatePinnedToCore(writerTask, "FlashWriter", 4096, this, 2, &_task, 1);
+}
+
+bool BufferedFirmwareWriter::write(const uint8_t *data, size_t len)
+{
+    _received += len;
+
+    while (len > 0 && !_writer.failed())
+    {
+        if (_fill < 0)
+        {
+            // Both blocks queued: wait for the flash to catch up
+            if (xSemaphoreTake(_free, 0) != pdTRUE)
+            {
+                _stalls++;
+                xSemaphoreTake(_free, portMAX_DELAY);
+            }
+            _fill = _next;
+            _next ^= 1;
+            _blocks[_fill].len = 0;
+        }
+
+        Block &block = _blocks[_fill];
+        size_t take = min(len, FIRMWARE_SECTOR_SIZE - block.len);
+        memcpy(block.data + block.len, data, take);
+        block.len += take;
+        data += take;
+        len -= take;
+
+        if (block.len == FIRMWARE_SECTOR_SIZE)
+        {
+            submit();
+        }
+    }
+    return !_writer.failed();
+}
+
+bool BufferedFirmwareWriter::end()
+{
+    if (_fill >= 0 && _blocks[_fill].len > 0)
+    {
+        submit();
+    }
+    stopTask();
+
+    return _writer.end();
+}
+
+void BufferedFirmwareWriter::abort()
+{
+    if (_task)
+    {
+        stopTask();
+        _writer.abort();
+    }
+}
+
+FirmwareWriteStats BufferedFirmwareWriter::stats() const
+{
+    return {_received, _writer.written(), static_cast<uint32_t>(millis() - _startMs), _flashMs, _stalls};
+}
+
+void BufferedFirmwareWriter::submit()
+{
+    uint8_t index = _fill;
+    _fill = -1;
+    xQueueSend(_full, &index, portMAX_DELAY);
+}
+
+// Let the task drain the queued blocks and exit
+void BufferedFirmwareWriter::stopTask()
+{
+    uint8_t stop = BLOCK_STOP;
+    xQueueSend(_full, &stop, portMAX_DELAY);
+    xSemaphoreTake(_stopped, portMAX_DELAY);
+    _task = nullptr;
+
+    // Return blocks that were taken but never submitted
+    while (uxSemaphoreGetCount(_free) < 2)
+    {
+        xSemaphoreGive(_free);
+    }
+    _fill = -1;
+    _next = 0;
+}
+
+void BufferedFirmwareWriter::writerTask(void *pvParameters)
+{
+    BufferedFirmwareWriter *self = static_cast<BufferedFirmwareWriter *>(pvParameters);
+
+    while (true)
+    {
+        uint8_t index;
+        xQueueReceive(self->_full, &index, portMAX_DELAY);
+        if (index == BLOCK_STOP)
+        {
+            break;
+        }
+
+        // Blocks after an error are drained without writing
+        if (!self->_writer.failed())
+        {
+            uint32_t start = millis();
+            self->_writer.write(self->_blocks[index].data, self->_blocks[index].len);
+            self->_flashMs += millis() - start;
+        }
+        xSemaphoreGive(self->_free);
+    }
+
+    xSemaphoreGive(self->_stopped);
+    vTaskDelete(NULL);
+}
@@ -0,0 +1,258 @@
+#include <LittleFS.h>
+
+#include "history.h"
+#include "types.h"
+
+// -----------------------------------------------------------------------------
+// Grind history
+//
+// Records are appended to numbered segment files below /history on the LittleFS
+// partition, which does the wear levelling. A record cut short by a power loss
+// can only be the last one of a segment; it is cut off at boot so appending
+// continues aligned with the sequence of the last complete record.
+// -----------------------------------------------------------------------------
+
+static const char *HISTORY_DIR = "/history";
+static const char *HISTORY_TEMP = "/history/partial.tmp";
+
+static bool mounted = false;
+static uint32_t firstSegment = 1;
+static uint32_t lastSegment = 1;
+static uint32_t lastSeq = 0;
+static SemaphoreHandle_t historyMutex = nullptr;
+
+static String segmentPath(uint32_t segment)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "%s/%08lu.bin", HISTORY_DIR, static_cast<unsigned long>(segment));
+    return String(path);
+}
+
+static bool readLastRecord(File &file, GrindRecord &record)
+{
+    size_t count = file.size() / sizeof(GrindRecord);
+    return count > 0 && file.seek((count - 1) * sizeof(GrindRecord)) &&
+           file.read(reinterpret_cast<uint8_t *>(&record), sizeof(record)) == sizeof(record);
+}
+
+// Drop a partial record at the end of a segment; LittleFS files cannot be
+// shortened in place, so the complete records are copied
+static void truncateSegment(uint32_t segment)
+{
+    String path = segmentPath(segment);
+    File file = LittleFS.open(path, FILE_READ);
+    if (!file)
+    {
+        return;
+    }
+
+    size_t keep = file.size() / sizeof(GrindRecord) * sizeof(GrindRecord);
+    LOGW("[HISTORY] Truncated record in segment %lu\n", static_cast<unsigned long>(segment));
+    if (keep == 0)
+    {
+        file.close();
+        LittleFS.remove(path);
+        return;
+    }
+
+    File copy = LittleFS.open(HISTORY_TEMP, FILE_WRITE);
+    uint8_t buffer[16 * sizeof(GrindRecord)];
+    size_t copied = 0;
+    while (copy && copied < keep)
+    {
+        size_t chunk = file.read(buffer, min(sizeof(buffer), keep - copied));
+        if (chunk == 0 || copy.write(buffer, chunk) != chunk)
+        {
+            break;
+        }
+        copied += chunk;
+    }
+    file.close();
+    copy.close();
+
+    if (copied == keep)
+    {
+        LittleFS.remove(path);
+        LittleFS.rename(HISTORY_TEMP, path);
+    }
+    else
+    {
+        LOGE("[HISTORY] Failed to truncate segment %lu\n", static_cast<unsigned long>(segment));
+        LittleFS.remove(HISTORY_TEMP);
+    }
+}
+
+const char *grindEndReasonToString(uint8_t reason)
+{
+    switch (reason)
+    {
+    case GRIND_END_FINISHED: return "finished";
+    case GRIND_END_EMPTY: return "empty";
+    case GRIND_END_PAUSED: return "paused";
+    case GRIND_END_BURST_LIMIT: return "burst_limit";
+    default: return "unknown";
+    }
+}
+
+// Mount LittleFS (formatting it on first use) and find the segment range
+void setupHistory()
+{
+    historyMutex = xSemaphoreCreateMutex();
+
+    if (!LittleFS.begin(true))
+    {
+        LOGE("[HISTORY] LittleFS mount failed\n");
+        return;
+    }
+    LittleFS.mkdir(HISTORY_DIR);
+    LittleFS.remove(HISTORY_TEMP);
+
+    uint32_t lowest = UINT32_MAX;
+    uint32_t highest = 0;
+    File dir = LittleFS.open(HISTORY_DIR);
+    for (File entry = dir.openNextFile(); entry; entry = dir.openNextFile())
+    {
+        uint32_t segment = strtoul(entry.name(), nullptr, 10);
+        if (segment > 0)
+        {
+            lowest = min(lowest, segment);
+            highest = max(highest, segment);
+        }
+    }
+
+    if (highest > 0)
+    {
+        firstSegment = lowest;
+        lastSegment = highest;
+
+        File file = LittleFS.open(segmentPath(lastSegment), FILE_READ);
+        bool partial = file && file.size() % sizeof(GrindRecord) != 0;
+        file.close();
+        if (partial)
+        {
+            truncateSegment(lastSegment);
+        }
+
+        // The newest segment may hold no complete record; continue the sequence
+        // of the last one stored, so paging with after= stays consistent
+        for (uint32_t segment = lastSegment; segment >= firstSegment && lastSeq == 0; segment--)
+        {
+            file = LittleFS.open(segmentPath(segment), FILE_READ);
+            GrindRecord record;
+            if (file && readLastRecord(file, record))
+            {
+                lastSeq = record.seq;
+            }
+            file.close();
+        }
+    }
+
+    mounted = true;
+    LOGF("[HISTORY] Segments %lu-%lu, last grind #%lu\n", static_cast<unsigned long>(firstSegment),
+         static_cast<unsigned long>(lastSegment), static_cast<unsigned long>(lastSeq));
+}
+
+void historyAppend(GrindRecord record)
+{
+    if (!mounted)
+    {
+        return;
+    }
+
+    xSemaphoreTake(historyMutex, portMAX_DELAY);
+
+    record.seq = ++lastSeq;
+    record.version = 1;
+
+    File file = LittleFS.open(segmentPath(lastSegment), FILE_APPEND);
+    if (file && file.size() + sizeof(record) > HISTORY_SEGMENT_SIZE)
+    {
+        file.close();
+        lastSegment++;
+        while (lastSegment - firstSegment >= HISTORY_MAX_SEGMENTS)
+        {
+            LittleFS.remove(segmentPath(firstSegment));
+            firstSegment++;
+        }
+        file = LittleFS.open(segmentPath(lastSegment), FILE_APPEND);
+    }
+
+    if (!file || file.write(reinterpret_cast<const uint8_t *>(&record), sizeof(record)) != sizeof(record))
+    {
+        LOGE("[HISTORY] Failed to append grind #%lu\n", static_cast<unsigned long>(record.seq));
+    }
+    file.close();
+
+    xSemaphoreGive(historyMutex);
+}
+
+// -----------------------------------------------------------------------------
+// Reading
+// -----------------------------------------------------------------------------
+
+HistoryReader::HistoryReader(uint32_t afterSeq, uint32_t from, uint32_t to)
+    : _segment(firstSegment), _afterSeq(afterSeq), _from(from), _to(to)
+{
+}
+
+bool HistoryReader::matches(const GrindRecord &record) const
+{
+    if (record.seq <= _afterSeq)
+    {
+        return false;
+    }
+    if (_from == 0 && _to == 0)
+    {
+        return true;
+    }
+    return record.timestamp != 0 && record.timestamp >= _from && (_to == 0 || record.timestamp <= _to);
+}
+
+// Open the next segment that can contain matching records
+bool HistoryReader::openNextSegment()
+{
+    while (mounted && _segment <= lastSegment)
+    {
+        // Segments deleted by rotation since the reader started are skipped
+        _segment = max(_segment, firstSegment);
+        _file = LittleFS.open(segmentPath(_segment++), FILE_READ);
+        if (!_file)
+        {
+            continue;
+        }
+
+        GrindRecord last;
+        if (!readLastRecord(_file, last) || last.seq <= _afterSeq ||
+            (_from != 0 && last.timestamp != 0 && last.timestamp < _from))
+        {
+            _file.close();
+            continue;
+        }
+
+        _file.seek(0);
+        return true;
+    }
+    return false;
+}
+
+bool HistoryReader::next(GrindRecord &record)
+{
+    while (true)
+    {
+        if (!_file && !openNextSegment())
+        {
+            return false;
+        }
+
+        if (_file.read(reinterpret_cast<uint8_t *>(&record), sizeof(record)) != sizeof(record))
+        {
+            _file.close();
+            continue;
+        }
+
+        if (matches(record))
+        {
+            return true;
+        }
+    }
+}
@@ -0,0 +1,303 @@
+#include <WiFi.h>
+
+#include <atomic>
+#include <cstdarg>
+#include <vector>
+
+#include "log.h"
+
+// -----------------------------------------------------------------------------
+// Log ring
+//
+// Bounded multi-producer queue of fixed-size slots. A producer claims a slot
+// with a single CAS on the enqueue position and formats straight into it; the
+// per-slot sequence number hands the slot to LogTask, the only consumer, and
+// back. Nothing here takes a lock or allocates.
+// -----------------------------------------------------------------------------
+
+// Must be a power of two
+constexpr uint32_t LOG_RING_SLOTS = 64;
+// Longer messages are truncated
+constexpr size_t LOG_MESSAGE_SIZE = 128;
+constexpr TickType_t LOG_DRAIN_INTERVAL = pdMS_TO_TICKS(10);
+
+static_assert((LOG_RING_SLOTS & (LOG_RING_SLOTS - 1)) == 0, "LOG_RING_SLOTS must be a power of two");
+
+static std::atomic<uint8_t> runtimeLevel{LOG_LEVEL_INFO};
+static std::atomic<uint32_t> droppedCount{0};
+
+void logSetLevel(uint8_t level)
+{
+    runtimeLevel = min<uint8_t>(level, LOG_LEVEL_DEBUG);
+}
+
+uint8_t logGetLevel()
+{
+    return runtimeLevel;
+}
+
+uint32_t logDropped()
+{
+    return droppedCount;
+}
+
+#if LOG_LEVEL > LOG_LEVEL_NONE
+
+struct LogSlot
+{
+    std::atomic<uint32_t> seq;
+    uint16_t length;
+    char text[LOG_MESSAGE_SIZE];
+};
+
+static LogSlot ring[LOG_RING_SLOTS];
+static std::atomic<uint32_t> enqueuePos{0};
+static uint32_t dequeuePos = 0; // LogTask only
+static std::atomic<bool> ready{false};
+
+static WiFiServer logServer(23);
+static std::vector<WiFiClient> clients; // LogTask only
+static std::atomic<bool> serverStarted{false};
+
+// Claim the next free slot, or nullptr if the ring is full
+static LogSlot *claimSlot(uint32_t &pos)
+{
+    if (!ready)
+    {
+        return nullptr;
+    }
+
+    pos = enqueuePos.load(std::memory_order_relaxed);
+    while (true)
+    {
+        LogSlot &slot = ring[pos & (LOG_RING_SLOTS - 1)];
+        int32_t diff = static_cast<int32_t>(slot.seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0)
+        {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                return &slot;
+            }
+        }
+        else if (diff < 0)
+        {
+            return nullptr;
+        }
+        else
+        {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+static void publishSlot(LogSlot *slot, uint32_t pos)
+{
+    slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+static void logWrite(const char *msg, size_t len, bool newline)
+{
+    if (runtimeLevel < LOG_LEVEL_INFO)
+    {
+        return;
+    }
+
+    uint32_t pos;
+    LogSlot *slot = claimSlot(pos);
+    if (slot == nullptr)
+    {
+        droppedCount++;
+        return;
+    }
+
+    size_t room = sizeof(slot->text) - (newline ? 2 : 0);
+    len = min(len, room);
+    memcpy(slot->text, msg, len);
+    if (newline)
+    {
+        slot->text[len++] = '\r';
+        slot->text[len++] = '\n';
+    }
+    slot->length = len;
+    publishSlot(slot, pos);
+}
+
+static void logWriteV(const char *fmt, va_list args)
+{
+    uint32_t pos;
+    LogSlot *slot = claimSlot(pos);
+    if (slot == nullptr)
+    {
+        droppedCount++;
+        return;
+    }
+
+    int len = vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+    if (len < 0)
+    {
+        len = 0;
+    }
+    else if (len >= static_cast<int>(sizeof(slot->text)))
+    {
+        // Keep line structure intact when truncating
+        len = sizeof(slot->text) - 1;
+        slot->text[len - 2] = '\r';
+        slot->text[len - 1] = '\n';
+    }
+    slot->length = len;
+    publishSlot(slot, pos);
+}
+
+void logPrint()
+{
+    logWrite("", 0, true);
+}
+
+void logPrint(const String &msg)
+{
+    logWrite(msg.c_str(), msg.length(), true);
+}
+
+void logPrint(const __FlashStringHelper *msg)
+{
+    // Flash is memory mapped on the ESP32
+    const char *text = reinterpret_cast<const char *>(msg);
+    logWrite(text, strlen_P(text), true);
+}
+
+void logPrint(const char *msg)
+{
+    logWrite(msg, strlen(msg), true);
+}
+
+void logPrintf(const char *fmt, ...)
+{
+    if (runtimeLevel < LOG_LEVEL_INFO)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    logWriteV(fmt, args);
+    va_end(args);
+}
+
+void logPrintLevel(uint8_t level, const char *fmt, ...)
+{
+    if (level > runtimeLevel)
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    logWriteV(fmt, args);
+    va_end(args);
+}
+
+// -----------------------------------------------------------------------------
+// Drain task
+// -----------------------------------------------------------------------------
+
+static void acceptClients()
+{
+    WiFiClient client = logServer.accept();
+    if (client)
+    {
+        client.setNoDelay(true);
+        clients.push_back(client);
+    }
+
+    for (auto it = clients.begin(); it != clients.end();)
+    {
+        if (!it->connected())
+        {
+            it->stop();
+            it = clients.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+static void emit(const char *text, size_t len)
+{
+    Serial.write(reinterpret_cast<const uint8_t *>(text), len);
+    for (auto &client : clients)
+    {
+        client.write(reinterpret_cast<const uint8_t *>(text), len);
+    }
+}
+
+static void logTask(void *pvParameters)
+{
+    (void)pvParameters;
+
+    uint32_t reportedDrops = 0;
+
+    while (true)
+    {
+        if (serverStarted)
+        {
+            acceptClients();
+        }
+
+        while (true)
+        {
+            LogSlot &slot = ring[dequeuePos & (LOG_RING_SLOTS - 1)];
+            if (slot.seq.load(std::memory_order_acquire) != dequeuePos + 1)
+            {
+                break;
+            }
+
+            emit(slot.text, slot.length);
+            slot.seq.store(dequeuePos + LOG_RING_SLOTS, std::memory_order_release);
+            dequeuePos++;
+        }
+
+        uint32_t drops = droppedCount;
+        if (drops != reportedDrops)
+        {
+            char note[48];
+            int len = snprintf(note, sizeof(note), "[LOG] %lu messages dropped\r\n", static_cast<unsigned long>(drops - reportedDrops));
+            emit(note, len);
+            reportedDrops = drops;
+        }
+
+        vTaskDelay(LOG_DRAIN_INTERVAL);
+    }
+}
+
+void setupLog()
+{
+    for (uint32_t i = 0; i < LOG_RING_SLOTS; i++)
+    {
+        ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+    ready = true;
+
+    xTaskCreatePinnedToCore(logTask, "LogTask", 3072, NULL, tskIDLE_PRIORITY + 1, NULL, 0);
+}
+
+// Called from the network task; the clients themselves are only touched by LogTask
+void startLogServer()
+{
+    logServer.begin();
+    logServer.setNoDelay(true);
+    serverStarted = true;
+}
+
+#else
+
+void setupLog()
+{
+}
+
+void startLogServer()
+{
+}
+
+#endif
@@ -1,6 +1,5 @@
 #include <Arduino.h>
 #include <Bounce2.h>
-#include <Preferences.h>
 #include <WebServer.h>
 #include <WiFi.h>
 #include <Wire.h>
@@ -11,16 +10,32 @@
 #include <StreamString.h>
 #include <esp_wifi.h>
 
-#include <cstdarg>
 #include <cstdio>
-#include <vector>
+#include <ctime>
 
 #include "HX711.h"
+#include "autozero.h"
+#include "batch.h"
+#include "boot.h"
+#include "calibration.h"
+#include "cupdetect.h"
+#include "dosestats.h"
+#include "eventqueue.h"
+#include "history.h"
 #include "mqtt.h"
 #include "ota.h"
 #include "pins.h"
+#include "presets.h"
+#include "profile.h"
+#include "pulsefinish.h"
+#include "remotecommand.h"
+#include "settings.h"
+#include "settle.h"
+#include "trace.h"
 #include "types.h"
 #include "webserver.h"
+#include "wifimanager.h"
+#include "weightstream.h"
 
 // -----------------------------------------------------------------------------
 // Configuration constants
@@ -33,101 +48,29 @@ constexpr unsigned long DISPLAY_REFRESH_MS = 50;
 constexpr unsigned long SCALE_INTERVAL_MS = 500;
 constexpr unsigned long DEBOUNCE_DELAY = 50;
 
-constexpr uint16_t MIN_PRESET_WEIGHT = 1;
-constexpr uint16_t MAX_PRESET_WEIGHT = 300;
-
-constexpr uint16_t MOTOR_RUN_THROTTLE = 1200;
-constexpr uint16_t MOTOR_SLOW_THROTTLE = MOTOR_RUN_THROTTLE / 2;
 constexpr uint16_t MOTOR_RAMP_UP_STEP = 2;
 constexpr uint16_t MOTOR_RAMP_UP_DELAY_MS = 4;
 constexpr uint16_t MOTOR_RAMP_DOWN_STEP = 25;
 constexpr uint16_t MOTOR_RAMP_DOWN_DELAY_MS = 4;
 constexpr uint16_t MOTOR_RAMP_MIN_HOLD_MS = 200;
-constexpr float MOTOR_SLOWDOWN_THRESHOLD_G = 0.7f;
-
-const unsigned long LONGPRESS_MS = 2000;
-
-// -----------------------------------------------------------------------------
-// Logging
-// -----------------------------------------------------------------------------
-
-WiFiServer logServer(23);
-std::vector<WiFiClient> clients;
-
-#if ENABLE_LOGGING
-static void purgeClients()
-{
-    for (auto it = clients.begin(); it != clients.end();)
-    {
-        if (!it->connected())
-        {
-            it->stop();
-            it = clients.erase(it);
-        }
-        else
-        {
-            ++it;
-        }
-    }
-}
-
-void logPrint()
-{
-    Serial.println();
-    purgeClients();
-    for (auto &client : clients)
-    {
-        client.println();
-    }
-}
-
-void logPrint(const String &msg)
-{
-    Serial.println(msg);
-    purgeClients();
-    for (auto &client : clients)
-    {
-        client.println(msg);
-    }
-}
 
-void logPrint(const __FlashStringHelper *msg)
-{
-    logPrint(String(msg));
-}
+// Smoothing of the grams-per-second estimate derived from scale samples
+constexpr float FLOW_FILTER_ALPHA = 0.2f;
 
-void logPrint(const char *msg)
-{
-    logPrint(String(msg));
-}
+const unsigned long LONGPRESS_MS = 2000;
 
-void logPrintf(const char *fmt, ...)
-{
-    char buffer[256];
-    va_list args;
-    va_start(args, fmt);
-    int len = vsnprintf(buffer, sizeof(buffer), fmt, args);
-    va_end(args);
+// Reference mass expected on the scale when calibrating via the start button
+constexpr float CALIBRATION_DEFAULT_WEIGHT_G = 10.92f;
 
-    if (len < 0)
-    {
-        return;
-    }
+// The tare offset restored at boot is re-taken if the empty scale reads further off
+constexpr float TARE_VERIFY_TOLERANCE_G = 0.5f;
+constexpr uint8_t TARE_VERIFY_SAMPLES = 10;
 
-    if (len >= static_cast<int>(sizeof(buffer)))
-    {
-        len = sizeof(buffer) - 1;
-    }
+// A batch may start in a cup already on the scale if it reads at most this
+constexpr float BATCH_EMPTY_CUP_G = 1.0f;
 
-    Serial.write(reinterpret_cast<const uint8_t *>(buffer), len);
-
-    purgeClients();
-    for (auto &client : clients)
-    {
-        client.write(reinterpret_cast<const uint8_t *>(buffer), len);
-    }
-}
-#endif
+// How long "Gespeichert!" stays on the display
+constexpr unsigned long SAVING_DISPLAY_MS = 1000;
 
 // -----------------------------------------------------------------------------
 // Hardware instances
@@ -143,6 +86,12 @@ static volatile bool stopPending = true;
 static uint16_t motorCurrentThrottle = DSHOT_CMD_MOTOR_STOP;
 
 HX711 scale;
+// scaleTask and the tare/calibration paths share the HX711
+static SemaphoreHandle_t scaleMutex = xSemaphoreCreateMutex();
+// Incremented on every tare so background checks can tell they were overtaken
+static volatile uint32_t tareGeneration = 0;
+// Empty-scale offset of the last boot, restored instead of taring at startup
+static long savedTareOffset = 0;
 
 // -----------------------------------------------------------------------------
 // Runtime state
@@ -150,11 +99,25 @@ HX711 scale;
 
 volatile State state = IDLE;
 
-uint16_t presetSmall = 8;
-uint16_t presetLarge = 12;
-PresetSelection selectedPreset = SMALL;
-
-Preferences prefs;
+uint8_t selectedPreset = 0; // index into the preset table
+static Preset grindPreset;   // preset of the grind in progress
+static bool grindUsesProfile = false;  // grindProfile replaces the preset's throttle settings
+static CompiledProfile grindProfile;
+static ProfileRun profileRun;
+static bool toppingUp = false; // past the first stop of the grind, compensation no longer applies
+
+// Filled by the web server, drained by loop()
+static QueueHandle_t remoteCommands = xQueueCreate(REMOTE_QUEUE_LENGTH, sizeof(RemoteCommand));
+static const char *volatile calibrationError = nullptr;
+
+// Pulse finishing of the grind in progress
+static float pulseBandG = 0.0f;         // the handover point of the grind is this far before the target
+static bool pulseFiring = false;        // a burst is running
+static unsigned long pulseSinceMs = 0;  // start of the burst, or its end while waiting for the scale
+static uint32_t pulseSample = 0;        // settle samples seen when the last burst ended
+static float pulseBeforeG = 0.0f;       // settled weight before the last burst
+static uint8_t pulseCount = 0;
+static uint8_t pulseDry = 0;            // bursts in a row that added nothing
 
 float scaleFactor = 1.0;
 
@@ -163,39 +126,64 @@ unsigned long lastMillis = 0;
 unsigned long lastScaleMillis = 0;
 
 float weight = 0.0;
+float flowRate = 0.0;
+uint16_t settleTimeoutMs = SETTLE_DEFAULT_TIMEOUT_MS; // longest wait for a stable reading
+static unsigned long stateSince = 0;                  // millis() of the last state change
+static unsigned long cupArmedSince = 0;               // cup tared, waiting to start; 0 = not armed
+static float peakFlow = 0.0f; // highest flow of the current grind
 float lastWeight = 0.0;
 unsigned long lastWeightChangeTime = 0;
 float blockThreshold = 0.03f;
 
+unsigned long grindStartMillis = 0;
+
 unsigned long presetSmallRuns = 0;
 unsigned long presetLargeRuns = 0;
 float totalWeight = 0.0;
 
 bool webStart = false;
 
+// Set once the network stack has been started in the background
+static volatile bool networkStarted = false;
+
+uint8_t telemetryRateHz = 10;
+
 // -----------------------------------------------------------------------------
 // Forward declarations
 // -----------------------------------------------------------------------------
 
 static void motorSendRaw(uint16_t value);
+uint16_t motorThrottle();
 void motorRampTo(uint16_t targetThrottle, uint16_t stepSize, uint16_t delayMs);
-inline void motorRampUp() { motorRampTo(MOTOR_RUN_THROTTLE, MOTOR_RAMP_UP_STEP, MOTOR_RAMP_UP_DELAY_MS); }
 inline void motorRampDown() { motorRampTo(DSHOT_CMD_MOTOR_STOP, MOTOR_RAMP_DOWN_STEP, MOTOR_RAMP_DOWN_DELAY_MS); }
 
 void setupButtons();
 void setupMotor();
 
-void setSelectedPreset(PresetSelection selection);
+static void lockScale();
+static void unlockScale();
+static void tareNow();
+
+void setSelectedPreset(uint8_t index);
 void setRemainingTime();
-void setPreset(PresetSelection selection);
+void selectPreset(uint8_t index);
+void setPreset(PresetSelection button);
 void setState(State s);
 void tareScale();
-void calibrateScale();
+void calibrateScale(bool keepPoints);
+const char *measureCalibrationPoint(float knownWeight);
+const char *finishCalibration(CalibrationMode mode);
 void startGrinding(bool tare);
+void startPulsing();
+void recordGrind(GrindEndReason reason);
 void enterSetting(PresetSelection selection);
 void adjustSetting(State s, int8_t delta);
 void handleStartButton(Bounce2::Button button);
 void handleButton(Bounce2::Button button, PresetSelection selection);
+void handleCup();
+void runRemoteCommands();
+const char *startBatch(const BatchJob *jobs, uint8_t count);
+void cancelBatch();
 
 void loadPreferences();
 void savePreferences();
@@ -208,6 +196,8 @@ void displayTask(void *pvParameters);
 void scaleTask(void *pvParameters);
 void mqttTask(void *pvParameters);
 void throttleTask(void *pvParameters);
+void tareVerifyTask(void *pvParameters);
+void networkTask(void *pvParameters);
 
 void setup();
 void loop();
@@ -228,8 +218,15 @@ static void motorSendRaw(uint16_t value) {
     throttleStream = constrained;
 }
 
+// Throttle currently commanded, DSHOT_CMD_MOTOR_STOP when stopped
+uint16_t motorThrottle()
+{
+    return motorCurrentThrottle;
+}
+
 void motorRampTo(uint16_t targetThrottle, uint16_t stepSize, uint16_t delayMs)
 {
+    TraceSpan span(TRACE_MOTOR_RAMP, targetThrottle, stepSize);
     uint16_t currentThrottle = motorCurrentThrottle;
     uint16_t desired = targetThrottle;
 
@@ -344,83 +341,368 @@ void setupMotor()
     }
 }
 
+static void lockScale()
+{
+    xSemaphoreTake(scaleMutex, portMAX_DELAY);
+}
+
+static void unlockScale()
+{
+    xSemaphoreGive(scaleMutex);
+}
+
+static void tareNow()
+{
+    lockScale();
+    scale.tare();
+    unlockScale();
+    tareGeneration++;
+    autoZeroTared(millis());
+}
+
 // -----------------------------------------------------------------------------
 // Grinding workflow & state transitions
 // -----------------------------------------------------------------------------
 
 // Setter for selected preset without side effects
-void setSelectedPreset(PresetSelection selection)
+void setSelectedPreset(uint8_t index)
 {
-    selectedPreset = selection;
+    selectedPreset = index < presetCount() ? index : 0;
 }
 
 // Set remaining time based on selected preset
 void setRemainingTime()
 {
-    LOGF("[REMAINING] %.1fg / %.1fg\n", presetSmall / 10.0, presetLarge / 10.0);
-    remaining = (selectedPreset == SMALL) ? presetSmall : presetLarge;
+    // A running batch decides the dose
+    BatchJob job;
+    if (batchCurrentJob(&job))
+    {
+        remaining = job.target;
+        return;
+    }
+
+    Preset preset = presetDefaults();
+    presetGet(selectedPreset, &preset);
+    remaining = preset.target;
+    LOGF("[REMAINING] %s: %.1fg\n", preset.name, remaining / 10.0);
 }
 
-void setPreset(PresetSelection selection)
+void selectPreset(uint8_t index)
 {
-    setSelectedPreset(selection);
+    if (state == UPDATING)
+    {
+        return;
+    }
+
+    setSelectedPreset(index);
     savePreferences();
     setState(IDLE);
-    scale.tare();
+    tareNow();
+}
+
+// Select the favourite of the left (SMALL) or right (LARGE) button
+void setPreset(PresetSelection button)
+{
+    selectPreset(presetFavourite(button));
 }
 
 // Setter for state variable with automatic logging
 void setState(State s)
 {
+    // A paused or stalled grind that is not resumed ends here
+    if ((state == PAUSED || state == EMPTY) && s == IDLE)
+    {
+        recordGrind(state == PAUSED ? GRIND_END_PAUSED : GRIND_END_EMPTY);
+    }
+
     state = s;
+    stateSince = millis();
     logState();
 }
 
+// Tare once the scale is stable, using the readings the settle detector
+// already averaged; falls back to a regular tare if it does not settle
 void tareScale()
 {
     LOG("Tare Scale");
-    delay(500);
-    scale.tare();
+
+    SettleState settle;
+    if (!settleWait(settleTimeoutMs, &settle))
+    {
+        LOGF("[TARE] Not settled after %u ms (%.3f g, %.3f g/s)\n", settleTimeoutMs, settle.stddev, settle.slope);
+        tareNow();
+        return;
+    }
+
+    lockScale();
+    scale.set_offset(lroundf(settle.meanRaw));
+    unlockScale();
+    tareGeneration++;
+    autoZeroTared(millis());
 }
 
-void calibrateScale()
+// Tare the empty scale as the zero point of a new calibration; keepPoints
+// re-measures on top of the references of the active one
+void calibrateScale(bool keepPoints)
 {
+    if (state == UPDATING)
+    {
+        return;
+    }
+
     setState(CALIBRATE);
 
     LOG("== SCALE CALIBRATION ==");
     LOG("Remove all weight. Taring...");
-    scale.tare();
-    LOG("Place known weight (e.g. 100g) and press Start button.");
+    tareScale();
+
+    lockScale();
+    calibrationBegin(scale.get_offset(), keepPoints);
+    unlockScale();
+
+    LOG("Place known weights one at a time, or one weight and press Start button.");
+}
+
+// Record the known weight now on the scale as a calibration point
+const char *measureCalibrationPoint(float knownWeight)
+{
+    SettleState settle;
+    if (!settleWait(settleTimeoutMs, &settle))
+    {
+        return "scale did not settle";
+    }
+
+    lockScale();
+    long reading = lroundf(settle.meanRaw) - scale.get_offset();
+    unlockScale();
+
+    return calibrationAddPoint(reading, knownWeight);
+}
+
+// Fit the measured points and switch the scale over to the new model
+const char *finishCalibration(CalibrationMode mode)
+{
+    const char *error = calibrationFit(mode);
+    if (error != nullptr)
+    {
+        LOGW("[CALIBRATION] %s\n", error);
+        return error;
+    }
+
+    lockScale();
+    scaleFactor = calibrationCountsPerGram();
+    scale.set_scale(scaleFactor);
+    unlockScale();
+
+    LOGF("Calibration factor set: %.2f\n", scaleFactor);
+
+    setState(SAVING);
+    return nullptr;
 }
 
 // Start grinding: reset timer, optionally tare scale and change state to RUNNING
 void startGrinding(bool tare)
 {
+    // The motor stays locked while firmware is being written
+    if (state == UPDATING)
+    {
+        return;
+    }
+
+    // A zero that auto-zero tracking just confirmed needs no new tare
     if (state == IDLE && tare)
     {
-        tareScale();
+        if (autoZeroCanSkipTare(millis()))
+        {
+            LOGD("[TARE] Skipped, zero is tracked\n");
+        }
+        else
+        {
+            tareScale();
+        }
     }
 
+    if (state == IDLE)
+    {
+        grindStartMillis = millis();
+        peakFlow = 0.0f;
+        bootMark(BOOT_FIRST_GRIND);
+
+        toppingUp = false;
+
+        BatchJob job;
+        if (batchCurrentJob(&job))
+        {
+            if (job.preset != BATCH_NO_PRESET)
+            {
+                setSelectedPreset(job.preset);
+            }
+            batchJobStarted();
+        }
+    }
+
+    // Jobs with their own target still grind with the selected profile
+    if (!presetGet(selectedPreset, &grindPreset))
+    {
+        grindPreset = presetDefaults();
+    }
+    grindUsesProfile = grindPreset.profile != PROFILE_NONE && profileCompiled(grindPreset.profile, &grindProfile);
+    profileStart(profileRun, grindPreset.slowThrottle, millis());
+
     lastMillis = millis();
     setRemainingTime();
     setState(RUNNING);
 }
 
-// Enter setting mode for selected preset
+// Hand the last grams over to timed bursts; the motor has been ramped down
+void startPulsing()
+{
+    pulseBandG = pulseFinishConfig().bandG;
+    pulseFiring = false;
+    pulseSinceMs = millis();
+    pulseSample = settleState().sample;
+    pulseCount = 0;
+    pulseDry = 0;
+    setState(PULSING);
+}
+
+// Weight of a settled window, averaged like a tare
+static float settledGrams(const SettleState &settle)
+{
+    lockScale();
+    long offset = scale.get_offset();
+    unlockScale();
+    return calibrationGrams(lroundf(settle.meanRaw) - offset);
+}
+
+// One step of pulse finishing per loop: end a running burst on time, or wait
+// for a settled window taken entirely after it, learn its yield and decide on
+// the next. The first reading also tells how far the continuous part stopped
+// from the handover point.
+static void runPulseFinish(unsigned long now)
+{
+    if (pulseFiring)
+    {
+        if (now - pulseSinceMs >= pulseFinishConfig().pulseMs)
+        {
+            motorSendRaw(DSHOT_CMD_MOTOR_STOP);
+            pulseFiring = false;
+            pulseSinceMs = now;
+            pulseSample = settleState().sample;
+        }
+        return;
+    }
+
+    SettleState settle = settleState();
+    if (settle.sample - pulseSample < SETTLE_WINDOW || (!settle.settled && now - pulseSinceMs < settleTimeoutMs))
+    {
+        return;
+    }
+
+    float grams = settledGrams(settle);
+    if (pulseCount == 0)
+    {
+        if (!toppingUp)
+        {
+            presetLearn(selectedPreset, lroundf(grams * 100.0f) - (remaining * 10 - lroundf(pulseBandG * 100.0f)));
+            toppingUp = true;
+        }
+    }
+    else if (grams - pulseBeforeG < PULSE_DRY_G)
+    {
+        pulseDry++;
+    }
+    else
+    {
+        pulseDry = 0;
+        pulseFinishLearn(selectedPreset, grams - pulseBeforeG);
+    }
+
+    float gramsRemaining = (remaining / 10.0f) - grams;
+    if (!pulseFinishNeeded(selectedPreset, gramsRemaining))
+    {
+        LOGD("[PULSE] Done after %u bursts, %.3f g left\n", pulseCount, gramsRemaining);
+        setState(FINISHED);
+        return;
+    }
+
+    if (pulseDry >= PULSE_MAX_DRY)
+    {
+        LOG("[EMPTY] Bursts stopped adding weight");
+        setState(EMPTY);
+        return;
+    }
+
+    // Grounds still arrive, just too few to reach the target
+    if (pulseCount >= PULSE_MAX_COUNT)
+    {
+        LOGW("[PULSE] Target not reached after %u bursts, %.3f g left\n", pulseCount, gramsRemaining);
+        recordGrind(GRIND_END_BURST_LIMIT);
+        setState(IDLE);
+        return;
+    }
+
+    pulseBeforeG = grams;
+    pulseCount++;
+    pulseFiring = true;
+    pulseSinceMs = now;
+    // Bursts switch at once; a ramp would take longer than the burst
+    motorSendRaw(grindPreset.slowThrottle);
+}
+
+// Append the grind to the history; completed grinds are also queued for MQTT delivery
+void recordGrind(GrindEndReason reason)
+{
+    time_t now = time(nullptr);
+    uint32_t timestamp = (now > 1700000000) ? static_cast<uint32_t>(now) : 0;
+    uint32_t durationMs = millis() - grindStartMillis;
+    int16_t actual = static_cast<int16_t>(roundf(weight * 100.0f));
+
+    if (reason == GRIND_END_FINISHED)
+    {
+        GrindEvent event = {};
+        event.timestamp = timestamp;
+        event.durationMs = durationMs;
+        event.target = remaining;
+        event.actual = actual;
+        event.preset = selectedPreset;
+        eventQueuePush(event);
+
+        doseStatsRecord(selectedPreset, actual - remaining * 10, durationMs);
+    }
+
+    if (batchActive())
+    {
+        batchJobFinished(actual, durationMs, reason == GRIND_END_FINISHED);
+    }
+
+    GrindRecord record = {};
+    record.timestamp = timestamp;
+    record.durationMs = durationMs;
+    record.target = remaining;
+    record.actual = actual;
+    record.overshoot = static_cast<int16_t>(actual - remaining * 10);
+    record.peakFlow = static_cast<uint16_t>(constrain(lroundf(peakFlow * 100.0f), 0L, 65535L));
+    record.preset = selectedPreset;
+    record.reason = reason;
+    historyAppend(record);
+}
+
+// Enter setting mode for the favourite of a button
 void enterSetting(PresetSelection selection)
 {
     setState(selection == SMALL ? SET_LEFT : SET_RIGHT);
 }
 
-// Adjust preset time in setting mode
+// Adjust the target of the favourite being set
 void adjustSetting(State s, int8_t delta)
 {
-    if (s == SET_LEFT)
-        presetSmall += delta;
-    else
-        presetLarge += delta;
-    presetSmall = constrain(presetSmall, MIN_PRESET_WEIGHT, MAX_PRESET_WEIGHT);
-    presetLarge = constrain(presetLarge, MIN_PRESET_WEIGHT, MAX_PRESET_WEIGHT);
+    uint8_t index = presetFavourite(s == SET_LEFT ? SMALL : LARGE);
+    Preset preset;
+    if (presetGet(index, &preset))
+    {
+        presetSetTarget(index, static_cast<uint16_t>(max(preset.target + delta, 0)));
+    }
 }
 
 // Handle button press for short and long press actions
@@ -469,9 +751,229 @@ void handleStartButton(Bounce2::Button button)
     }
 }
 
+// Hands-free dosing: tare when a cup is placed, start after the arming delay
+// and pause as soon as the cup is lifted. Events outside IDLE/RUNNING/PULSING are dropped.
+// A batch uses the same flow whether or not cup detection is switched on, but
+// waits for the finished dose to be taken away before accepting the next cup.
+void handleCup()
+{
+    CupEvent event = cupDetectTakeEvent();
+    bool batch = batchActive();
+
+    if (!batch && !cupDetectConfig().enabled)
+    {
+        cupArmedSince = 0;
+        return;
+    }
+
+    if (event == CUP_REMOVED)
+    {
+        cupArmedSince = 0;
+        if (batchPhase() == BATCH_ARMED)
+        {
+            batchSetPhase(BATCH_WAIT_CUP);
+        }
+        if (state == RUNNING || state == PULSING)
+        {
+            LOG("[CUP] Removed, pausing");
+            setState(PAUSED);
+        }
+    }
+
+    bool placed = event == CUP_PLACED;
+    if (batch)
+    {
+        if (batchPhase() == BATCH_WAIT_REMOVAL && !cupDetectPresent())
+        {
+            batchSetPhase(BATCH_WAIT_CUP);
+        }
+        placed = batchPhase() == BATCH_WAIT_CUP && cupDetectPresent();
+    }
+
+    if (placed && state == IDLE && cupArmedSince == 0)
+    {
+        LOG("[CUP] Placed, taring");
+        tareScale();
+        cupArmedSince = max(millis(), 1UL);
+        batchSetPhase(BATCH_ARMED);
+    }
+
+    if (cupArmedSince == 0)
+    {
+        return;
+    }
+
+    if (state != IDLE)
+    {
+        // Started or changed by hand in the meantime
+        cupArmedSince = 0;
+    }
+    else if (millis() - cupArmedSince >= cupDetectConfig().armDelayMs)
+    {
+        cupArmedSince = 0;
+        LOG("[CUP] Starting");
+        startGrinding(false);
+    }
+}
+
+// Queue doses for the cup flow; a cup that is on the scale, tared and empty is
+// used for the first one, anything else has to be taken away first
+const char *startBatch(const BatchJob *jobs, uint8_t count)
+{
+    if (state != IDLE)
+    {
+        return "grinder busy";
+    }
+
+    bool emptyCup = !cupDetectPresent() || fabsf(weight) < BATCH_EMPTY_CUP_G;
+    if (!batchSubmit(jobs, count, emptyCup ? BATCH_WAIT_CUP : BATCH_WAIT_REMOVAL))
+    {
+        return "batch already running";
+    }
+
+    setRemainingTime();
+    return nullptr;
+}
+
+void cancelBatch()
+{
+    if (!batchActive())
+    {
+        return;
+    }
+
+    LOG("[BATCH] Cancelled");
+    batchCancel();
+    cupArmedSince = 0;
+    setRemainingTime();
+}
+
+bool postRemoteCommand(const RemoteCommand &command)
+{
+    return xQueueSend(remoteCommands, &command, 0) == pdTRUE;
+}
+
+const char *remoteCalibrationError()
+{
+    return calibrationError;
+}
+
+// Run what the web API and MQTT queued; states are checked again since they may have
+// changed while the command waited
+void runRemoteCommands()
+{
+    RemoteCommand command;
+    while (xQueueReceive(remoteCommands, &command, 0) == pdTRUE)
+    {
+        switch (command.type)
+        {
+        case REMOTE_START:
+            if (state == IDLE || state == PAUSED || state == EMPTY)
+            {
+                webStart = true;
+                startGrinding(true);
+            }
+            break;
+
+        case REMOTE_TARE:
+            tareScale();
+            break;
+
+        case REMOTE_FAVOURITE:
+        case REMOTE_SELECT:
+            if (command.start && state != IDLE && state != PAUSED && state != EMPTY)
+            {
+                break;
+            }
+            if (command.type == REMOTE_FAVOURITE)
+            {
+                setPreset(command.button);
+            }
+            else if (command.preset < presetCount())
+            {
+                selectPreset(command.preset);
+            }
+            else
+            {
+                break;
+            }
+            if (command.start)
+            {
+                webStart = true;
+                startGrinding(true);
+            }
+            break;
+
+        case REMOTE_CALIBRATE:
+            calibrationError = nullptr;
+            calibrateScale(command.keep);
+            break;
+
+        case REMOTE_CALIBRATION_POINT:
+        {
+            if (state != CALIBRATE)
+            {
+                calibrationError = "calibration not started";
+                break;
+            }
+            const char *error = command.weight > 0.0f ? measureCalibrationPoint(command.weight) : nullptr;
+            if (error == nullptr && command.finish)
+            {
+                error = finishCalibration(command.mode);
+            }
+            if (error != nullptr)
+            {
+                LOGW("[CALIBRATION] %s\n", error);
+            }
+            calibrationError = error;
+            break;
+        }
+
+        case REMOTE_PRESETS:
+        {
+            // Keep the entry selected, wherever it moved; a removed one falls back to its index
+            uint8_t selected = command.preset;
+            if (selected == PRESET_NEW)
+            {
+                selected = min<uint8_t>(selectedPreset, presetCount() - 1);
+                for (uint8_t i = 0; i < PRESET_MAX_COUNT; i++)
+                {
+                    if (command.previous[i] == selectedPreset)
+                    {
+                        selected = i;
+                        break;
+                    }
+                }
+            }
+            setSelectedPreset(selected);
+            savePreferences();
+            if (state == IDLE)
+            {
+                setRemainingTime();
+            }
+            break;
+        }
+
+        case REMOTE_BATCH:
+        {
+            const char *error = startBatch(command.jobs, command.jobCount);
+            if (error != nullptr)
+            {
+                LOGW("[BATCH] Not started: %s\n", error);
+            }
+            break;
+        }
+        }
+    }
+}
+
+// A short press selects the button's favourite; pressing it again steps on
+// through the rest of the table
 void handleButton(Bounce2::Button button, PresetSelection selection)
 {
     static bool isSetSettings = false;
+    static int8_t lastButton = -1;
+    static uint8_t lastButtonPreset = 0;
 
     if (button.isPressed())
     {
@@ -488,7 +990,17 @@ void handleButton(Bounce2::Button button, PresetSelection selection)
         if (button.currentDuration() < LONGPRESS_MS)
         {
             LOG("Set Preset");
-            setPreset(selection);
+            uint8_t count = presetCount();
+            if (count > 2 && lastButton == selection && selectedPreset == lastButtonPreset)
+            {
+                selectPreset((selectedPreset + 1) % count);
+            }
+            else
+            {
+                setPreset(selection);
+            }
+            lastButton = selection;
+            lastButtonPreset = selectedPreset;
         }
 
         isSetSettings = false;
@@ -502,46 +1014,76 @@ void handleButton(Bounce2::Button button, PresetSelection selection)
 // Load presets and selected preset from non-volatile storage
 void loadPreferences()
 {
-    prefs.begin("coffee", false);
-
-    presetSmall = prefs.getUShort("pL", 8 * 10);
-    presetLarge = prefs.getUShort("pR", 12 * 10);
+    // The two presets of older firmware seed the table on first boot
+    setupPresets(settingsGetUShort("pL", 8 * 10), settingsGetUShort("pR", 12 * 10));
 
-    LOGF("[PREFERENCES] %d / %d g\n", presetSmall, presetLarge);
+    uint32_t sel = settingsGetUInt("sel", selectedPreset);
+    setSelectedPreset(sel < presetCount() ? static_cast<uint8_t>(sel) : 0);
 
-    uint32_t sel = prefs.getUInt("sel", static_cast<uint32_t>(selectedPreset));
-    selectedPreset = (sel <= LARGE) ? static_cast<PresetSelection>(sel) : SMALL;
-
-    scaleFactor = prefs.getFloat("scale", 1.0);
+    scaleFactor = settingsGetFloat("scale", 1.0);
     scale.set_scale(scaleFactor);
 
-    totalWeight = prefs.getFloat("totalWeight", 0.0);
-    presetSmallRuns = prefs.getULong("presetSmallRuns", 0);
-    presetLargeRuns = prefs.getULong("presetLargeRuns", 0);
-    blockThreshold = prefs.getFloat("blockThreshold", 0.3);
-
-    prefs.end();
+    totalWeight = settingsGetFloat("totalWeight", 0.0);
+    presetSmallRuns = settingsGetUInt("presetSmallRuns", 0);
+    presetLargeRuns = settingsGetUInt("presetLargeRuns", 0);
+    blockThreshold = settingsGetFloat("blockThreshold", 0.3);
+    telemetryRateHz = settingsGetUChar("wsRate", telemetryRateHz);
+    logSetLevel(settingsGetUChar("logLevel", LOG_LEVEL_INFO));
+    settleTimeoutMs = settingsGetUShort("settleMax", SETTLE_DEFAULT_TIMEOUT_MS);
+    savedTareOffset = settingsGetLong("tareOffset", 0);
+
+    AutoZeroConfig autoZero;
+    autoZero.enabled = settingsGetUChar("azOn", 1) != 0;
+    autoZero.bandG = settingsGetFloat("azBand", AUTOZERO_DEFAULT_BAND_G);
+    autoZero.rateGps = settingsGetFloat("azRate", AUTOZERO_DEFAULT_RATE_GPS);
+    autoZeroConfigure(autoZero);
+
+    CupDetectConfig cup;
+    cup.enabled = settingsGetUChar("cupOn", 0) != 0;
+    cup.minWeightG = settingsGetFloat("cupMin", CUP_DEFAULT_MIN_WEIGHT_G);
+    cup.armDelayMs = settingsGetUShort("cupArm", CUP_DEFAULT_ARM_DELAY_MS);
+    cupDetectConfigure(cup);
+
+    PulseFinishConfig pulse;
+    pulse.enabled = settingsGetUChar("pulseOn", 0) != 0;
+    pulse.bandG = settingsGetFloat("pulseBand", PULSE_DEFAULT_BAND_G);
+    pulse.pulseMs = settingsGetUShort("pulseMs", PULSE_DEFAULT_MS);
+    pulseFinishConfigure(pulse);
 }
 
-// Save presets and selected preset to non-volatile storage
+// Save presets and selected preset; only changed keys reach NVS, in the background
 void savePreferences()
 {
-    prefs.begin("coffee", false);
-
-    prefs.putUShort("pL", presetSmall);
-    prefs.putUShort("pR", presetLarge);
-    prefs.putUInt("sel", static_cast<uint32_t>(selectedPreset));
-    prefs.putFloat("scale", scaleFactor);
-    prefs.putFloat("totalWeight", totalWeight);
-    prefs.putULong("presetSmallRuns", presetSmallRuns);
-    prefs.putULong("presetLargeRuns", presetLargeRuns);
-    prefs.putFloat("blockThreshold", blockThreshold);
-
-    prefs.end();
+    presetsCommit();
+    pulseFinishCommit();
+    settingsPutUInt("sel", selectedPreset);
+    settingsPutFloat("scale", scaleFactor);
+    settingsPutFloat("totalWeight", totalWeight);
+    settingsPutUInt("presetSmallRuns", presetSmallRuns);
+    settingsPutUInt("presetLargeRuns", presetLargeRuns);
+    settingsPutFloat("blockThreshold", blockThreshold);
+    settingsPutUChar("wsRate", telemetryRateHz);
+    settingsPutUChar("logLevel", logGetLevel());
+    settingsPutUShort("settleMax", settleTimeoutMs);
+
+    AutoZeroConfig autoZero = autoZeroConfig();
+    settingsPutUChar("azOn", autoZero.enabled ? 1 : 0);
+    settingsPutFloat("azBand", autoZero.bandG);
+    settingsPutFloat("azRate", autoZero.rateGps);
+
+    CupDetectConfig cup = cupDetectConfig();
+    settingsPutUChar("cupOn", cup.enabled ? 1 : 0);
+    settingsPutFloat("cupMin", cup.minWeightG);
+    settingsPutUShort("cupArm", cup.armDelayMs);
+
+    PulseFinishConfig pulse = pulseFinishConfig();
+    settingsPutUChar("pulseOn", pulse.enabled ? 1 : 0);
+    settingsPutFloat("pulseBand", pulse.bandG);
+    settingsPutUShort("pulseMs", pulse.pulseMs);
+    settingsCommit();
 
     setSelectedPreset(selectedPreset);
     setRemainingTime();
-    drawDisplay();
 }
 
 // -----------------------------------------------------------------------------
@@ -551,13 +1093,35 @@ void savePreferences()
 // Update OLED display based on current state
 void drawDisplay()
 {
+    TraceSpan span(TRACE_DISPLAY_DRAW, state);
     display.clearDisplay();
     char buf[32];
     switch (state)
     {
     case IDLE:
-        sprintf(buf, "%4.1fg", (selectedPreset == SMALL ? presetSmall : presetLarge) / 10.0);
+    {
+        uint8_t batchJob, batchCount;
+        batchProgress(&batchJob, &batchCount);
+        if (batchCount > 0)
+        {
+            sprintf(buf, "%u/%u %4.1fg", batchJob, batchCount, remaining / 10.0);
+        }
+        else
+        {
+            Preset preset = presetDefaults();
+            presetGet(selectedPreset, &preset);
+            if (presetCount() > 2)
+            {
+                // Name the preset once the buttons step through the table
+                snprintf(buf, sizeof(buf), "%.10s\n%4.1fg", preset.name, preset.target / 10.0);
+            }
+            else
+            {
+                sprintf(buf, "%4.1fg", preset.target / 10.0);
+            }
+        }
         break;
+    }
     case WEIGHING:
         sprintf(buf, "%4.1fg", weight);
         break;
@@ -565,6 +1129,9 @@ void drawDisplay()
         // float weight = scale.get_units();
         sprintf(buf, "%4.1fg", (remaining / 10.0) - weight);
         break;
+    case PULSING:
+        sprintf(buf, "%4.2fg", (remaining / 10.0) - weight);
+        break;
     case PAUSED:
         sprintf(buf, "%4.1fg", (remaining / 10.0) - weight);
         break;
@@ -578,11 +1145,13 @@ void drawDisplay()
         sprintf(buf, "Gespeichert!");
         break;
     case SET_LEFT:
-        sprintf(buf, "Setze Kl.: %4.1f%s", presetSmall / 10.0, "g");
-        break;
     case SET_RIGHT:
-        sprintf(buf, "Setze Gr.: %4.1f%s", presetLarge / 10.0, "g");
+    {
+        Preset preset = presetDefaults();
+        presetGet(presetFavourite(state == SET_LEFT ? SMALL : LARGE), &preset);
+        sprintf(buf, "Setze %s: %4.1f%s", state == SET_LEFT ? "Kl." : "Gr.", preset.target / 10.0, "g");
         break;
+    }
     case CALIBRATE:
         sprintf(buf, "Kalibrierung");
         break;
@@ -614,6 +1183,7 @@ String stateToString(State s)
     case IDLE: return "IDLE";
     case RUNNING: return "RUNNING";
     case PAUSED: return "PAUSED";
+    case PULSING: return "PULSING";
     case MEASURING: return "MEASURING";
     case FINISHED: return "FINISHED";
     case SAVING: return "SAVING";
@@ -630,8 +1200,8 @@ String stateToString(State s)
 // Log current state, preset and remaining time
 void logState()
 {
-    LOGF("[STATE] %s\n", stateToString(state));
-    LOGF("[PRESET] %s\n", (selectedPreset == SMALL) ? "SMALL" : "LARGE");
+    LOGF("[STATE] %s\n", stateToString(state).c_str());
+    LOGF("[PRESET] %u\n", selectedPreset);
     LOGF("[REMAINING] %.1fg\n", remaining / 10.0);
 }
 
@@ -650,14 +1220,59 @@ void displayTask(void *pvParameters)
     }
 }
 
+// Follow slow drift of the empty scale; never while grinding
+static void trackZero(float grams, unsigned long nowMs)
+{
+    SettleState settle = settleState();
+
+    lockScale();
+    long step = autoZeroStep(grams, settle, scale.get_offset(), scale.get_scale(), nowMs, state == IDLE);
+    if (step != 0)
+    {
+        scale.set_offset(scale.get_offset() + step);
+    }
+    unlockScale();
+}
+
 void scaleTask(void *pvParameters)
 {
     (void)pvParameters;
+    unsigned long lastSampleMs = 0;
+    float lastSampleWeight = 0.0f;
+
     while (true)
     {
-        weight = scale.get_units();
+        // Take every conversion the HX711 delivers instead of polling at a fixed rate
+        if (!scale.is_ready())
+        {
+            vTaskDelay(pdMS_TO_TICKS(2));
+            continue;
+        }
+
+        long raw;
+        {
+            TraceSpan span(TRACE_SCALE_READ);
+            lockScale();
+            raw = scale.read();
+            weight = calibrationGrams(raw - scale.get_offset());
+            unlockScale();
+            span.result(raw, static_cast<int32_t>(lroundf(weight * 100.0f)));
+        }
+
+        unsigned long nowMs = millis();
+        if (lastSampleMs != 0 && nowMs > lastSampleMs)
+        {
+            float instantFlow = (weight - lastSampleWeight) * 1000.0f / (nowMs - lastSampleMs);
+            flowRate += FLOW_FILTER_ALPHA * (instantFlow - flowRate);
+        }
+        lastSampleMs = nowMs;
+        lastSampleWeight = weight;
+
         // LOGF("[SCALE - Task] %.2f g\n", weight);
-        vTaskDelay(pdMS_TO_TICKS(200));
+        settlePush(raw, nowMs, scale.get_scale());
+        trackZero(weight, nowMs);
+        cupDetectPush(raw, settleState(), scale.get_scale());
+        streamPushSample(raw, weight, motorCurrentThrottle);
     }
 }
 
@@ -672,6 +1287,66 @@ void mqttTask(void *pvParameters)
     }
 }
 
+// Check the tare offset restored at boot against the empty scale. Runs once,
+// after grinding is already possible; any tare in the meantime wins.
+void tareVerifyTask(void *pvParameters)
+{
+    (void)pvParameters;
+    uint32_t generation = tareGeneration;
+
+    // Average what scaleTask measures with the restored offset
+    vTaskDelay(pdMS_TO_TICKS(500));
+    float drift = 0.0f;
+    for (uint8_t i = 0; i < TARE_VERIFY_SAMPLES; i++)
+    {
+        drift += weight;
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    drift /= TARE_VERIFY_SAMPLES;
+
+    if (generation != tareGeneration || state != IDLE)
+    {
+        LOG("[TARE] Restored offset superseded");
+    }
+    else if (fabsf(drift) > TARE_VERIFY_TOLERANCE_G)
+    {
+        lockScale();
+        long offset = scale.get_offset() + lroundf(drift * scale.get_scale());
+        scale.set_offset(offset);
+        unlockScale();
+
+        settingsPutLong("tareOffset", offset);
+        settingsCommit();
+
+        LOGF("[TARE] Restored offset off by %.2f g, re-tared\n", drift);
+    }
+    else
+    {
+        LOGF("[TARE] Restored offset verified (%.2f g)\n", drift);
+    }
+
+    bootMark(BOOT_TARE_VERIFIED);
+    vTaskDelete(NULL);
+}
+
+// Bring up Wi-Fi and all network services without holding up local grinding
+void networkTask(void *pvParameters)
+{
+    (void)pvParameters;
+
+    startWifi();
+    startLogServer();
+    setupWebServer();
+
+    setupOTA();
+    setupMqtt();
+    xTaskCreatePinnedToCore(mqttTask, "MqttTask", 6144, NULL, 1, NULL, 1);
+
+    networkStarted = true;
+    bootMark(BOOT_NETWORK_STARTED);
+    vTaskDelete(NULL);
+}
+
 void throttleTask(void *) {
     const TickType_t interval = pdMS_TO_TICKS(1);
     while (true) {
@@ -689,55 +1364,81 @@ void throttleTask(void *) {
 // Arduino lifecycle
 // -----------------------------------------------------------------------------
 
-// Initialize serial, networking, hardware, and background tasks
+// Staged startup: everything needed for grinding comes first, networking
+// follows in the background
 void setup()
 {
     Serial.begin(115200);
-
-    startWifi();
-    logServer.begin();
-    logServer.setNoDelay(true);
-    setupWebServer();
-
-    setupOTA();
-    setupMqtt();
+    setupLog();
+    bootMark(BOOT_SETUP);
 
     if (!display.begin(SSD1306_SWITCHCAPVCC, SCREEN_ADDRESS))
     {
-        LOG(F("SSD1306 allocation failed"));
+        LOGE("SSD1306 allocation failed\n");
         for (;;)
         {
         }
     }
     display.clearDisplay();
+    display.display();
+    bootMark(BOOT_DISPLAY);
 
     setupButtons();
+    setupSettings();
+    setupProfiles();
+    setupPulseFinish();
     loadPreferences();
     setRemainingTime();
     setupMotor();
 
+    setupCalibration(scaleFactor);
+    scaleFactor = calibrationCountsPerGram();
     scale.begin(HX_DT, HX_SCK);
     scale.set_scale(scaleFactor);
-    scale.tare();
+
+    // A blocking tare takes a second; reuse the last one and check it later
+    bool restoreTare = savedTareOffset != 0;
+    if (restoreTare)
+    {
+        scale.set_offset(savedTareOffset);
+    }
+    else
+    {
+        scale.tare();
+        settingsPutLong("tareOffset", scale.get_offset());
+        settingsCommit();
+    }
 
     logState();
 
     xTaskCreatePinnedToCore(displayTask, "DisplayTask", 2048, NULL, 1, NULL, 1);
     xTaskCreatePinnedToCore(scaleTask, "ScaleTask", 2048, NULL, 1, NULL, 1);
-    xTaskCreatePinnedToCore(mqttTask, "MqttTask", 6144, NULL, 1, NULL, 1);
     xTaskCreatePinnedToCore(throttleTask, "ThrottleTask", 1024, NULL, 1, NULL, 1);
+    bootMark(BOOT_GRIND_READY);
+
+    if (restoreTare)
+    {
+        xTaskCreatePinnedToCore(tareVerifyTask, "TareVerify", 2048, NULL, 1, NULL, 1);
+    }
+    else
+    {
+        bootMark(BOOT_TARE_VERIFIED);
+    }
+
+    setupEventQueue();
+    setupHistory();
+    setupDoseStats();
+    xTaskCreatePinnedToCore(networkTask, "NetworkTask", 8192, NULL, 1, NULL, 0);
 }
 
 // Main loop handling state machine and button updates
 void loop()
 {
-    ArduinoOTA.handle();
+    TraceSpan span(TRACE_LOOP);
 
-    WiFiClient newClient = logServer.accept();
-    if (newClient)
+    if (networkStarted)
     {
-        newClient.setNoDelay(true);
-        clients.push_back(newClient);
+        ArduinoOTA.handle();
     }
 
     unsigned long now = millis();
@@ -752,6 +1453,9 @@ void loop()
         // LOGF("[SCALE - loop] %.2f g\n", weight);
     }
 
+    handleCup();
+    runRemoteCommands();
+
     switch (state)
     {
     case IDLE:
@@ -763,9 +1467,37 @@ void loop()
 
     case RUNNING:
     {
-        float gramsRemaining = (remaining / 10.0f) - weight;
-        uint16_t targetThrottle = (gramsRemaining <= MOTOR_SLOWDOWN_THRESHOLD_G) ? MOTOR_SLOW_THROTTLE : MOTOR_RUN_THROTTLE;
-        motorRampTo(targetThrottle, MOTOR_RAMP_UP_STEP, MOTOR_RAMP_UP_DELAY_MS);
+        // Grams left to the stop point, which the learned compensation moves ahead of the target;
+        // with pulse finishing the motor stops the band before it and bursts do the rest
+        PulseFinishConfig pulse = pulseFinishConfig();
+        float compensation = toppingUp ? 0.0f : grindPreset.compensationCg / 100.0f;
+        float band = pulse.enabled ? pulse.bandG : 0.0f;
+        float gramsRemaining = (remaining / 10.0f) - compensation - band - weight;
+
+        // Resumed inside the pulse band: no spin-up, the bursts take over at once
+        if (!pulse.enabled || gramsRemaining > 0.0f)
+        {
+            if (grindUsesProfile)
+            {
+                ProfileCommand command = profileEvaluate(grindProfile, gramsRemaining, flowRate, now, now - grindStartMillis,
+                                                         PRESET_MIN_THROTTLE, grindPreset.maxThrottle, profileRun);
+                if (command.pulse)
+                {
+                    // Bursts switch at once; a ramp would take longer than the burst
+                    motorSendRaw(command.throttle > 0 ? command.throttle : DSHOT_CMD_MOTOR_STOP);
+                }
+                else
+                {
+                    motorRampTo(command.throttle, MOTOR_RAMP_UP_STEP, MOTOR_RAMP_UP_DELAY_MS);
+                }
+            }
+            else
+            {
+                motorRampTo(presetThrottle(grindPreset, gramsRemaining), MOTOR_RAMP_UP_STEP, MOTOR_RAMP_UP_DELAY_MS);
+            }
+        }
+
+        peakFlow = max(peakFlow, flowRate);
 
         if (fabs(weight - lastWeight) > blockThreshold)
         {
@@ -783,10 +1515,18 @@ void loop()
             lastWeightChangeTime = now;
         }
 
-        if (weight * 10 >= remaining)
+        if (gramsRemaining <= 0.0f)
         {
+            traceWrite(TRACE_TARGET_REACHED, TRACE_INSTANT, static_cast<int32_t>(lroundf(weight * 100.0f)), remaining);
             motorRampDown();
-            setState(MEASURING);
+            if (pulse.enabled)
+            {
+                startPulsing();
+            }
+            else
+            {
+                setState(MEASURING);
+            }
         }
 
         if (webStart)
@@ -800,14 +1540,29 @@ void loop()
         break;
     }
 
+    case PULSING:
+        runPulseFinish(now);
+        if (state == PULSING && btnStart.released())
+        {
+            setState(PAUSED);
+        }
+        break;
+
     case MEASURING:
-        delay(1000);
+        // Decide as soon as the last grounds have landed
+        settleWait(settleTimeoutMs);
         if (weight * 10 >= remaining)
         {
             setState(FINISHED);
         }
         else
         {
+            // Stopped short: the first stop tells how much to compensate
+            if (!toppingUp)
+            {
+                presetLearn(selectedPreset, lroundf(weight * 100.0f) - remaining * 10);
+                toppingUp = true;
+            }
             startGrinding(false);
         }
         break;
@@ -823,7 +1578,7 @@ void loop()
 
         if (btnL.fell())
         {
-            setSelectedPreset(SMALL);
+            setSelectedPreset(presetFavourite(SMALL));
             savePreferences();
             setRemainingTime();
             setState(IDLE);
@@ -831,7 +1586,7 @@ void loop()
 
         if (btnR.fell())
         {
-            setSelectedPreset(LARGE);
+            setSelectedPreset(presetFavourite(LARGE));
             savePreferences();
             setRemainingTime();
             setState(IDLE);
@@ -840,23 +1595,40 @@ void loop()
 
     case FINISHED:
         motorRampDown();
-        if (selectedPreset == SMALL)
+        if (selectedPreset == presetFavourite(SMALL))
         {
             presetSmallRuns++;
         }
-        else
+        else if (selectedPreset == presetFavourite(LARGE))
         {
             presetLargeRuns++;
         }
+        if (!toppingUp)
+        {
+            presetLearn(selectedPreset, lroundf(weight * 100.0f) - remaining * 10);
+        }
         totalWeight += weight;
-        setState(SAVING);
+        recordGrind(GRIND_END_FINISHED);
+
+        // Between batch doses the cup exchange is the only wait
+        if (batchActive())
+        {
+            savePreferences();
+            setState(IDLE);
+        }
+        else
+        {
+            setState(SAVING);
+        }
         break;
 
     case SAVING:
-        savePreferences();
-        setRemainingTime();
-        delay(1000);
-        setState(IDLE);
+        // Show the confirmation without blocking the loop
+        if (millis() - stateSince >= SAVING_DISPLAY_MS)
+        {
+            savePreferences();
+            setState(IDLE);
+        }
         break;
 
     case SET_LEFT:
@@ -880,23 +1652,24 @@ void loop()
     case CALIBRATE:
         if (btnStart.fell())
         {
-            long reading = scale.get_value(10);
-            LOGF("Raw reading: %ld", reading);
-
-            float known_weight = 10.92;
-            float factor = static_cast<float>(reading) / known_weight;
-
-            LOGF("Calibration factor set: %.2f\n", factor);
-
-            scaleFactor = factor;
-            scale.set_scale(scaleFactor);
-
-            setState(SAVING);
+            const char *error = measureCalibrationPoint(CALIBRATION_DEFAULT_WEIGHT_G);
+            if (error != nullptr)
+            {
+                LOGW("[CALIBRATION] %s\n", error);
+            }
+            else
+            {
+                finishCalibration(CALIBRATION_LINEAR);
+            }
         }
         break;
 
     case WEIGHING:
         handleStartButton(btnStart);
         break;
+
+    case UPDATING:
+        motorRampDown();
+        break;
     }
 }
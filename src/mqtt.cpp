@@ -1,10 +1,29 @@
 #include <ArduinoJson.h>
 #include <Preferences.h>
-#include <PubSubClient.h>
 #include <WiFi.h>
+
+#include <atomic>
+#include <cctype>
+#include <climits>
+#include <deque>
+
+#include "asyncmqtt.h"
+#include "autozero.h"
+#include "batch.h"
+#include "cupdetect.h"
+#include "boot.h"
+#include "dosestats.h"
+#include "eventqueue.h"
 #include "mqtt.h"
+#include "ota.h"
+#include "presets.h"
+#include "pulsefinish.h"
+#include "remotecommand.h"
+#include "trace.h"
 #include "types.h"
 #include "version.h"
+#include "weightstream.h"
+#include "wifimanager.h"
 
 // MQTT-Config
 static String mqttServer;
@@ -12,17 +31,37 @@ static uint16_t mqttPort = 0;
 static String mqttUser;
 static String mqttPass;
 
-WiFiClient espClient;
-PubSubClient mqttClient(espClient);
+constexpr unsigned long MQTT_RECONNECT_INTERVAL_MS = 2000;
+
+AsyncMqtt mqttClient;
 
 String mqttIdentifier = "coffeegrinder_" + String((uint32_t)ESP.getEfuseMac(), HEX);
 
-void publishConfigsForHA();
+// Messages arrive in the AsyncTCP task and are dispatched from loopMqtt()
+struct InboundMessage
+{
+    String topic;
+    String payload;
+};
+
+static std::deque<InboundMessage> inbox;
+static SemaphoreHandle_t inboxMutex = xSemaphoreCreateMutex();
+static volatile bool sessionStarted = false;
+static bool forceStatePublish = false;
+static unsigned long lastReconnectAttempt = 0;
+
+// Discovery configs go out over as many mqttPublishState() calls as the send
+// queue needs: a pass skips the configs earlier passes queued and stops at the
+// first one the client refuses
+static uint16_t discoveryQueued = 0;
+static uint16_t discoveryStep = 0;
+static bool discoveryBlocked = false;
+
+static void publishConfigsForHA();
+static void publishPresetConfigs();
 
 // Externe Variablen aus deinem Code
 extern float weight;
-extern uint16_t presetSmall;
-extern uint16_t presetLarge;
 extern float scaleFactor;
 extern float blockThreshold;
 extern volatile State state;
@@ -31,15 +70,106 @@ extern unsigned long presetSmallRuns;
 extern unsigned long presetLargeRuns;
 extern float totalWeight;
 
-extern PresetSelection selectedPreset;
+extern uint8_t selectedPreset;
 
 extern String stateToString(State s);
 
-extern Preferences prefs;
 
 extern void savePreferences();
 extern void setRemainingTime();
-extern void setPreset(PresetSelection selection);
+extern void setState(State s);
+
+#if MQTT_BENCHMARK
+static std::atomic<uint32_t> benchDelivered{0};
+static std::atomic<uint32_t> benchDropped{0};
+
+// Publish `count` messages of `size` bytes with zero-copy publishRef() and log
+// the throughput once the broker (QoS 1) or TCP stack (QoS 0) acknowledged all
+// of them. Trigger against a local broker with e.g.
+//   mosquitto_pub -t coffeegrinder/<id>/cmd/benchmark -m "1000,256,0"
+static void runBenchmark(uint32_t count, size_t size, uint8_t qos)
+{
+    static uint8_t payload[MQTT_MAX_PACKET_SIZE];
+    size = constrain(size, static_cast<size_t>(1), sizeof(payload));
+    memset(payload, 'x', size);
+
+    benchDelivered = 0;
+    benchDropped = 0;
+
+    String topic = "coffeegrinder/" + mqttIdentifier + "/benchmark";
+    unsigned long start = millis();
+    unsigned long blockedUs = 0;
+    uint32_t queued = 0;
+
+    while (queued < count && millis() - start < 30000)
+    {
+        unsigned long t0 = micros();
+        bool ok = mqttClient.publishRef(topic.c_str(), payload, size, false, qos, [](bool delivered) {
+            if (delivered)
+            {
+                benchDelivered++;
+            }
+            else
+            {
+                benchDropped++;
+            }
+        });
+        blockedUs += micros() - t0;
+
+        if (ok)
+        {
+            queued++;
+        }
+        else
+        {
+            vTaskDelay(1);
+        }
+    }
+
+    while (benchDelivered + benchDropped < queued && millis() - start < 30000)
+    {
+        vTaskDelay(1);
+    }
+
+    unsigned long elapsed = millis() - start;
+    if (elapsed == 0)
+    {
+        elapsed = 1;
+    }
+
+    LOGF("[BENCH] %u/%u messages, %u bytes, QoS %u in %lu ms\n", benchDelivered.load(), count, size, qos, elapsed);
+    LOGF("[BENCH] %.1f msg/s, %.1f KB/s, %.2f us per publish call, %u dropped\n",
+         benchDelivered * 1000.0f / elapsed, benchDelivered * size / 1.024f / elapsed,
+         queued ? static_cast<float>(blockedUs) / queued : 0.0f, benchDropped.load());
+}
+#endif
+
+// Table index from coffeegrinder/<id>/<prefix><index><suffix>, -1 if the topic does not match
+static int presetTopicIndex(const String &topic, const char *prefix, const char *suffix)
+{
+    String start = "coffeegrinder/" + mqttIdentifier + "/" + prefix;
+    if (!topic.startsWith(start) || !topic.endsWith(suffix))
+    {
+        return -1;
+    }
+
+    String number = topic.substring(start.length(), topic.length() - strlen(suffix));
+    if (number.isEmpty() || number.length() > 2 || !isdigit(number[0]) || !isdigit(number[number.length() - 1]))
+    {
+        return -1;
+    }
+    int index = number.toInt();
+    return index < presetCount() ? index : -1;
+}
+
+// Commands that tare or change the grind state run in loop(), not in mqttTask
+static void mqttPostCommand(const RemoteCommand &command)
+{
+    if (!postRemoteCommand(command))
+    {
+        LOGW("[MQTT] Command queue full, command dropped\n");
+    }
+}
 
 void callback(char *topic, byte *payload, unsigned int length)
 {
@@ -49,92 +179,234 @@ void callback(char *topic, byte *payload, unsigned int length)
         message += (char)payload[i];
     }
 
+    int presetIndex = -1;
     if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/preset_left/set")
     {
-        presetSmall = message.toFloat() * 10;
+        presetSetTarget(presetFavourite(SMALL), static_cast<uint16_t>(constrain(lroundf(message.toFloat() * 10), 0L, 65535L)));
         savePreferences();
         setRemainingTime();
     }
     else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/preset_right/set")
     {
-        presetLarge = message.toFloat() * 10;
+        presetSetTarget(presetFavourite(LARGE), static_cast<uint16_t>(constrain(lroundf(message.toFloat() * 10), 0L, 65535L)));
         savePreferences();
         setRemainingTime();
     }
+    else if ((presetIndex = presetTopicIndex(topic, "preset/", "/target/set")) >= 0)
+    {
+        presetSetTarget(presetIndex, static_cast<uint16_t>(constrain(lroundf(message.toFloat() * 10), 0L, 65535L)));
+        savePreferences();
+    }
+    else if ((presetIndex = presetTopicIndex(topic, "cmd/grind/", "")) >= 0)
+    {
+        RemoteCommand command = {};
+        command.type = REMOTE_SELECT;
+        command.preset = presetIndex;
+        command.start = true;
+        mqttPostCommand(command);
+    }
+    else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cmd/preset")
+    {
+        // Payload is a table index
+        int index = message.toInt();
+        if (message.length() > 0 && isdigit(message[0]) && index < presetCount())
+        {
+            RemoteCommand command = {};
+            command.type = REMOTE_SELECT;
+            command.preset = index;
+            mqttPostCommand(command);
+        }
+    }
     else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/block_threshold/set")
     {
         blockThreshold = message.toFloat();
         savePreferences();
         setRemainingTime();
     }
+    else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cup_detect/set")
+    {
+        CupDetectConfig cup = cupDetectConfig();
+        cup.enabled = message == "ON" || message == "1";
+        cupDetectConfigure(cup);
+        savePreferences();
+    }
+    else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cup_arm_delay/set")
+    {
+        CupDetectConfig cup = cupDetectConfig();
+        cup.armDelayMs = constrain(lroundf(message.toFloat() * 1000.0f), 0L, static_cast<long>(CUP_MAX_ARM_DELAY_MS));
+        cupDetectConfigure(cup);
+        savePreferences();
+    }
+    else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/pulse_finish/set")
+    {
+        PulseFinishConfig pulse = pulseFinishConfig();
+        pulse.enabled = message == "ON" || message == "1";
+        pulseFinishConfigure(pulse);
+        savePreferences();
+    }
     else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cmd/start")
     {
-        extern bool webStart;
-        extern void startGrinding(bool);
-        webStart = true;
-        startGrinding(true);
+        RemoteCommand command = {};
+        command.type = REMOTE_START;
+        mqttPostCommand(command);
     }
     else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cmd/stop")
     {
-        extern bool webStart;
-        extern void startGrinding(bool);
-        webStart = true;
-        startGrinding(true);
+        // Same as the stop command of the REST API
+        if (state == RUNNING || state == PULSING)
+        {
+            setState(PAUSED);
+        }
     }
     else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cmd/start_right")
     {
-        extern bool webStart;
-        extern void startGrinding(bool);
-        setPreset(LARGE);
-        webStart = true;
-        startGrinding(true);
+        RemoteCommand command = {};
+        command.type = REMOTE_FAVOURITE;
+        command.button = LARGE;
+        command.start = true;
+        mqttPostCommand(command);
     }
     else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cmd/start_left")
     {
-        extern bool webStart;
-        extern void startGrinding(bool);
-        setPreset(SMALL);
-        webStart = true;
-        startGrinding(true);
+        RemoteCommand command = {};
+        command.type = REMOTE_FAVOURITE;
+        command.button = SMALL;
+        command.start = true;
+        mqttPostCommand(command);
+    }
+    else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cmd/batch")
+    {
+        JsonDocument request;
+        RemoteCommand command = {};
+        command.type = REMOTE_BATCH;
+        const char *error = deserializeJson(request, message.c_str())
+                                ? "invalid JSON"
+                                : batchFromJson(request.as<JsonVariantConst>(), selectedPreset, command.jobs, &command.jobCount);
+        if (error == nullptr && !postRemoteCommand(command))
+        {
+            error = "command queue full";
+        }
+        if (error != nullptr)
+        {
+            LOGW("[BATCH] Not started: %s\n", error);
+        }
+    }
+    else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cmd/batch_cancel")
+    {
+        extern void cancelBatch();
+        cancelBatch();
     }
     else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cmd/calibrate")
     {
-        extern void calibrateScale();
-        calibrateScale();
+        RemoteCommand command = {};
+        command.type = REMOTE_CALIBRATE;
+        mqttPostCommand(command);
     }
     else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cmd/tare_scale")
     {
-        extern void tareScale();
-        tareScale();
+        RemoteCommand command = {};
+        command.type = REMOTE_TARE;
+        mqttPostCommand(command);
     }
     else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cmd/left")
     {
-        setPreset(SMALL);
+        RemoteCommand command = {};
+        command.type = REMOTE_FAVOURITE;
+        command.button = SMALL;
+        mqttPostCommand(command);
         LOGF("[SET PRESET] %s\n", "LEFT");
     }
     else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cmd/right")
     {
-        setPreset(LARGE);
+        RemoteCommand command = {};
+        command.type = REMOTE_FAVOURITE;
+        command.button = LARGE;
+        mqttPostCommand(command);
         LOGF("[SET PRESET] %s\n", "RIGHT");
     }
+    else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cmd/update")
+    {
+        if (!otaStartUpdate())
+        {
+            LOG("[OTA] Grinder busy, update not started");
+        }
+    }
+    else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/stream/set")
+    {
+        setWeightStreamEnabled(message == "ON" || message == "1");
+    }
+#if MQTT_BENCHMARK
+    else if (String(topic) == "coffeegrinder/" + mqttIdentifier + "/cmd/benchmark")
+    {
+        unsigned count = 1000, size = 256, qos = 0;
+        sscanf(message.c_str(), "%u,%u,%u", &count, &size, &qos);
+        runBenchmark(count, size, qos > 1 ? 1 : qos);
+    }
+#endif
 }
 
+// Start a connection attempt if none is running; never blocks
 void reconnect()
 {
-    while (!mqttClient.connected())
+    if (mqttClient.connected() || mqttClient.connecting() || !wifiConnected())
     {
-        if (mqttClient.connect(mqttIdentifier.c_str(), mqttUser.c_str(), mqttPass.c_str(), ("coffeegrinder/" + mqttIdentifier + "/status").c_str(), 1, true, "offline"))
-        {
-            // Publish online status after successful connection
-            mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/status").c_str(), "online", true);
-            mqttClient.subscribe(("coffeegrinder/" + mqttIdentifier + "/#").c_str());
+        return;
+    }
 
-            publishConfigsForHA();
-        }
-        else
+    unsigned long now = millis();
+    if (lastReconnectAttempt != 0 && now - lastReconnectAttempt < MQTT_RECONNECT_INTERVAL_MS)
+    {
+        return;
+    }
+    lastReconnectAttempt = now;
+
+    mqttClient.setCredentials(mqttUser, mqttPass);
+    mqttClient.setWill("coffeegrinder/" + mqttIdentifier + "/status", "offline", true, 1);
+    mqttClient.connect(mqttIdentifier);
+}
+
+// Runs in mqttTask once the broker accepted the connection
+static void startSession()
+{
+    bootMark(BOOT_MQTT_CONNECTED);
+
+    // Publish online status after successful connection
+    mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/status").c_str(), "online", true);
+    mqttClient.subscribe(("coffeegrinder/" + mqttIdentifier + "/#").c_str());
+
+    // Also restarts the discovery configs
+    forceStatePublish = true;
+}
+
+static void queueInbound(const char *topic, const uint8_t *payload, size_t length)
+{
+    InboundMessage message;
+    message.topic = topic;
+    message.payload.reserve(length);
+    message.payload.concat(reinterpret_cast<const char *>(payload), length);
+
+    xSemaphoreTake(inboxMutex, portMAX_DELAY);
+    inbox.push_back(std::move(message));
+    xSemaphoreGive(inboxMutex);
+}
+
+static void dispatchInbound()
+{
+    while (true)
+    {
+        InboundMessage message;
+
+        xSemaphoreTake(inboxMutex, portMAX_DELAY);
+        if (inbox.empty())
         {
-            delay(2000);
+            xSemaphoreGive(inboxMutex);
+            return;
         }
+        message = std::move(inbox.front());
+        inbox.pop_front();
+        xSemaphoreGive(inboxMutex);
+
+        callback(const_cast<char *>(message.topic.c_str()), reinterpret_cast<byte *>(const_cast<char *>(message.payload.c_str())), message.payload.length());
     }
 }
 
@@ -147,8 +419,36 @@ void addDeviceBlock(JsonObject& device) {
   device["sw_version"] = CURRENT_VERSION;
 }
 
+// The next config of the running discovery pass has not been queued yet
+static bool discoveryDue() {
+    return !discoveryBlocked && discoveryStep++ >= discoveryQueued;
+}
+
+static void discoveryPublish(const char* topic, const char* payload) {
+    if (mqttClient.publish(topic, payload, true)) {
+        discoveryQueued++;
+    } else {
+        discoveryBlocked = true;
+    }
+}
+
+// One pass of a discovery publisher; queued carries the progress between
+// passes. True once every config of the publisher is queued.
+static bool runDiscovery(void (*publisher)(), uint16_t &queued) {
+    discoveryQueued = queued;
+    discoveryStep = 0;
+    discoveryBlocked = false;
+    publisher();
+    queued = discoveryQueued;
+    return !discoveryBlocked;
+}
+
 // Hilfsfunktion: publish JSON Payload
 void publishConfig(const char* topic, std::function<void(JsonDocument&)> buildPayload) {
+    if (!discoveryDue()) {
+        return;
+    }
+
     JsonDocument doc;
     buildPayload(doc);
 
@@ -156,14 +456,14 @@ void publishConfig(const char* topic, std::function<void(JsonDocument&)> buildPa
 
     static char payload[1024];
     serializeJson(doc, payload);
-    LOGF("[TOPIC] %s\n", topic);
-    LOGF("[PAYLOAD] %s\n", payload);
-    bool result = mqttClient.publish(topic, payload, true);
-    LOGF("[MQTT] Connected: %s\n", mqttClient.connected() ? "YES" : "NO");
-    LOGF("[MQTT] Publish result: %s\n", result ? "OK" : "FAILED");
+    LOGD("[TOPIC] %s\n", topic);
+    LOGD("[PAYLOAD] %s\n", payload);
+    discoveryPublish(topic, payload);
+    LOGD("[MQTT] Publish result: %s\n", discoveryBlocked ? "FAILED" : "OK");
 }
 
 void setupMqtt() {
+    Preferences prefs;
     prefs.begin("mqtt", true);
     String server = prefs.getString("server", "");
     uint16_t port = prefs.getUInt("port", 0);
@@ -171,21 +471,29 @@ void setupMqtt() {
     String pass = prefs.getString("pass", "");
     prefs.end();
 
+    // Settings may change at runtime; drop the old session first
+    mqttClient.disconnect();
+
+    mqttServer = server;
+    mqttPort = port;
+    mqttUser = user;
+    mqttPass = pass;
+
     if (server.isEmpty() || port == 0) {
-        LOGF("[MQTT] No valid MQTT config found. Skipping setup.\nServer: %s\nPort: %d\nUser: %s\nPassword: %s\n", server, port, user, pass);
+        LOGF("[MQTT] No valid MQTT config found. Skipping setup.\nServer: %s\nPort: %d\nUser: %s\nPassword: %s\n", server.c_str(), port, user.c_str(), pass.c_str());
         return;
     }
 
-    mqttClient.setServer(server.c_str(), port);
-    mqttClient.setCallback(callback);
+    mqttClient.setServer(server, port);
+    mqttClient.onMessage(queueInbound);
+    mqttClient.onConnect([]() { sessionStarted = true; });
     mqttClient.setKeepAlive(60);
-    mqttUser = user;
-    mqttPass = pass;
 
+    lastReconnectAttempt = 0;
     reconnect();
 }
 
-void publishConfigsForHA() {
+static void publishConfigsForHA() {
     // MQTT Status (optional, for Home Assistant reference)
     publishConfig(("homeassistant/sensor/" + mqttIdentifier + "/status/config").c_str(), [](JsonDocument& doc) {
         doc["name"] = "MQTT Status";
@@ -270,6 +578,67 @@ void publishConfigsForHA() {
         addDeviceBlock(device);
     });
 
+    // Cup detection: auto-tare and auto-start when a cup is placed
+    publishConfig(("homeassistant/switch/" + mqttIdentifier + "/cup_detect/config").c_str(), [](JsonDocument& doc) {
+        doc["name"] = "Cup Detection";
+        doc["unique_id"] = mqttIdentifier + "_cup_detect";
+        doc["command_topic"] = "coffeegrinder/" + mqttIdentifier + "/cup_detect/set";
+        doc["state_topic"] = "coffeegrinder/" + mqttIdentifier + "/cup_detect";
+        doc["entity_category"] = "config";
+
+        JsonObject device = doc["device"].to<JsonObject>();
+        addDeviceBlock(device);
+    });
+
+    publishConfig(("homeassistant/number/" + mqttIdentifier + "/cup_arm_delay/config").c_str(), [](JsonDocument& doc) {
+        doc["name"] = "Cup Arm Delay";
+        doc["unique_id"] = mqttIdentifier + "_cup_arm_delay";
+        doc["command_topic"] = "coffeegrinder/" + mqttIdentifier + "/cup_arm_delay/set";
+        doc["state_topic"] = "coffeegrinder/" + mqttIdentifier + "/cup_arm_delay";
+        doc["step"] = 0.1;
+        doc["min"] = 0;
+        doc["max"] = CUP_MAX_ARM_DELAY_MS / 1000;
+        doc["unit_of_measurement"] = "s";
+        doc["entity_category"] = "config";
+
+        JsonObject device = doc["device"].to<JsonObject>();
+        addDeviceBlock(device);
+    });
+
+    // Pulse finishing: the last grams in short bursts
+    publishConfig(("homeassistant/switch/" + mqttIdentifier + "/pulse_finish/config").c_str(), [](JsonDocument& doc) {
+        doc["name"] = "Pulse Finishing";
+        doc["unique_id"] = mqttIdentifier + "_pulse_finish";
+        doc["command_topic"] = "coffeegrinder/" + mqttIdentifier + "/pulse_finish/set";
+        doc["state_topic"] = "coffeegrinder/" + mqttIdentifier + "/pulse_finish";
+        doc["entity_category"] = "config";
+
+        JsonObject device = doc["device"].to<JsonObject>();
+        addDeviceBlock(device);
+    });
+
+    // Batch progress; results per dose are in the attributes
+    publishConfig(("homeassistant/sensor/" + mqttIdentifier + "/batch/config").c_str(), [](JsonDocument& doc) {
+        doc["name"] = "Batch";
+        doc["unique_id"] = mqttIdentifier + "_batch";
+        doc["state_topic"] = "coffeegrinder/" + mqttIdentifier + "/batch";
+        doc["value_template"] = "{{ value_json.done }}/{{ value_json.count }}";
+        doc["json_attributes_topic"] = "coffeegrinder/" + mqttIdentifier + "/batch";
+
+        JsonObject device = doc["device"].to<JsonObject>();
+        addDeviceBlock(device);
+    });
+
+    // Button: Cancel batch
+    publishConfig(("homeassistant/button/" + mqttIdentifier + "/batch_cancel/config").c_str(), [](JsonDocument& doc) {
+        doc["name"] = "Cancel Batch";
+        doc["unique_id"] = mqttIdentifier + "_cmd_batch_cancel";
+        doc["command_topic"] = "coffeegrinder/" + mqttIdentifier + "/cmd/batch_cancel";
+
+        JsonObject device = doc["device"].to<JsonObject>();
+        addDeviceBlock(device);
+    });
+
     // Scale Factor
     publishConfig(("homeassistant/sensor/" + mqttIdentifier + "/scale_factor/config").c_str(), [](JsonDocument& doc) {
         doc["name"] = "Scale Factor";
@@ -281,6 +650,20 @@ void publishConfigsForHA() {
         addDeviceBlock(device);
     });
 
+    // Zero drift corrected by auto-zero tracking since the last tare
+    publishConfig(("homeassistant/sensor/" + mqttIdentifier + "/zero_drift/config").c_str(), [](JsonDocument& doc) {
+        doc["name"] = "Zero Drift";
+        doc["unique_id"] = mqttIdentifier + "_zero_drift";
+        doc["state_topic"] = "coffeegrinder/" + mqttIdentifier + "/zero_drift";
+        doc["value_template"] = "{{ value_json.drift }}";
+        doc["json_attributes_topic"] = "coffeegrinder/" + mqttIdentifier + "/zero_drift";
+        doc["unit_of_measurement"] = "g";
+        doc["entity_category"] = "diagnostic";
+
+        JsonObject device = doc["device"].to<JsonObject>();
+        addDeviceBlock(device);
+    });
+
     // Presets Runs Counter
     publishConfig(("homeassistant/sensor/" + mqttIdentifier + "/presets_left_runs/config").c_str(), [](JsonDocument& doc) {
         doc["name"] = "Coffee Small Count";
@@ -313,6 +696,37 @@ void publishConfigsForHA() {
         addDeviceBlock(device);
     });
 
+    // Dose statistics, one JSON state per preset
+    static const struct
+    {
+        const char *key;
+        const char *name;
+        const char *unit;
+    } statSensors[] = {
+        {"error_p50", "Dose Error p50", "g"},
+        {"error_p95", "Dose Error p95", "g"},
+        {"error_p99", "Dose Error p99", "g"},
+        {"time_p50", "Grind Time p50", "s"},
+        {"time_p95", "Grind Time p95", "s"},
+    };
+    for (const char *side : {"left", "right"}) {
+        for (const auto &sensor : statSensors) {
+            String id = String("stats_") + side + "_" + sensor.key;
+            publishConfig(("homeassistant/sensor/" + mqttIdentifier + "/" + id + "/config").c_str(), [&](JsonDocument& doc) {
+                doc["name"] = String(strcmp(side, "left") == 0 ? "Coffee Small " : "Coffee Large ") + sensor.name;
+                doc["unique_id"] = mqttIdentifier + "_" + id;
+                doc["state_topic"] = "coffeegrinder/" + mqttIdentifier + "/stats/" + side;
+                doc["value_template"] = String("{{ value_json.") + sensor.key + " }}";
+                doc["json_attributes_topic"] = "coffeegrinder/" + mqttIdentifier + "/stats/" + side;
+                doc["unit_of_measurement"] = sensor.unit;
+                doc["state_class"] = "measurement";
+
+                JsonObject device = doc["device"].to<JsonObject>();
+                addDeviceBlock(device);
+            });
+        }
+    }
+
     // Button: Start
     publishConfig(("homeassistant/button/" + mqttIdentifier + "/start/config").c_str(), [](JsonDocument& doc) {
         doc["name"] = "Press Start";
@@ -373,6 +787,31 @@ void publishConfigsForHA() {
         addDeviceBlock(device);
     });
 
+    // Button: Firmware update
+    publishConfig(("homeassistant/button/" + mqttIdentifier + "/update/config").c_str(), [](JsonDocument& doc) {
+        doc["name"] = "Firmware Update";
+        doc["unique_id"] = mqttIdentifier + "_cmd_update";
+        doc["command_topic"] = "coffeegrinder/" + mqttIdentifier + "/cmd/update";
+        doc["entity_category"] = "config";
+
+        JsonObject device = doc["device"].to<JsonObject>();
+        addDeviceBlock(device);
+    });
+
+    // Firmware update progress
+    publishConfig(("homeassistant/sensor/" + mqttIdentifier + "/update_progress/config").c_str(), [](JsonDocument& doc) {
+        doc["name"] = "Update Progress";
+        doc["unique_id"] = mqttIdentifier + "_update_progress";
+        doc["state_topic"] = "coffeegrinder/" + mqttIdentifier + "/update";
+        doc["value_template"] = "{{ value_json.progress }}";
+        doc["json_attributes_topic"] = "coffeegrinder/" + mqttIdentifier + "/update";
+        doc["unit_of_measurement"] = "%";
+        doc["entity_category"] = "diagnostic";
+
+        JsonObject device = doc["device"].to<JsonObject>();
+        addDeviceBlock(device);
+    });
+
     // Button: Preset Left
     publishConfig(("homeassistant/button/" + mqttIdentifier + "/left/config").c_str(), [](JsonDocument& doc) {
         doc["name"] = "Press Small";
@@ -394,78 +833,342 @@ void publishConfigsForHA() {
     });
 }
 
+// Entities per preset table entry: target, a grind button and the learned
+// compensation. Unused slots get an empty config, which removes their entities.
+static void publishPresetConfigs() {
+    for (uint8_t i = 0; i < PRESET_MAX_COUNT; i++) {
+        String id = String(i);
+        String number = "homeassistant/number/" + mqttIdentifier + "/preset_" + id + "/config";
+        String button = "homeassistant/button/" + mqttIdentifier + "/grind_" + id + "/config";
+        String compensation = "homeassistant/sensor/" + mqttIdentifier + "/preset_" + id + "_compensation/config";
+        String stateTopic = "coffeegrinder/" + mqttIdentifier + "/preset/" + id;
+
+        Preset preset;
+        if (!presetGet(i, &preset)) {
+            for (const String &topic : {number, button, compensation}) {
+                if (discoveryDue()) {
+                    discoveryPublish(topic.c_str(), "");
+                }
+            }
+            continue;
+        }
+
+        publishConfig(number.c_str(), [&](JsonDocument& doc) {
+            doc["name"] = "Preset " + String(preset.name);
+            doc["unique_id"] = mqttIdentifier + "_preset_" + id;
+            doc["command_topic"] = stateTopic + "/target/set";
+            doc["state_topic"] = stateTopic;
+            doc["value_template"] = "{{ value_json.target }}";
+            doc["step"] = 0.1;
+            doc["min"] = MIN_PRESET_WEIGHT / 10.0f;
+            doc["max"] = MAX_PRESET_WEIGHT / 10.0f;
+            doc["unit_of_measurement"] = "g";
+
+            JsonObject device = doc["device"].to<JsonObject>();
+            addDeviceBlock(device);
+        });
+
+        publishConfig(button.c_str(), [&](JsonDocument& doc) {
+            doc["name"] = "Grind " + String(preset.name);
+            doc["unique_id"] = mqttIdentifier + "_cmd_grind_" + id;
+            doc["command_topic"] = "coffeegrinder/" + mqttIdentifier + "/cmd/grind/" + id;
+
+            JsonObject device = doc["device"].to<JsonObject>();
+            addDeviceBlock(device);
+        });
+
+        publishConfig(compensation.c_str(), [&](JsonDocument& doc) {
+            doc["name"] = String(preset.name) + " Compensation";
+            doc["unique_id"] = mqttIdentifier + "_preset_" + id + "_compensation";
+            doc["state_topic"] = stateTopic;
+            doc["value_template"] = "{{ value_json.compensation }}";
+            doc["json_attributes_topic"] = stateTopic;
+            doc["unit_of_measurement"] = "g";
+            doc["entity_category"] = "diagnostic";
+
+            JsonObject device = doc["device"].to<JsonObject>();
+            addDeviceBlock(device);
+        });
+    }
+}
+
+// Retained JSON per table entry on coffeegrinder/<id>/preset/<index>
+static bool publishPresetStates() {
+    bool ok = true;
+    Preset preset;
+    for (uint8_t i = 0; presetGet(i, &preset); i++) {
+        JsonDocument doc;
+        presetToJson(preset, doc.to<JsonObject>());
+
+        char payload[256];
+        serializeJson(doc, payload);
+        ok = mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/preset/" + String(i)).c_str(), payload, true) && ok;
+    }
+    return ok;
+}
+
+// Count and names, which the discovery configs depend on
+static uint32_t presetLayoutHash() {
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](uint8_t byte) {
+        hash = (hash ^ byte) * 16777619u;
+    };
+
+    Preset preset;
+    for (uint8_t i = 0; presetGet(i, &preset); i++) {
+        mix(i);
+        for (const char *c = preset.name; *c; c++) {
+            mix(static_cast<uint8_t>(*c));
+        }
+    }
+    return hash;
+}
+
+// Broker settings as last loaded from NVS; the password is not exposed
+void mqttGetConfig(String &server, uint16_t &port, String &user)
+{
+    server = mqttServer;
+    port = mqttPort;
+    user = mqttUser;
+}
+
 void loopMqtt()
 {
-    if (!mqttClient.connected())
+    if (mqttServer.isEmpty() || mqttPort == 0)
     {
-        reconnect();
+        return;
     }
+
+    reconnect();
     mqttClient.loop();
+
+    if (sessionStarted)
+    {
+        sessionStarted = false;
+        startSession();
+    }
+
+    dispatchInbound();
+    loopEventQueue();
+    loopWeightStream();
+}
+
+// Retained JSON per preset on coffeegrinder/<id>/stats/<index>, and for the
+// button favourites on coffeegrinder/<id>/stats/<left|right>
+static bool publishDoseStats()
+{
+    bool ok = true;
+    uint8_t count = presetCount();
+    for (uint8_t topic = 0; topic < count + 2; topic++) {
+        uint8_t preset = topic < count ? topic : presetFavourite(topic == count ? SMALL : LARGE);
+        DoseStatsSummary s = doseStatsSummary(preset);
+        char payload[256];
+        snprintf(payload, sizeof(payload),
+                 "{\"count\":%lu,\"error_mean\":%.3f,\"error_stddev\":%.3f,\"error_p50\":%.2f,\"error_p95\":%.2f,"
+                 "\"error_p99\":%.2f,\"time_mean\":%.1f,\"time_stddev\":%.1f,\"time_p50\":%.1f,\"time_p95\":%.1f,\"time_p99\":%.1f}",
+                 static_cast<unsigned long>(s.count), s.errorMean, s.errorStddev, s.errorP50, s.errorP95, s.errorP99,
+                 s.timeMean, s.timeStddev, s.timeP50, s.timeP95, s.timeP99);
+        String name = topic < count ? String(topic) : topic == count ? "left" : "right";
+        ok = mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/stats/" + name).c_str(), payload, true) && ok;
+    }
+    return ok;
 }
 
 void mqttPublishState()
 {
+    TraceSpan span(TRACE_MQTT_STATE);
+
     static float lastWeight = -1;
     static uint16_t lastPresetSmall = 0;
     static uint16_t lastPresetLarge = 0;
+    static uint32_t lastPresetsRevision = 0;
+    static uint16_t fixedConfigsQueued = 0;
+    static bool fixedConfigsDone = false;
+    static uint32_t presetConfigsLayout = 0;
+    static uint16_t presetConfigsQueued = 0;
+    static bool presetConfigsDone = false;
     static float lastBlockThreshold = -1;
     static float lastScaleFactor = 0.0f;
     static unsigned long lastPresetSmallRuns = -1;
     static unsigned long lastPresetLargeRuns = -1;
     static float lastTotalWeight = -1;
-    static PresetSelection lastSelectedPreset = SMALL;
+    static String lastSelectedPreset;
     static State lastState = UNKNOWN;
+    static uint32_t lastStatsRevision = 0;
+    static long lastZeroDriftCg = LONG_MIN;
+    static int8_t lastCupEnabled = -1;
+    static int32_t lastCupArmDelay = -1;
+    static int8_t lastPulseEnabled = -1;
+    static uint32_t lastBatchRevision = 0;
+
+    // Publishing only enqueues; retry changed values once the broker is back
+    if (!mqttClient.connected()) {
+        return;
+    }
+
+    if (forceStatePublish) {
+        forceStatePublish = false;
+        lastWeight = -1;
+        lastPresetSmall = 0;
+        lastPresetLarge = 0;
+        lastPresetsRevision = presetsRevision() - 1;
+        fixedConfigsQueued = 0;
+        fixedConfigsDone = false;
+        presetConfigsLayout = presetLayoutHash();
+        presetConfigsQueued = 0;
+        presetConfigsDone = false;
+        lastSelectedPreset = "";
+        lastBlockThreshold = -1;
+        lastScaleFactor = 0.0f;
+        lastPresetSmallRuns = -1;
+        lastPresetLargeRuns = -1;
+        lastTotalWeight = -1;
+        lastState = UNKNOWN;
+        lastStatsRevision = doseStatsRevision() - 1;
+        lastZeroDriftCg = LONG_MIN;
+        lastCupEnabled = -1;
+        lastCupArmDelay = -1;
+        lastPulseEnabled = -1;
+        lastBatchRevision = batchRevision() - 1;
+    }
+
+    // Discovery first, continued on the next calls while the send queue is full;
+    // a changed preset count or name starts the preset entities over
+    if (!fixedConfigsDone) {
+        fixedConfigsDone = runDiscovery(publishConfigsForHA, fixedConfigsQueued);
+    }
+    uint32_t layout = presetLayoutHash();
+    if (layout != presetConfigsLayout) {
+        presetConfigsLayout = layout;
+        presetConfigsQueued = 0;
+        presetConfigsDone = false;
+    }
+    if (fixedConfigsDone && !presetConfigsDone) {
+        presetConfigsDone = runDiscovery(publishPresetConfigs, presetConfigsQueued);
+    }
 
     if (roundf(weight * 10.0f) != roundf(lastWeight * 10.0f)) {
-        mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/current_weight").c_str(), String(weight, 1).c_str(), true);
-        lastWeight = weight;
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/current_weight").c_str(), String(weight, 1).c_str(), true)) {
+            lastWeight = weight;
+        }
+    }
+
+    Preset preset = presetDefaults();
+    presetGet(selectedPreset, &preset);
+    String selected = String(preset.name) + " (" + String(preset.target / 10.0f, 1) + "g)";
+    if (selected != lastSelectedPreset) {
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/selected_preset").c_str(), selected.c_str(), true)) {
+            lastSelectedPreset = selected;
+        }
     }
 
-    if (selectedPreset != lastSelectedPreset || presetSmall != lastPresetSmall || presetLarge != lastPresetLarge) {
-        const char* preset = selectedPreset == SMALL ? "SMALL" : "LARGE";
-        float timeValue = (selectedPreset == SMALL ? presetSmall : presetLarge) / 10.0f;
-        String message = String(preset) + " (" + String(timeValue, 1) + "s)";
-        mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/selected_preset").c_str(), message.c_str(), true);
-        lastSelectedPreset = selectedPreset;
+    uint32_t currentPresetsRevision = presetsRevision();
+    if (currentPresetsRevision != lastPresetsRevision) {
+        if (publishPresetStates()) {
+            lastPresetsRevision = currentPresetsRevision;
+        }
     }
 
+    uint16_t presetSmall = presetGet(presetFavourite(SMALL), &preset) ? preset.target : 0;
+    uint16_t presetLarge = presetGet(presetFavourite(LARGE), &preset) ? preset.target : 0;
+
     if (presetSmall != lastPresetSmall) {
-        mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/preset_left").c_str(), String(presetSmall / 10.0f, 1).c_str(), true);
-        lastPresetSmall = presetSmall;
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/preset_left").c_str(), String(presetSmall / 10.0f, 1).c_str(), true)) {
+            lastPresetSmall = presetSmall;
+        }
     }
 
     if (presetLarge != lastPresetLarge) {
-        mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/preset_right").c_str(), String(presetLarge / 10.0f, 1).c_str(), true);
-        lastPresetLarge = presetLarge;
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/preset_right").c_str(), String(presetLarge / 10.0f, 1).c_str(), true)) {
+            lastPresetLarge = presetLarge;
+        }
     }
 
     if (blockThreshold != lastBlockThreshold) {
-        mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/block_threshold").c_str(), String(blockThreshold, 2).c_str(), true);
-        lastBlockThreshold = blockThreshold;
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/block_threshold").c_str(), String(blockThreshold, 2).c_str(), true)) {
+            lastBlockThreshold = blockThreshold;
+        }
     }
 
     if (scaleFactor != lastScaleFactor) {
-        mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/scale_factor").c_str(), String(scaleFactor, 2).c_str(), true);
-        lastScaleFactor = scaleFactor;
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/scale_factor").c_str(), String(scaleFactor, 2).c_str(), true)) {
+            lastScaleFactor = scaleFactor;
+        }
     }
 
     if (presetSmallRuns != lastPresetSmallRuns) {
-        mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/presets_left_runs").c_str(), String(presetSmallRuns).c_str(), true);
-        lastPresetSmallRuns = presetSmallRuns;
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/presets_left_runs").c_str(), String(presetSmallRuns).c_str(), true)) {
+            lastPresetSmallRuns = presetSmallRuns;
+        }
     }
 
     if (presetLargeRuns != lastPresetLargeRuns) {
-        mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/presets_right_runs").c_str(), String(presetLargeRuns).c_str(), true);
-        lastPresetLargeRuns = presetLargeRuns;
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/presets_right_runs").c_str(), String(presetLargeRuns).c_str(), true)) {
+            lastPresetLargeRuns = presetLargeRuns;
+        }
     }
 
     if (totalWeight != lastTotalWeight) {
-        mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/total_weight").c_str(), String(totalWeight, 1).c_str(), true);
-        lastTotalWeight = totalWeight;
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/total_weight").c_str(), String(totalWeight, 1).c_str(), true)) {
+            lastTotalWeight = totalWeight;
+        }
     }
 
     if (state != lastState) {
-        mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/current_state").c_str(), stateToString(state).c_str(), true);
-        lastState = state;
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/current_state").c_str(), stateToString(state).c_str(), true)) {
+            lastState = state;
+        }
+    }
+
+    CupDetectConfig cup = cupDetectConfig();
+    if (cup.enabled != lastCupEnabled) {
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/cup_detect").c_str(), cup.enabled ? "ON" : "OFF", true)) {
+            lastCupEnabled = cup.enabled;
+        }
+    }
+
+    if (cup.armDelayMs != lastCupArmDelay) {
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/cup_arm_delay").c_str(), String(cup.armDelayMs / 1000.0f, 1).c_str(), true)) {
+            lastCupArmDelay = cup.armDelayMs;
+        }
+    }
+
+    PulseFinishConfig pulse = pulseFinishConfig();
+    if (pulse.enabled != lastPulseEnabled) {
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/pulse_finish").c_str(), pulse.enabled ? "ON" : "OFF", true)) {
+            lastPulseEnabled = pulse.enabled;
+        }
+    }
+
+    AutoZeroStatus zero = autoZeroStatus(millis());
+    long zeroDriftCg = lroundf(zero.driftG * 100.0f);
+    if (zeroDriftCg != lastZeroDriftCg) {
+        JsonDocument doc;
+        doc["drift"] = zeroDriftCg / 100.0f;
+        doc["rate"] = roundf(zero.driftRateGpm * 1000.0f) / 1000.0f;
+        doc["tracking"] = zero.atZero;
+
+        char payload[96];
+        serializeJson(doc, payload);
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/zero_drift").c_str(), payload, true)) {
+            lastZeroDriftCg = zeroDriftCg;
+        }
+    }
+
+    uint32_t currentBatchRevision = batchRevision();
+    if (currentBatchRevision != lastBatchRevision) {
+        JsonDocument doc;
+        batchToJson(doc.to<JsonObject>());
+
+        String payload;
+        serializeJson(doc, payload);
+        if (mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/batch").c_str(), payload.c_str(), true)) {
+            lastBatchRevision = currentBatchRevision;
+        }
+    }
+
+    uint32_t statsRevision = doseStatsRevision();
+    if (statsRevision != lastStatsRevision && publishDoseStats()) {
+        lastStatsRevision = statsRevision;
     }
 }
\ No newline at end of file
@@ -1,10 +1,36 @@
+#include <Arduino.h>
+#include <HTTPClient.h>
+#include <Preferences.h>
+
+#include <ArduinoJson.h>
+#include <mbedtls/sha256.h>
+
+#include <atomic>
+
+#include "asyncmqtt.h"
+#include "firmwarewriter.h"
 #include "ota.h"
+#include "settings.h"
+#include "telemetry.h"
+#include "types.h"
+#include "version.h"
+
+extern volatile State state;
+extern AsyncMqtt mqttClient;
+extern String mqttIdentifier;
+
+extern void setState(State s);
+
+static std::atomic<bool> otaBusy{false};
+static OtaStatus status = {OTA_IDLE, 0, 0, "", ""};
+static portMUX_TYPE statusMux = portMUX_INITIALIZER_UNLOCKED;
 
 void setupOTA() {
     ArduinoOTA.setHostname("coffeegrinder");
 
     ArduinoOTA.onStart([]() {
         Serial.println("Start OTA update");
+        settingsFlush();
     });
 
     ArduinoOTA.onEnd([]() {
@@ -26,4 +52,413 @@ void setupOTA() {
 
     ArduinoOTA.begin();
     Serial.println("OTA Ready");
-}
\ No newline at end of file
+}
+
+// -----------------------------------------------------------------------------
+// Background auto-update
+//
+// The web and MQTT handlers only start otaTask; the release lookup, download
+// and flashing all run there. The image is hashed while it is written and
+// only activated if the SHA-256 matches the one published with the release.
+// -----------------------------------------------------------------------------
+
+const char *otaPhaseToString(OtaPhase phase)
+{
+    switch (phase)
+    {
+    case OTA_IDLE: return "idle";
+    case OTA_CHECKING: return "checking";
+    case OTA_DOWNLOADING: return "downloading";
+    case OTA_VERIFYING: return "verifying";
+    case OTA_DONE: return "done";
+    case OTA_UP_TO_DATE: return "up_to_date";
+    case OTA_FAILED: return "failed";
+    }
+    return "unknown";
+}
+
+OtaStatus otaGetStatus()
+{
+    portENTER_CRITICAL(&statusMux);
+    OtaStatus copy = status;
+    portEXIT_CRITICAL(&statusMux);
+    return copy;
+}
+
+String otaGetSource()
+{
+    Preferences store;
+    store.begin("ota", true);
+    String url = store.getString("url", OTA_DEFAULT_SOURCE);
+    store.end();
+    return url.length() ? url : String(OTA_DEFAULT_SOURCE);
+}
+
+// An empty url restores the default release source
+void otaSetSource(const String &url)
+{
+    Preferences store;
+    store.begin("ota", false);
+    if (url.length())
+    {
+        store.putString("url", url);
+    }
+    else
+    {
+        store.remove("url");
+    }
+    store.end();
+}
+
+// Push the status to WebSocket clients and MQTT
+static void reportStatus()
+{
+    OtaStatus s = otaGetStatus();
+
+    JsonDocument doc;
+    JsonObject update = doc["update"].to<JsonObject>();
+    update["phase"] = otaPhaseToString(s.phase);
+    update["progress"] = s.total ? static_cast<uint8_t>(100ULL * s.written / s.total) : 0;
+    update["written"] = s.written;
+    update["total"] = s.total;
+    update["version"] = s.version;
+    if (s.error[0])
+    {
+        update["error"] = s.error;
+    }
+
+    char payload[192];
+    serializeJson(doc, payload);
+    telemetryBroadcastText(payload);
+
+    if (mqttClient.connected())
+    {
+        serializeJson(update, payload);
+        mqttClient.publish(("coffeegrinder/" + mqttIdentifier + "/update").c_str(), payload, false);
+    }
+}
+
+static void setPhase(OtaPhase phase, const char *error = "")
+{
+    portENTER_CRITICAL(&statusMux);
+    status.phase = phase;
+    strlcpy(status.error, error, sizeof(status.error));
+    portEXIT_CRITICAL(&statusMux);
+
+    if (phase == OTA_FAILED)
+    {
+        LOGE("[OTA] Failed: %s\n", error);
+    }
+    reportStatus();
+}
+
+static void setProgress(uint32_t written, uint32_t total)
+{
+    portENTER_CRITICAL(&statusMux);
+    status.written = written;
+    status.total = total;
+    portEXIT_CRITICAL(&statusMux);
+}
+
+static bool parseDigest(const char *hex, uint8_t digest[32])
+{
+    if (strncmp(hex, "sha256:", 7) == 0)
+    {
+        hex += 7;
+    }
+
+    for (uint8_t i = 0; i < 32; i++)
+    {
+        char byte[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+        if (!isxdigit(byte[0]) || !isxdigit(byte[1]))
+        {
+            return false;
+        }
+        digest[i] = strtoul(byte, nullptr, 16);
+    }
+    return true;
+}
+
+// Look up the newest release: firmware URL, expected SHA-256 and version.
+// The digest comes from the asset itself or from a "<name>.sha256" asset.
+static bool fetchRelease(String &firmwareUrl, uint8_t digest[32], String &version)
+{
+    HTTPClient http;
+    http.begin(otaGetSource());
+    http.useHTTP10(true); // no chunked encoding, so the body can be parsed from the stream
+    http.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
+    http.setUserAgent("ESP32");
+    http.setConnectTimeout(5000);
+
+    int httpCode = http.GET();
+    if (httpCode != HTTP_CODE_OK)
+    {
+        LOGW("[OTA] Release lookup: HTTP %d %s\n", httpCode, HTTPClient::errorToString(httpCode).c_str());
+        http.end();
+        setPhase(OTA_FAILED, "release lookup failed");
+        return false;
+    }
+
+    // Release documents are large; keep only what is needed
+    JsonDocument filter;
+    filter["tag_name"] = true;
+    filter["assets"][0]["name"] = true;
+    filter["assets"][0]["browser_download_url"] = true;
+    filter["assets"][0]["digest"] = true;
+
+    JsonDocument doc;
+    DeserializationError error = deserializeJson(doc, http.getStream(), DeserializationOption::Filter(filter));
+    http.end();
+
+    if (error)
+    {
+        setPhase(OTA_FAILED, "invalid release data");
+        return false;
+    }
+
+    version = doc["tag_name"] | "";
+    portENTER_CRITICAL(&statusMux);
+    strlcpy(status.version, version.c_str(), sizeof(status.version));
+    portEXIT_CRITICAL(&statusMux);
+
+    if (version == CURRENT_VERSION)
+    {
+        setPhase(OTA_UP_TO_DATE);
+        return false;
+    }
+
+    // Prefer the compressed image, it transfers in about half the time
+    String firmwareName;
+    String digestHex;
+    uint8_t rank = 0;
+    for (JsonObject asset : doc["assets"].as<JsonArray>())
+    {
+        String name = asset["name"] | "";
+        uint8_t nameRank = name == "firmware.bin.gz" ? 3 : name == "firmware.bin" ? 2 : name.endsWith(".bin") ? 1 : 0;
+        if (nameRank > rank)
+        {
+            rank = nameRank;
+            firmwareName = name;
+            firmwareUrl = asset["browser_download_url"] | "";
+            digestHex = asset["digest"] | "";
+        }
+    }
+
+    if (firmwareUrl.isEmpty())
+    {
+        setPhase(OTA_FAILED, "firmware .bin not found");
+        return false;
+    }
+
+    if (digestHex.isEmpty())
+    {
+        for (JsonObject asset : doc["assets"].as<JsonArray>())
+        {
+            if (firmwareName + ".sha256" == (asset["name"] | ""))
+            {
+                http.begin(asset["browser_download_url"] | "");
+                http.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
+                if (http.GET() == HTTP_CODE_OK)
+                {
+                    digestHex = http.getString();
+                }
+                http.end();
+                break;
+            }
+        }
+    }
+
+    if (!parseDigest(digestHex.c_str(), digest))
+    {
+        setPhase(OTA_FAILED, "no SHA-256 for firmware");
+        return false;
+    }
+
+    LOGF("[OTA] %s -> %s: %s\n", CURRENT_VERSION, version.c_str(), firmwareUrl.c_str());
+    return true;
+}
+
+// Read up to `want` bytes, waiting for slow connections but not forever
+static size_t readChunk(HTTPClient &http, WiFiClient *stream, uint8_t *buf, size_t want)
+{
+    size_t fill = 0;
+    unsigned long lastData = millis();
+
+    while (fill < want)
+    {
+        int available = stream->available();
+        if (available <= 0)
+        {
+            if (!http.connected() || millis() - lastData > OTA_STALL_TIMEOUT_MS)
+            {
+                break;
+            }
+            vTaskDelay(1);
+            continue;
+        }
+
+        int n = stream->read(buf + fill, min(static_cast<size_t>(available), want - fill));
+        if (n > 0)
+        {
+            fill += n;
+            lastData = millis();
+        }
+    }
+    return fill;
+}
+
+// Stream the image into the inactive slot, hashing every chunk on the way;
+// gzip images are inflated by the FirmwareWriter
+static bool flashFirmware(const String &url, const uint8_t expected[32])
+{
+    HTTPClient http;
+    http.begin(url);
+    http.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
+    http.setUserAgent("ESP32");
+    http.setConnectTimeout(5000);
+
+    int httpCode = http.GET();
+    int total = http.getSize();
+    if (httpCode != HTTP_CODE_OK || total <= 0)
+    {
+        LOGF("[OTA] Download: HTTP %d, %d bytes\n", httpCode, total);
+        http.end();
+        setPhase(OTA_FAILED, "download failed");
+        return false;
+    }
+
+    uint8_t *buf = static_cast<uint8_t *>(malloc(OTA_CHUNK_SIZE));
+    if (!buf)
+    {
+        http.end();
+        setPhase(OTA_FAILED, "out of memory");
+        return false;
+    }
+
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+
+    FirmwareWriter writer;
+    writer.begin(total);
+
+    WiFiClient *stream = http.getStreamPtr();
+    size_t written = 0;
+    uint8_t lastPercent = 0;
+    const char *error = nullptr;
+
+    setProgress(0, total);
+    setPhase(OTA_DOWNLOADING);
+
+    while (written < static_cast<size_t>(total))
+    {
+        size_t want = min(OTA_CHUNK_SIZE, total - written);
+        size_t len = readChunk(http, stream, buf, want);
+        if (len != want)
+        {
+            error = "connection lost";
+            break;
+        }
+
+        mbedtls_sha256_update(&sha, buf, len);
+        if (!writer.write(buf, len))
+        {
+            error = writer.error();
+            break;
+        }
+
+        written += len;
+        setProgress(written, total);
+
+        uint8_t percent = 100ULL * written / total;
+        if (percent != lastPercent)
+        {
+            lastPercent = percent;
+            reportStatus();
+        }
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    free(buf);
+    http.end();
+
+    if (error)
+    {
+        writer.abort();
+        setPhase(OTA_FAILED, error);
+        return false;
+    }
+
+    setPhase(OTA_VERIFYING);
+    if (memcmp(digest, expected, sizeof(digest)) != 0)
+    {
+        writer.abort();
+        setPhase(OTA_FAILED, "SHA-256 mismatch");
+        return false;
+    }
+
+    if (!writer.end())
+    {
+        setPhase(OTA_FAILED, writer.error());
+        return false;
+    }
+
+    LOGF("[OTA] Update successful: %u bytes downloaded, %u bytes written\n", written, writer.written());
+    return true;
+}
+
+static void otaTask(void *pvParameters)
+{
+    (void)pvParameters;
+
+    String firmwareUrl;
+    String version;
+    uint8_t digest[32];
+
+    // Nothing may be pending in the settings cache when the new image boots
+    settingsFlush();
+
+    if (fetchRelease(firmwareUrl, digest, version) && flashFirmware(firmwareUrl, digest))
+    {
+        setPhase(OTA_DONE);
+        vTaskDelay(pdMS_TO_TICKS(2000));
+        ESP.restart();
+    }
+
+    setState(IDLE);
+    otaBusy = false;
+    vTaskDelete(NULL);
+}
+
+bool otaStartUpdate()
+{
+    if (state != IDLE)
+    {
+        return false;
+    }
+
+    bool expected = false;
+    if (!otaBusy.compare_exchange_strong(expected, true))
+    {
+        return false;
+    }
+
+    // Lock out the motor before anything is downloaded
+    setState(UPDATING);
+
+    portENTER_CRITICAL(&statusMux);
+    status = {OTA_CHECKING, 0, 0, "", ""};
+    portEXIT_CRITICAL(&statusMux);
+    reportStatus();
+
+    if (xTaskCreatePinnedToCore(otaTask, "OtaTask", 8192, NULL, 1, NULL, 0) != pdPASS)
+    {
+        setPhase(OTA_FAILED, "task creation failed");
+        setState(IDLE);
+        otaBusy = false;
+        return false;
+    }
+    return true;
+}
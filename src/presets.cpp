@@ -0,0 +1,523 @@
+#include <Preferences.h>
+
+#include <cmath>
+#include <cstddef>
+
+#include "dosestats.h"
+#include "presets.h"
+#include "pulsefinish.h"
+
+// -----------------------------------------------------------------------------
+// Preset table
+//
+// Every preset carries its own motor profile: full throttle until the slowdown
+// window, then down to the slow throttle, and a stop point moved ahead of the
+// target by the learned compensation for the grounds still falling. The left
+// and right buttons each select one favourite entry of the table.
+// -----------------------------------------------------------------------------
+
+static constexpr uint8_t PRESETS_VERSION = 2;
+
+struct StoredPresets
+{
+    uint8_t version;
+    uint8_t count;
+    uint8_t favourites[2]; // indexed by PresetSelection
+    Preset entries[PRESET_MAX_COUNT];
+};
+
+// Version 1 entries end where the profile slot starts
+static constexpr size_t PRESET_V1_SIZE = offsetof(Preset, profile);
+struct StoredPresetsV1
+{
+    uint8_t version;
+    uint8_t count;
+    uint8_t favourites[2];
+    uint8_t entries[PRESET_MAX_COUNT][PRESET_V1_SIZE];
+};
+
+static StoredPresets table = {};
+static portMUX_TYPE presetsMux = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t revision = 0;
+static bool dirty = false;
+static uint8_t unsavedGrinds = 0;
+
+Preset presetDefaults()
+{
+    Preset preset = {};
+    strlcpy(preset.name, "Preset", sizeof(preset.name));
+    preset.target = 100;
+    preset.maxThrottle = PRESET_DEFAULT_MAX_THROTTLE;
+    preset.slowThrottle = PRESET_DEFAULT_SLOW_THROTTLE;
+    preset.slowdownCg = PRESET_DEFAULT_SLOWDOWN_CG;
+    preset.curve = PRESET_CURVE_STEP;
+    preset.learn = true;
+    preset.compensationCg = 0;
+    preset.profile = PROFILE_NONE;
+    return preset;
+}
+
+static const char *validate(const Preset &preset)
+{
+    if (preset.name[0] == '\0')
+    {
+        return "name missing";
+    }
+    if (preset.target < MIN_PRESET_WEIGHT || preset.target > MAX_PRESET_WEIGHT)
+    {
+        return "target out of range";
+    }
+    if (preset.maxThrottle < PRESET_MIN_THROTTLE || preset.maxThrottle > PRESET_MAX_THROTTLE)
+    {
+        return "maxThrottle out of range";
+    }
+    if (preset.slowThrottle < PRESET_MIN_THROTTLE || preset.slowThrottle > preset.maxThrottle)
+    {
+        return "slowThrottle must be between the minimum and maxThrottle";
+    }
+    if (preset.slowdownCg > PRESET_MAX_SLOWDOWN_CG)
+    {
+        return "slowdown out of range";
+    }
+    if (preset.curve > PRESET_CURVE_LINEAR)
+    {
+        return "unknown curve";
+    }
+    if (preset.compensationCg < 0 || preset.compensationCg > PRESET_MAX_COMPENSATION_CG)
+    {
+        return "compensation out of range";
+    }
+    if (preset.profile != PROFILE_NONE && preset.profile >= PROFILE_MAX_COUNT)
+    {
+        return "profile out of range";
+    }
+    return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+// Persistence
+// -----------------------------------------------------------------------------
+
+static void persist()
+{
+    StoredPresets copy;
+    portENTER_CRITICAL(&presetsMux);
+    copy = table;
+    dirty = false;
+    portEXIT_CRITICAL(&presetsMux);
+
+    Preferences store;
+    store.begin("presets", false);
+    store.putBytes("table", &copy, sizeof(copy));
+    store.end();
+}
+
+void setupPresets(uint16_t legacyLeft, uint16_t legacyRight)
+{
+    StoredPresets stored = {};
+
+    Preferences store;
+    store.begin("presets", true);
+    bool loaded = false;
+    if (store.getBytesLength("table") == sizeof(StoredPresetsV1))
+    {
+        StoredPresetsV1 old = {};
+        store.getBytes("table", &old, sizeof(old));
+        loaded = old.version == 1;
+        stored.version = PRESETS_VERSION;
+        stored.count = old.count;
+        memcpy(stored.favourites, old.favourites, sizeof(stored.favourites));
+        for (uint8_t i = 0; i < PRESET_MAX_COUNT; i++)
+        {
+            memcpy(&stored.entries[i], old.entries[i], PRESET_V1_SIZE);
+            stored.entries[i].profile = PROFILE_NONE;
+        }
+    }
+    else
+    {
+        loaded = store.getBytes("table", &stored, sizeof(stored)) == sizeof(stored) && stored.version == PRESETS_VERSION;
+    }
+    loaded = loaded && stored.count > 0 && stored.count <= PRESET_MAX_COUNT;
+    store.end();
+
+    for (uint8_t i = 0; loaded && i < stored.count; i++)
+    {
+        stored.entries[i].name[PRESET_NAME_SIZE - 1] = '\0';
+        loaded = validate(stored.entries[i]) == nullptr;
+    }
+
+    if (!loaded)
+    {
+        // The two fixed presets of older firmware, on their buttons
+        memset(&stored, 0, sizeof(stored));
+        stored.version = PRESETS_VERSION;
+        stored.count = 2;
+        stored.entries[0] = presetDefaults();
+        stored.entries[0].target = constrain(legacyLeft, MIN_PRESET_WEIGHT, MAX_PRESET_WEIGHT);
+        strlcpy(stored.entries[0].name, "Small", PRESET_NAME_SIZE);
+        stored.entries[1] = presetDefaults();
+        stored.entries[1].target = constrain(legacyRight, MIN_PRESET_WEIGHT, MAX_PRESET_WEIGHT);
+        strlcpy(stored.entries[1].name, "Large", PRESET_NAME_SIZE);
+        stored.favourites[SMALL] = 0;
+        stored.favourites[LARGE] = 1;
+    }
+
+    for (uint8_t &favourite : stored.favourites)
+    {
+        favourite = min<uint8_t>(favourite, stored.count - 1);
+    }
+
+    portENTER_CRITICAL(&presetsMux);
+    table = stored;
+    revision++;
+    portEXIT_CRITICAL(&presetsMux);
+
+    if (!loaded)
+    {
+        persist();
+    }
+
+    LOGF("[PRESETS] %u presets, favourites %u / %u\n", stored.count, stored.favourites[SMALL], stored.favourites[LARGE]);
+}
+
+void presetsCommit()
+{
+    portENTER_CRITICAL(&presetsMux);
+    bool changed = dirty;
+    portEXIT_CRITICAL(&presetsMux);
+
+    if (changed)
+    {
+        unsavedGrinds = 0;
+        persist();
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Table access
+// -----------------------------------------------------------------------------
+
+uint8_t presetCount()
+{
+    portENTER_CRITICAL(&presetsMux);
+    uint8_t count = table.count;
+    portEXIT_CRITICAL(&presetsMux);
+    return count;
+}
+
+bool presetGet(uint8_t index, Preset *preset)
+{
+    portENTER_CRITICAL(&presetsMux);
+    bool found = index < table.count;
+    if (found)
+    {
+        *preset = table.entries[index];
+    }
+    portEXIT_CRITICAL(&presetsMux);
+    return found;
+}
+
+const char *presetsReplace(const Preset *presets, uint8_t count, uint8_t *previous)
+{
+    if (count == 0 || count > PRESET_MAX_COUNT)
+    {
+        return "preset count out of range";
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+        const char *error = validate(presets[i]);
+        if (error != nullptr)
+        {
+            return error;
+        }
+    }
+
+    // Old index of every new entry; a name given twice is matched in order
+    bool taken[PRESET_MAX_COUNT] = {};
+
+    portENTER_CRITICAL(&presetsMux);
+    for (uint8_t i = 0; i < PRESET_MAX_COUNT; i++)
+    {
+        previous[i] = PRESET_NEW;
+    }
+    for (uint8_t i = 0; i < count; i++)
+    {
+        for (uint8_t j = 0; j < table.count; j++)
+        {
+            if (!taken[j] && strncmp(table.entries[j].name, presets[i].name, PRESET_NAME_SIZE) == 0)
+            {
+                previous[i] = j;
+                taken[j] = true;
+                break;
+            }
+        }
+    }
+
+    table.count = count;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        table.entries[i] = presets[i];
+        table.entries[i].name[PRESET_NAME_SIZE - 1] = '\0';
+    }
+    // A favourite whose entry was removed falls back to the same index
+    for (uint8_t &favourite : table.favourites)
+    {
+        uint8_t moved = min<uint8_t>(favourite, count - 1);
+        for (uint8_t i = 0; i < count; i++)
+        {
+            if (previous[i] == favourite)
+            {
+                moved = i;
+                break;
+            }
+        }
+        favourite = moved;
+    }
+    dirty = true;
+    revision++;
+    portEXIT_CRITICAL(&presetsMux);
+
+    doseStatsRemap(previous, count);
+    pulseFinishRemap(previous, count);
+    return nullptr;
+}
+
+void presetSetTarget(uint8_t index, uint16_t target)
+{
+    target = constrain(target, MIN_PRESET_WEIGHT, MAX_PRESET_WEIGHT);
+
+    portENTER_CRITICAL(&presetsMux);
+    if (index < table.count && table.entries[index].target != target)
+    {
+        table.entries[index].target = target;
+        dirty = true;
+        revision++;
+    }
+    portEXIT_CRITICAL(&presetsMux);
+}
+
+uint8_t presetFavourite(PresetSelection button)
+{
+    portENTER_CRITICAL(&presetsMux);
+    uint8_t index = table.favourites[button == SMALL ? SMALL : LARGE];
+    portEXIT_CRITICAL(&presetsMux);
+    return index;
+}
+
+void presetSetFavourite(PresetSelection button, uint8_t index)
+{
+    portENTER_CRITICAL(&presetsMux);
+    uint8_t &favourite = table.favourites[button == SMALL ? SMALL : LARGE];
+    if (index < table.count && favourite != index)
+    {
+        favourite = index;
+        dirty = true;
+        revision++;
+    }
+    portEXIT_CRITICAL(&presetsMux);
+}
+
+uint32_t presetsRevision()
+{
+    portENTER_CRITICAL(&presetsMux);
+    uint32_t current = revision;
+    portEXIT_CRITICAL(&presetsMux);
+    return current;
+}
+
+// -----------------------------------------------------------------------------
+// Motor profile
+// -----------------------------------------------------------------------------
+
+uint16_t presetThrottle(const Preset &preset, float gramsRemaining)
+{
+    float window = preset.slowdownCg / 100.0f;
+    if (gramsRemaining > window)
+    {
+        return preset.maxThrottle;
+    }
+    if (preset.curve == PRESET_CURVE_STEP || gramsRemaining <= 0.0f)
+    {
+        return preset.slowThrottle;
+    }
+
+    float share = gramsRemaining / window;
+    return preset.slowThrottle + static_cast<uint16_t>(lroundf((preset.maxThrottle - preset.slowThrottle) * share));
+}
+
+// Called once per grind from the main loop; up to PRESET_PERSIST_GRINDS - 1
+// adjustments are lost on power loss
+void presetLearn(uint8_t index, int32_t errorCg)
+{
+    bool learned = false;
+    int16_t compensation = 0;
+
+    portENTER_CRITICAL(&presetsMux);
+    if (index < table.count && table.entries[index].learn)
+    {
+        Preset &preset = table.entries[index];
+        long next = preset.compensationCg + lroundf(errorCg * PRESET_LEARN_RATE);
+        compensation = static_cast<int16_t>(constrain(next, 0L, static_cast<long>(PRESET_MAX_COMPENSATION_CG)));
+        learned = compensation != preset.compensationCg;
+        preset.compensationCg = compensation;
+        if (learned)
+        {
+            dirty = true;
+            revision++;
+        }
+    }
+    portEXIT_CRITICAL(&presetsMux);
+
+    if (!learned)
+    {
+        return;
+    }
+
+    LOGD("[PRESETS] %u: error %ld cg, compensation %d cg\n", index, static_cast<long>(errorCg), compensation);
+    if (++unsavedGrinds >= PRESET_PERSIST_GRINDS)
+    {
+        presetsCommit();
+    }
+}
+
+// -----------------------------------------------------------------------------
+// JSON
+// -----------------------------------------------------------------------------
+
+void presetToJson(const Preset &preset, JsonObject out)
+{
+    out["name"] = preset.name;
+    out["target"] = preset.target / 10.0f;
+    out["maxThrottle"] = preset.maxThrottle;
+    out["slowThrottle"] = preset.slowThrottle;
+    out["slowdown"] = preset.slowdownCg / 100.0f;
+    out["curve"] = presetCurveToString(preset.curve);
+    out["learn"] = preset.learn;
+    out["compensation"] = preset.compensationCg / 100.0f;
+    if (preset.profile != PROFILE_NONE)
+    {
+        out["profile"] = preset.profile;
+    }
+    else
+    {
+        out["profile"] = nullptr;
+    }
+}
+
+// Tells an explicit null from a field left out
+static bool hasKey(JsonVariantConst value, const char *key)
+{
+    for (JsonPairConst pair : value.as<JsonObjectConst>())
+    {
+        if (strcmp(pair.key().c_str(), key) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *presetFromJson(JsonVariantConst value, Preset *preset)
+{
+    if (!value.is<JsonObjectConst>())
+    {
+        return "preset must be an object";
+    }
+
+    Preset next = *preset;
+    if (!value["name"].isNull())
+    {
+        if (!value["name"].is<const char *>())
+        {
+            return "name must be a string";
+        }
+        strlcpy(next.name, value["name"].as<const char *>(), sizeof(next.name));
+    }
+    if (!value["target"].isNull())
+    {
+        long steps = lroundf((value["target"] | 0.0f) * 10.0f);
+        if (!value["target"].is<float>() || steps < MIN_PRESET_WEIGHT || steps > MAX_PRESET_WEIGHT)
+        {
+            return "target out of range";
+        }
+        next.target = static_cast<uint16_t>(steps);
+    }
+    if (!value["maxThrottle"].isNull())
+    {
+        next.maxThrottle = static_cast<uint16_t>(constrain(value["maxThrottle"] | 0L, 0L, 65535L));
+    }
+    if (!value["slowThrottle"].isNull())
+    {
+        next.slowThrottle = static_cast<uint16_t>(constrain(value["slowThrottle"] | 0L, 0L, 65535L));
+    }
+    if (!value["slowdown"].isNull())
+    {
+        long cg = lroundf((value["slowdown"] | -1.0f) * 100.0f);
+        if (cg < 0 || cg > PRESET_MAX_SLOWDOWN_CG)
+        {
+            return "slowdown out of range";
+        }
+        next.slowdownCg = static_cast<uint16_t>(cg);
+    }
+    if (!value["curve"].isNull() && !presetCurveFromString(value["curve"] | "", &next.curve))
+    {
+        return "curve must be step or linear";
+    }
+    if (!value["learn"].isNull())
+    {
+        next.learn = value["learn"] | next.learn;
+    }
+    if (!value["compensation"].isNull())
+    {
+        long cg = lroundf((value["compensation"] | -1.0f) * 100.0f);
+        if (cg < 0 || cg > PRESET_MAX_COMPENSATION_CG)
+        {
+            return "compensation out of range";
+        }
+        next.compensationCg = static_cast<int16_t>(cg);
+    }
+
+    // null goes back to the preset's own throttle settings
+    if (value["profile"].is<int>())
+    {
+        next.profile = static_cast<uint8_t>(constrain(value["profile"].as<int>(), 0, static_cast<int>(PROFILE_NONE)));
+    }
+    else if (!value["profile"].isNull())
+    {
+        return "profile must be a slot or null";
+    }
+    else if (hasKey(value, "profile"))
+    {
+        next.profile = PROFILE_NONE;
+    }
+
+    const char *error = validate(next);
+    if (error == nullptr)
+    {
+        *preset = next;
+    }
+    return error;
+}
+
+const char *presetCurveToString(PresetCurve curve)
+{
+    switch (curve)
+    {
+    case PRESET_CURVE_STEP: return "step";
+    case PRESET_CURVE_LINEAR: return "linear";
+    }
+    return "unknown";
+}
+
+bool presetCurveFromString(const char *text, PresetCurve *curve)
+{
+    for (uint8_t i = PRESET_CURVE_STEP; i <= PRESET_CURVE_LINEAR; i++)
+    {
+        if (strcmp(text, presetCurveToString(static_cast<PresetCurve>(i))) == 0)
+        {
+            *curve = static_cast<PresetCurve>(i);
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,396 @@
+#include <Preferences.h>
+
+#include <cmath>
+
+#include "presets.h"
+#include "profile.h"
+
+// -----------------------------------------------------------------------------
+// Grind profiles
+//
+// A profile maps grams remaining or time elapsed to a throttle or a target
+// flow through up to PROFILE_MAX_POINTS breakpoints, linear in between and
+// held beyond the ends. Any segment can instead pulse the motor on and off.
+// Profiles are compiled into a fixed-size lookup table when stored, so the
+// control loop never walks the breakpoints.
+// -----------------------------------------------------------------------------
+
+static constexpr uint8_t PROFILES_VERSION = 1;
+
+struct StoredProfiles
+{
+    uint8_t version;
+    GrindProfile slots[PROFILE_MAX_COUNT];
+};
+
+static GrindProfile profiles[PROFILE_MAX_COUNT] = {};
+static CompiledProfile compiled[PROFILE_MAX_COUNT] = {};
+static portMUX_TYPE profilesMux = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *validate(const GrindProfile &profile)
+{
+    if (profile.count == 0)
+    {
+        return nullptr;
+    }
+    if (profile.count > PROFILE_MAX_POINTS)
+    {
+        return "too many points";
+    }
+    if (profile.axis > PROFILE_AXIS_ELAPSED || profile.output > PROFILE_OUTPUT_FLOW)
+    {
+        return "unknown axis or output";
+    }
+
+    for (uint8_t i = 0; i < profile.count; i++)
+    {
+        const ProfilePoint &point = profile.points[i];
+        if (i > 0 && point.at <= profile.points[i - 1].at)
+        {
+            return "points must be in ascending order";
+        }
+        bool throttleOk = point.value >= PRESET_MIN_THROTTLE && point.value <= PRESET_MAX_THROTTLE;
+        bool flowOk = point.value > 0 && point.value <= PROFILE_MAX_FLOW_CGPS;
+        if (profile.output == PROFILE_OUTPUT_THROTTLE ? !throttleOk : !flowOk)
+        {
+            return "value out of range";
+        }
+        if ((point.pulseOn == 0) != (point.pulseOff == 0))
+        {
+            return "a pulse needs both on and off times";
+        }
+    }
+    return nullptr;
+}
+
+// Segment starting at the last point at or before at; the first before the range
+static uint8_t segment(const ProfilePoint *points, uint8_t count, uint8_t from, uint32_t at)
+{
+    uint8_t i = from;
+    while (i + 1 < count && points[i + 1].at <= at)
+    {
+        i++;
+    }
+    return i;
+}
+
+// Linear within segment i, held beyond the ends
+static uint16_t interpolate(const ProfilePoint *points, uint8_t count, uint8_t i, uint32_t at)
+{
+    if (at <= points[0].at)
+    {
+        return points[0].value;
+    }
+    if (i + 1 >= count)
+    {
+        return points[count - 1].value;
+    }
+
+    int32_t span = points[i + 1].at - points[i].at;
+    int32_t rise = points[i + 1].value - points[i].value;
+    return points[i].value + (rise * static_cast<int32_t>(at - points[i].at) + span / 2) / span;
+}
+
+static CompiledProfile compile(const GrindProfile &profile)
+{
+    CompiledProfile c = {};
+    c.axis = profile.axis;
+    c.output = profile.output;
+    c.count = profile.count;
+    memcpy(c.points, profile.points, sizeof(c.points));
+
+    uint32_t range = profile.points[profile.count - 1].at;
+    c.cellWidth = static_cast<uint16_t>(max<uint32_t>(1, (range + PROFILE_LUT_CELLS - 1) / PROFILE_LUT_CELLS));
+
+    uint8_t i = 0;
+    for (uint8_t cell = 0; cell < PROFILE_LUT_CELLS; cell++)
+    {
+        i = segment(c.points, c.count, i, static_cast<uint32_t>(cell) * c.cellWidth);
+        c.segments[cell] = i;
+    }
+    return c;
+}
+
+// -----------------------------------------------------------------------------
+// Persistence
+// -----------------------------------------------------------------------------
+
+static void persist()
+{
+    StoredProfiles stored;
+    stored.version = PROFILES_VERSION;
+    portENTER_CRITICAL(&profilesMux);
+    memcpy(stored.slots, profiles, sizeof(profiles));
+    portEXIT_CRITICAL(&profilesMux);
+
+    Preferences store;
+    store.begin("profiles", false);
+    store.putBytes("table", &stored, sizeof(stored));
+    store.end();
+}
+
+void setupProfiles()
+{
+    StoredProfiles stored = {};
+
+    Preferences store;
+    store.begin("profiles", true);
+    bool loaded = store.getBytes("table", &stored, sizeof(stored)) == sizeof(stored) && stored.version == PROFILES_VERSION;
+    store.end();
+
+    uint8_t used = 0;
+    for (uint8_t i = 0; i < PROFILE_MAX_COUNT; i++)
+    {
+        GrindProfile &profile = stored.slots[i];
+        profile.name[PROFILE_NAME_SIZE - 1] = '\0';
+        if (!loaded || validate(profile) != nullptr)
+        {
+            memset(&profile, 0, sizeof(profile));
+        }
+
+        portENTER_CRITICAL(&profilesMux);
+        profiles[i] = profile;
+        if (profile.count > 0)
+        {
+            compiled[i] = compile(profile);
+        }
+        portEXIT_CRITICAL(&profilesMux);
+        used += profile.count > 0;
+    }
+
+    LOGF("[PROFILES] %u of %u slots used\n", used, PROFILE_MAX_COUNT);
+}
+
+// -----------------------------------------------------------------------------
+// Slots
+// -----------------------------------------------------------------------------
+
+bool profileGet(uint8_t slot, GrindProfile *profile)
+{
+    if (slot >= PROFILE_MAX_COUNT)
+    {
+        return false;
+    }
+
+    portENTER_CRITICAL(&profilesMux);
+    *profile = profiles[slot];
+    portEXIT_CRITICAL(&profilesMux);
+    return profile->count > 0;
+}
+
+bool profileCompiled(uint8_t slot, CompiledProfile *out)
+{
+    if (slot >= PROFILE_MAX_COUNT)
+    {
+        return false;
+    }
+
+    portENTER_CRITICAL(&profilesMux);
+    bool used = profiles[slot].count > 0;
+    if (used)
+    {
+        *out = compiled[slot];
+    }
+    portEXIT_CRITICAL(&profilesMux);
+    return used;
+}
+
+const char *profilePut(uint8_t slot, const GrindProfile &profile)
+{
+    if (slot >= PROFILE_MAX_COUNT)
+    {
+        return "slot out of range";
+    }
+    const char *error = validate(profile);
+    if (error != nullptr)
+    {
+        return error;
+    }
+
+    GrindProfile next = profile;
+    next.name[PROFILE_NAME_SIZE - 1] = '\0';
+    CompiledProfile lookup = next.count > 0 ? compile(next) : CompiledProfile{};
+
+    portENTER_CRITICAL(&profilesMux);
+    profiles[slot] = next;
+    compiled[slot] = lookup;
+    portEXIT_CRITICAL(&profilesMux);
+
+    persist();
+    LOGF("[PROFILES] Slot %u: %s, %u points\n", slot, next.count > 0 ? next.name : "cleared", next.count);
+    return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+// Evaluation
+// -----------------------------------------------------------------------------
+
+void profileStart(ProfileRun &run, uint16_t startThrottle, uint32_t nowMs)
+{
+    run.throttle = startThrottle;
+    run.lastMs = nowMs;
+    run.pulseSinceMs = nowMs;
+    run.pulsing = false;
+}
+
+ProfileCommand profileEvaluate(const CompiledProfile &profile, float remainingG, float flowGps, uint32_t nowMs,
+                               uint32_t elapsedMs, uint16_t minThrottle, uint16_t maxThrottle, ProfileRun &run)
+{
+    uint32_t at = profile.axis == PROFILE_AXIS_REMAINING ? static_cast<uint32_t>(max(0L, lroundf(remainingG * 100.0f))) : elapsedMs / 10;
+
+    // Constant time: the cell gives the segment at its start, and only the
+    // breakpoints inside that cell are left to step over
+    uint32_t cell = min<uint32_t>(at / profile.cellWidth, PROFILE_LUT_CELLS - 1);
+    uint8_t i = segment(profile.points, profile.count, profile.segments[cell], at);
+    uint16_t value = interpolate(profile.points, profile.count, i, at);
+    uint8_t pulseOn = profile.points[i].pulseOn;
+    uint8_t pulseOff = profile.points[i].pulseOff;
+
+    float dt = (nowMs - run.lastMs) / 1000.0f;
+    run.lastMs = nowMs;
+
+    ProfileCommand command = {};
+    bool pulsing = pulseOn > 0;
+    if (pulsing && !run.pulsing)
+    {
+        run.pulseSinceMs = nowMs;
+    }
+    run.pulsing = pulsing;
+
+    float throttle = value;
+    if (profile.output == PROFILE_OUTPUT_FLOW)
+    {
+        // Integrating controller; it holds still while the motor pulses
+        if (!pulsing)
+        {
+            run.throttle += PROFILE_FLOW_GAIN * (value / 100.0f - flowGps) * dt;
+        }
+        run.throttle = constrain(run.throttle, static_cast<float>(minThrottle), static_cast<float>(maxThrottle));
+        throttle = run.throttle;
+    }
+    command.throttle = static_cast<uint16_t>(constrain(lroundf(throttle), static_cast<long>(minThrottle), static_cast<long>(maxThrottle)));
+
+    if (pulsing)
+    {
+        command.pulse = true;
+        uint32_t period = (pulseOn + pulseOff) * 10u;
+        if ((nowMs - run.pulseSinceMs) % period >= pulseOn * 10u)
+        {
+            command.throttle = 0;
+        }
+    }
+    return command;
+}
+
+// -----------------------------------------------------------------------------
+// JSON
+// -----------------------------------------------------------------------------
+
+const char *profileFromJson(JsonVariantConst value, GrindProfile *profile)
+{
+    GrindProfile next = {};
+    if (value.isNull())
+    {
+        *profile = next;
+        return nullptr;
+    }
+    if (!value.is<JsonObjectConst>())
+    {
+        return "profile must be an object";
+    }
+
+    strlcpy(next.name, value["name"] | "Profile", sizeof(next.name));
+
+    const char *axis = value["axis"] | "remaining";
+    if (strcmp(axis, "remaining") == 0 || strcmp(axis, "elapsed") == 0)
+    {
+        next.axis = strcmp(axis, "remaining") == 0 ? PROFILE_AXIS_REMAINING : PROFILE_AXIS_ELAPSED;
+    }
+    else
+    {
+        return "axis must be remaining or elapsed";
+    }
+
+    const char *output = value["output"] | "throttle";
+    if (strcmp(output, "throttle") == 0 || strcmp(output, "flow") == 0)
+    {
+        next.output = strcmp(output, "throttle") == 0 ? PROFILE_OUTPUT_THROTTLE : PROFILE_OUTPUT_FLOW;
+    }
+    else
+    {
+        return "output must be throttle or flow";
+    }
+
+    JsonArrayConst points = value["points"];
+    if (points.isNull() || points.size() == 0 || points.size() > PROFILE_MAX_POINTS)
+    {
+        return "points needs 1 to 8 entries";
+    }
+
+    for (JsonVariantConst entry : points)
+    {
+        JsonArrayConst fields = entry.as<JsonArrayConst>();
+        if (fields.isNull() || (fields.size() != 2 && fields.size() != 4) || !fields[0].is<float>() || !fields[1].is<float>())
+        {
+            return "a point is [at, value] or [at, value, onMs, offMs]";
+        }
+
+        // g and s alike are stored in hundredths
+        long at = lroundf(fields[0].as<float>() * 100.0f);
+        long scaled = next.output == PROFILE_OUTPUT_FLOW ? lroundf(fields[1].as<float>() * 100.0f) : lroundf(fields[1].as<float>());
+        if (at < 0 || at > UINT16_MAX || scaled < 0 || scaled > UINT16_MAX)
+        {
+            return "point out of range";
+        }
+
+        ProfilePoint &point = next.points[next.count++];
+        point.at = static_cast<uint16_t>(at);
+        point.value = static_cast<uint16_t>(scaled);
+        if (fields.size() == 4)
+        {
+            long on = fields[2] | -1L;
+            long off = fields[3] | -1L;
+            if (on < PROFILE_MIN_PULSE_MS || on > PROFILE_MAX_PULSE_MS || off < PROFILE_MIN_PULSE_MS || off > PROFILE_MAX_PULSE_MS)
+            {
+                return "pulse times out of range";
+            }
+            point.pulseOn = static_cast<uint8_t>((on + 5) / 10);
+            point.pulseOff = static_cast<uint8_t>((off + 5) / 10);
+        }
+    }
+
+    const char *error = validate(next);
+    if (error == nullptr)
+    {
+        *profile = next;
+    }
+    return error;
+}
+
+void profileToJson(const GrindProfile &profile, JsonObject out)
+{
+    out["name"] = profile.name;
+    out["axis"] = profile.axis == PROFILE_AXIS_REMAINING ? "remaining" : "elapsed";
+    out["output"] = profile.output == PROFILE_OUTPUT_THROTTLE ? "throttle" : "flow";
+
+    JsonArray points = out["points"].to<JsonArray>();
+    for (uint8_t i = 0; i < profile.count; i++)
+    {
+        const ProfilePoint &point = profile.points[i];
+        JsonArray fields = points.add<JsonArray>();
+        fields.add(point.at / 100.0f);
+        if (profile.output == PROFILE_OUTPUT_FLOW)
+        {
+            fields.add(point.value / 100.0f);
+        }
+        else
+        {
+            fields.add(point.value);
+        }
+        if (point.pulseOn > 0)
+        {
+            fields.add(point.pulseOn * 10);
+            fields.add(point.pulseOff * 10);
+        }
+    }
+}
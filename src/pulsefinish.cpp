@@ -0,0 +1,174 @@
+#include <Preferences.h>
+
+#include <cmath>
+
+#include "pulsefinish.h"
+
+// -----------------------------------------------------------------------------
+// Pulse finishing
+//
+// The last part of a dose is ground in short bursts at the slow throttle, each
+// followed by a settled reading. What a burst yields depends on the beans and
+// the grind setting, so it is learned per preset from the measured bursts and
+// decides whether one more burst gets closer to the target than stopping.
+// -----------------------------------------------------------------------------
+
+static constexpr uint8_t PULSE_STORE_VERSION = 1;
+
+struct StoredYields
+{
+    uint8_t version;
+    uint16_t pulseMs; // burst length the yields were learned with
+    float grams[PRESET_MAX_COUNT];
+};
+
+static PulseFinishConfig config = {false, PULSE_DEFAULT_BAND_G, PULSE_DEFAULT_MS};
+static StoredYields yields = {};
+static portMUX_TYPE pulseMux = portMUX_INITIALIZER_UNLOCKED;
+static bool dirty = false;
+static uint8_t unsavedPulses = 0;
+
+static void resetYields(StoredYields &stored, uint16_t pulseMs)
+{
+    stored.version = PULSE_STORE_VERSION;
+    stored.pulseMs = pulseMs;
+    for (float &grams : stored.grams)
+    {
+        grams = PULSE_DEFAULT_GRAMS;
+    }
+}
+
+void setupPulseFinish()
+{
+    StoredYields stored = {};
+
+    Preferences store;
+    store.begin("pulse", true);
+    bool loaded = store.getBytes("yields", &stored, sizeof(stored)) == sizeof(stored) &&
+                  stored.version == PULSE_STORE_VERSION;
+    store.end();
+
+    for (uint8_t i = 0; loaded && i < PRESET_MAX_COUNT; i++)
+    {
+        loaded = stored.grams[i] >= PULSE_MIN_GRAMS && stored.grams[i] <= PULSE_MAX_GRAMS;
+    }
+
+    if (!loaded)
+    {
+        resetYields(stored, PULSE_DEFAULT_MS);
+    }
+
+    portENTER_CRITICAL(&pulseMux);
+    yields = stored;
+    portEXIT_CRITICAL(&pulseMux);
+}
+
+void pulseFinishConfigure(const PulseFinishConfig &next)
+{
+    portENTER_CRITICAL(&pulseMux);
+    config = next;
+    if (yields.pulseMs != next.pulseMs)
+    {
+        resetYields(yields, next.pulseMs);
+        dirty = true;
+    }
+    portEXIT_CRITICAL(&pulseMux);
+}
+
+PulseFinishConfig pulseFinishConfig()
+{
+    portENTER_CRITICAL(&pulseMux);
+    PulseFinishConfig current = config;
+    portEXIT_CRITICAL(&pulseMux);
+    return current;
+}
+
+float pulseFinishGrams(uint8_t preset)
+{
+    if (preset >= PRESET_MAX_COUNT)
+    {
+        return PULSE_DEFAULT_GRAMS;
+    }
+
+    portENTER_CRITICAL(&pulseMux);
+    float grams = yields.grams[preset];
+    portEXIT_CRITICAL(&pulseMux);
+    return grams;
+}
+
+bool pulseFinishNeeded(uint8_t preset, float gramsRemaining)
+{
+    // Stopping leaves gramsRemaining short, a burst lands about |remaining - yield| off
+    return gramsRemaining > pulseFinishGrams(preset) / 2.0f;
+}
+
+void pulseFinishLearn(uint8_t preset, float yieldG)
+{
+    if (preset >= PRESET_MAX_COUNT)
+    {
+        return;
+    }
+
+    portENTER_CRITICAL(&pulseMux);
+    float &grams = yields.grams[preset];
+    float learned = constrain(grams + (yieldG - grams) * PULSE_LEARN_RATE, PULSE_MIN_GRAMS, PULSE_MAX_GRAMS);
+    bool changed = learned != grams;
+    grams = learned;
+    dirty |= changed;
+    portEXIT_CRITICAL(&pulseMux);
+
+    if (!changed)
+    {
+        return;
+    }
+
+    LOGD("[PULSE] %u: burst %.3f g, learned %.3f g\n", preset, yieldG, learned);
+    if (++unsavedPulses >= PULSE_PERSIST_PULSES)
+    {
+        pulseFinishCommit();
+    }
+}
+
+void pulseFinishRemap(const uint8_t *previous, uint8_t count)
+{
+    float moved[PRESET_MAX_COUNT];
+
+    portENTER_CRITICAL(&pulseMux);
+    for (uint8_t i = 0; i < PRESET_MAX_COUNT; i++)
+    {
+        uint8_t from = i < count ? previous[i] : PRESET_NEW;
+        moved[i] = from < PRESET_MAX_COUNT ? yields.grams[from] : PULSE_DEFAULT_GRAMS;
+    }
+    bool changed = memcmp(moved, yields.grams, sizeof(moved)) != 0;
+    if (changed)
+    {
+        memcpy(yields.grams, moved, sizeof(moved));
+        dirty = true;
+    }
+    portEXIT_CRITICAL(&pulseMux);
+
+    if (changed)
+    {
+        pulseFinishCommit();
+    }
+}
+
+void pulseFinishCommit()
+{
+    portENTER_CRITICAL(&pulseMux);
+    bool changed = dirty;
+    StoredYields copy = yields;
+    dirty = false;
+    portEXIT_CRITICAL(&pulseMux);
+
+    if (!changed)
+    {
+        return;
+    }
+
+    unsavedPulses = 0;
+    Preferences store;
+    store.begin("pulse", false);
+    store.putBytes("yields", &copy, sizeof(copy));
+    store.end();
+}
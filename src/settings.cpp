@@ -0,0 +1,326 @@
+#include <Preferences.h>
+
+#include "settings.h"
+#include "types.h"
+
+// -----------------------------------------------------------------------------
+// Write-behind settings cache
+//
+// Values of the "coffee" namespace live in RAM. Puts only compare and mark the
+// key dirty; SettingsTask writes the dirty keys in one NVS session once the
+// changes have settled, so button presses and grinds never wait for flash.
+// -----------------------------------------------------------------------------
+
+enum SettingType : uint8_t
+{
+    SETTING_UCHAR,
+    SETTING_USHORT,
+    SETTING_UINT,
+    SETTING_LONG,
+    SETTING_FLOAT
+};
+
+struct SettingEntry
+{
+    char key[16]; // NVS keys are at most 15 characters
+    SettingType type;
+    bool dirty;
+    uint32_t bits; // value, reinterpreted according to type
+};
+
+static const char *SETTINGS_NAMESPACE = "coffee";
+
+// Every key the firmware keeps in the namespace. A key missing here still
+// works, but once the cache is full it is read and written without it.
+static constexpr const char *KNOWN_KEYS[] = {
+    // Presets, scale and counters
+    "sel", "pL", "pR", "scale", "tareOffset", "totalWeight", "presetSmallRuns", "presetLargeRuns",
+    // Grinding, telemetry and logging
+    "blockThreshold", "settleMax", "wsRate", "logLevel",
+    // Zero tracking, cup detection and pulse finishing
+    "azOn", "azBand", "azRate", "cupOn", "cupMin", "cupArm", "pulseOn", "pulseBand", "pulseMs",
+};
+
+static constexpr bool keysFitNvs()
+{
+    for (const char *key : KNOWN_KEYS)
+    {
+        size_t length = 0;
+        while (key[length] != '\0')
+        {
+            length++;
+        }
+        if (length > 15)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(sizeof(KNOWN_KEYS) / sizeof(KNOWN_KEYS[0]) <= SETTINGS_MAX_KEYS, "raise SETTINGS_MAX_KEYS for the new keys");
+static_assert(keysFitNvs(), "NVS keys are at most 15 characters");
+
+static SettingEntry entries[SETTINGS_MAX_KEYS];
+static uint8_t entryCount = 0;
+static portMUX_TYPE entriesMux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t flushMutex = nullptr;
+static TaskHandle_t settingsTaskHandle = nullptr;
+
+// Caller holds entriesMux
+static SettingEntry *findEntry(const char *key)
+{
+    for (uint8_t i = 0; i < entryCount; i++)
+    {
+        if (strcmp(entries[i].key, key) == 0)
+        {
+            return &entries[i];
+        }
+    }
+    return nullptr;
+}
+
+static bool cachedBits(const char *key, uint32_t &bits)
+{
+    portENTER_CRITICAL(&entriesMux);
+    SettingEntry *entry = findEntry(key);
+    if (entry)
+    {
+        bits = entry->bits;
+    }
+    portEXIT_CRITICAL(&entriesMux);
+    return entry != nullptr;
+}
+
+template <typename T>
+static uint32_t toBits(T value)
+{
+    static_assert(sizeof(T) <= sizeof(uint32_t), "setting too large");
+    uint32_t bits = 0;
+    memcpy(&bits, &value, sizeof(T));
+    return bits;
+}
+
+template <typename T>
+static T fromBits(uint32_t bits)
+{
+    T value;
+    memcpy(&value, &bits, sizeof(T));
+    return value;
+}
+
+// False if the key is not cached and there is no room for it
+static bool storeBits(const char *key, SettingType type, uint32_t bits, bool dirty)
+{
+    portENTER_CRITICAL(&entriesMux);
+    SettingEntry *entry = findEntry(key);
+    if (entry == nullptr && entryCount < SETTINGS_MAX_KEYS)
+    {
+        entry = &entries[entryCount++];
+        strlcpy(entry->key, key, sizeof(entry->key));
+        entry->type = type;
+        entry->dirty = dirty;
+        entry->bits = bits;
+    }
+    else if (entry && entry->bits != bits)
+    {
+        entry->bits = bits;
+        entry->dirty = entry->dirty || dirty;
+    }
+    portEXIT_CRITICAL(&entriesMux);
+
+    return entry != nullptr;
+}
+
+// Caller has the namespace open for writing
+static void writeEntry(Preferences &prefs, const SettingEntry &entry)
+{
+    switch (entry.type)
+    {
+    case SETTING_UCHAR:
+        prefs.putUChar(entry.key, fromBits<uint8_t>(entry.bits));
+        break;
+    case SETTING_USHORT:
+        prefs.putUShort(entry.key, fromBits<uint16_t>(entry.bits));
+        break;
+    case SETTING_UINT:
+        prefs.putUInt(entry.key, fromBits<uint32_t>(entry.bits));
+        break;
+    case SETTING_LONG:
+        prefs.putLong(entry.key, fromBits<int32_t>(entry.bits));
+        break;
+    case SETTING_FLOAT:
+        prefs.putFloat(entry.key, fromBits<float>(entry.bits));
+        break;
+    }
+}
+
+// Keys that found no room in the cache are written through at once
+static void putSetting(const char *key, SettingType type, uint32_t bits)
+{
+    if (storeBits(key, type, bits, true))
+    {
+        return;
+    }
+
+    LOGW("[SETTINGS] Cache full, writing %s directly\n", key);
+    SettingEntry entry = {};
+    strlcpy(entry.key, key, sizeof(entry.key));
+    entry.type = type;
+    entry.bits = bits;
+
+    if (flushMutex)
+    {
+        xSemaphoreTake(flushMutex, portMAX_DELAY);
+    }
+    Preferences prefs;
+    prefs.begin(SETTINGS_NAMESPACE, false);
+    writeEntry(prefs, entry);
+    prefs.end();
+    if (flushMutex)
+    {
+        xSemaphoreGive(flushMutex);
+    }
+}
+
+// Return the cached value, reading it from NVS on first use
+template <typename T, typename Read>
+static T getSetting(const char *key, SettingType type, Read read)
+{
+    uint32_t bits;
+    if (cachedBits(key, bits))
+    {
+        return fromBits<T>(bits);
+    }
+
+    Preferences prefs;
+    prefs.begin(SETTINGS_NAMESPACE, true);
+    T value = read(prefs);
+    prefs.end();
+
+    storeBits(key, type, toBits(value), false);
+    return value;
+}
+
+uint8_t settingsGetUChar(const char *key, uint8_t defaultValue)
+{
+    return getSetting<uint8_t>(key, SETTING_UCHAR, [&](Preferences &p) { return p.getUChar(key, defaultValue); });
+}
+
+uint16_t settingsGetUShort(const char *key, uint16_t defaultValue)
+{
+    return getSetting<uint16_t>(key, SETTING_USHORT, [&](Preferences &p) { return p.getUShort(key, defaultValue); });
+}
+
+uint32_t settingsGetUInt(const char *key, uint32_t defaultValue)
+{
+    return getSetting<uint32_t>(key, SETTING_UINT, [&](Preferences &p) { return p.getUInt(key, defaultValue); });
+}
+
+int32_t settingsGetLong(const char *key, int32_t defaultValue)
+{
+    return getSetting<int32_t>(key, SETTING_LONG, [&](Preferences &p) { return p.getLong(key, defaultValue); });
+}
+
+float settingsGetFloat(const char *key, float defaultValue)
+{
+    return getSetting<float>(key, SETTING_FLOAT, [&](Preferences &p) { return p.getFloat(key, defaultValue); });
+}
+
+void settingsPutUChar(const char *key, uint8_t value)
+{
+    putSetting(key, SETTING_UCHAR, toBits(value));
+}
+
+void settingsPutUShort(const char *key, uint16_t value)
+{
+    putSetting(key, SETTING_USHORT, toBits(value));
+}
+
+void settingsPutUInt(const char *key, uint32_t value)
+{
+    putSetting(key, SETTING_UINT, toBits(value));
+}
+
+void settingsPutLong(const char *key, int32_t value)
+{
+    putSetting(key, SETTING_LONG, toBits(value));
+}
+
+void settingsPutFloat(const char *key, float value)
+{
+    putSetting(key, SETTING_FLOAT, toBits(value));
+}
+
+void settingsCommit()
+{
+    if (settingsTaskHandle)
+    {
+        xTaskNotifyGive(settingsTaskHandle);
+    }
+}
+
+void settingsFlush()
+{
+    if (flushMutex)
+    {
+        xSemaphoreTake(flushMutex, portMAX_DELAY);
+    }
+
+    // Take the dirty entries; values changed while writing stay dirty
+    SettingEntry pending[SETTINGS_MAX_KEYS];
+    uint8_t count = 0;
+    portENTER_CRITICAL(&entriesMux);
+    for (uint8_t i = 0; i < entryCount; i++)
+    {
+        if (entries[i].dirty)
+        {
+            pending[count++] = entries[i];
+            entries[i].dirty = false;
+        }
+    }
+    portEXIT_CRITICAL(&entriesMux);
+
+    if (count > 0)
+    {
+        unsigned long start = millis();
+        Preferences prefs;
+        prefs.begin(SETTINGS_NAMESPACE, false);
+        for (uint8_t i = 0; i < count; i++)
+        {
+            writeEntry(prefs, pending[i]);
+        }
+        prefs.end();
+        LOGD("[SETTINGS] Wrote %u keys in %lu ms\n", count, millis() - start);
+    }
+
+    if (flushMutex)
+    {
+        xSemaphoreGive(flushMutex);
+    }
+}
+
+static void settingsTask(void *pvParameters)
+{
+    (void)pvParameters;
+
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Coalesce bursts such as holding a preset button
+        TickType_t first = xTaskGetTickCount();
+        while (ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(SETTINGS_QUIET_MS)) > 0 &&
+               xTaskGetTickCount() - first < pdMS_TO_TICKS(SETTINGS_MAX_DELAY_MS))
+        {
+        }
+
+        settingsFlush();
+    }
+}
+
+void setupSettings()
+{
+    flushMutex = xSemaphoreCreateMutex();
+    xTaskCreatePinnedToCore(settingsTask, "SettingsTask", 3072, NULL, tskIDLE_PRIORITY + 1, &settingsTaskHandle, 0);
+}
@@ -0,0 +1,104 @@
+#include <cmath>
+
+#include "settle.h"
+#include "trace.h"
+
+// -----------------------------------------------------------------------------
+// Settle detection
+//
+// Statistics are computed on raw counts, so a tare does not disturb the
+// window; they are converted to grams with the scale factor of each sample.
+// -----------------------------------------------------------------------------
+
+struct SettleSample
+{
+    int32_t raw;
+    uint32_t timeMs;
+};
+
+static SettleSample window[SETTLE_WINDOW];
+static uint8_t windowHead = 0;
+static SettleState current = {};
+static portMUX_TYPE settleMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Called from scaleTask only
+void settlePush(int32_t raw, uint32_t timeMs, float countsPerGram)
+{
+    window[windowHead] = {raw, timeMs};
+    windowHead = (windowHead + 1) % SETTLE_WINDOW;
+
+    SettleState next = current;
+    next.sample++;
+
+    if (next.sample >= SETTLE_WINDOW && countsPerGram != 0.0f)
+    {
+        // Least squares over the window, times relative to the oldest sample
+        uint32_t t0 = window[windowHead].timeMs;
+        double sumRaw = 0.0;
+        double sumTime = 0.0;
+        for (const auto &s : window)
+        {
+            sumRaw += s.raw;
+            sumTime += (s.timeMs - t0) / 1000.0;
+        }
+        double meanRaw = sumRaw / SETTLE_WINDOW;
+        double meanTime = sumTime / SETTLE_WINDOW;
+
+        double varRaw = 0.0;
+        double varTime = 0.0;
+        double covariance = 0.0;
+        for (const auto &s : window)
+        {
+            double dr = s.raw - meanRaw;
+            double dt = (s.timeMs - t0) / 1000.0 - meanTime;
+            varRaw += dr * dr;
+            varTime += dt * dt;
+            covariance += dr * dt;
+        }
+
+        float scale = fabsf(countsPerGram);
+        next.meanRaw = meanRaw;
+        next.stddev = sqrt(varRaw / (SETTLE_WINDOW - 1)) / scale;
+        next.slope = varTime > 0.0 ? covariance / varTime / countsPerGram : 0.0f;
+
+        bool settled = next.stddev <= SETTLE_MAX_STDDEV_G && fabsf(next.slope) <= SETTLE_MAX_SLOPE_GPS;
+        if (settled && !current.settled)
+        {
+            traceWrite(TRACE_SETTLED, TRACE_INSTANT, lroundf(next.stddev * 1000.0f), lroundf(next.slope * 1000.0f));
+        }
+        next.settled = settled;
+    }
+
+    portENTER_CRITICAL(&settleMux);
+    current = next;
+    portEXIT_CRITICAL(&settleMux);
+}
+
+SettleState settleState()
+{
+    portENTER_CRITICAL(&settleMux);
+    SettleState state = current;
+    portEXIT_CRITICAL(&settleMux);
+    return state;
+}
+
+bool settleWait(uint32_t timeoutMs, SettleState *state)
+{
+    unsigned long start = millis();
+    uint32_t firstSample = settleState().sample;
+
+    while (true)
+    {
+        SettleState now = settleState();
+        bool settled = now.settled && now.sample - firstSample >= SETTLE_MIN_FRESH;
+        if (settled || millis() - start >= timeoutMs)
+        {
+            if (state)
+            {
+                *state = now;
+            }
+            return settled;
+        }
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+}
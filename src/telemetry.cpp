@@ -0,0 +1,170 @@
+#include <Arduino.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "telemetry.h"
+#include "types.h"
+
+// -----------------------------------------------------------------------------
+// Live telemetry over WebSocket
+//
+// One frame is serialised per tick into a single buffer shared by all clients.
+// Clients whose send queue is still busy skip the frame, so a slow browser only
+// loses updates and never holds up the server or the other clients.
+// -----------------------------------------------------------------------------
+
+constexpr uint8_t TELEMETRY_FORMAT_VERSION = 1;
+// Resend an unchanged frame at least this often so clients see we are alive
+constexpr unsigned long TELEMETRY_KEEPALIVE_MS = 1000;
+
+extern volatile State state;
+extern float weight;
+extern float flowRate;
+extern uint8_t telemetryRateHz;
+
+extern uint16_t motorThrottle();
+extern void savePreferences();
+
+static AsyncWebSocket telemetrySocket("/ws");
+
+// Client ids are tracked here since the client list type differs between
+// AsyncWebServer releases; lookups go through AsyncWebSocket::client().
+static std::vector<uint32_t> clientIds;
+static SemaphoreHandle_t clientsMutex = xSemaphoreCreateMutex();
+
+static void onSocketEvent(AsyncWebSocket *socket, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
+{
+    (void)socket;
+    (void)arg;
+    (void)data;
+    (void)len;
+
+    xSemaphoreTake(clientsMutex, portMAX_DELAY);
+    if (type == WS_EVT_CONNECT)
+    {
+        clientIds.push_back(client->id());
+        LOGF("[WS] Client %u connected\n", client->id());
+    }
+    else if (type == WS_EVT_DISCONNECT)
+    {
+        clientIds.erase(std::remove(clientIds.begin(), clientIds.end(), client->id()), clientIds.end());
+        LOGF("[WS] Client %u disconnected\n", client->id());
+    }
+    xSemaphoreGive(clientsMutex);
+}
+
+// Serialise once into a shared buffer and queue it for every client that can
+// take it; the buffer is reference counted by the messages holding it
+static void broadcast(const uint8_t *data, size_t len, bool text = false)
+{
+    static uint32_t dropped = 0;
+
+    AsyncWebSocketMessageBuffer *buffer = telemetrySocket.makeBuffer(len);
+    if (!buffer)
+    {
+        return;
+    }
+    memcpy(buffer->get(), data, len);
+
+    // Locked while queueing so it is not freed before the last client holds it
+    buffer->lock();
+    xSemaphoreTake(clientsMutex, portMAX_DELAY);
+    for (uint32_t id : clientIds)
+    {
+        AsyncWebSocketClient *client = telemetrySocket.client(id);
+        if (!client)
+        {
+            continue;
+        }
+
+        if (client->canSend())
+        {
+            if (text)
+            {
+                client->text(buffer);
+            }
+            else
+            {
+                client->binary(buffer);
+            }
+        }
+        else
+        {
+            dropped++;
+        }
+    }
+    xSemaphoreGive(clientsMutex);
+    buffer->unlock();
+
+    if (dropped >= 100)
+    {
+        LOGF("[WS] Dropped %u frames for slow clients\n", dropped);
+        dropped = 0;
+    }
+}
+
+// Status messages (e.g. update progress) share the socket as JSON text frames
+void telemetryBroadcastText(const char *message)
+{
+    broadcast(reinterpret_cast<const uint8_t *>(message), strlen(message), true);
+}
+
+static void telemetryTask(void *pvParameters)
+{
+    (void)pvParameters;
+
+    TelemetryFrame last = {};
+    unsigned long lastSent = 0;
+    TickType_t wake = xTaskGetTickCount();
+
+    while (true)
+    {
+        uint8_t rate = constrain(telemetryRateHz, TELEMETRY_MIN_RATE_HZ, TELEMETRY_MAX_RATE_HZ);
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(1000 / rate));
+
+        telemetrySocket.cleanupClients();
+        if (telemetrySocket.count() == 0)
+        {
+            continue;
+        }
+
+        TelemetryFrame frame;
+        frame.version = TELEMETRY_FORMAT_VERSION;
+        frame.state = static_cast<uint8_t>(state);
+        frame.throttle = motorThrottle();
+        frame.timeMs = millis();
+        frame.weight = weight;
+        frame.flow = flowRate;
+
+        // Only push deltas; unchanged values are refreshed once per keepalive
+        bool changed = frame.state != last.state || frame.throttle != last.throttle ||
+                       fabsf(frame.weight - last.weight) >= 0.01f || fabsf(frame.flow - last.flow) >= 0.01f;
+        if (!changed && frame.timeMs - lastSent < TELEMETRY_KEEPALIVE_MS)
+        {
+            continue;
+        }
+
+        broadcast(reinterpret_cast<const uint8_t *>(&frame), sizeof(frame));
+        last = frame;
+        lastSent = frame.timeMs;
+    }
+}
+
+void setupTelemetry(AsyncWebServer &server)
+{
+    telemetrySocket.onEvent(onSocketEvent);
+    server.addHandler(&telemetrySocket);
+
+    server.on("/telemetry", HTTP_GET, [](AsyncWebServerRequest *request) {
+        if (request->hasParam("hz"))
+        {
+            long hz = request->getParam("hz")->value().toInt();
+            telemetryRateHz = constrain(hz, TELEMETRY_MIN_RATE_HZ, TELEMETRY_MAX_RATE_HZ);
+            savePreferences();
+        }
+        request->send(200, "text/plain", String(telemetryRateHz));
+    });
+
+    xTaskCreatePinnedToCore(telemetryTask, "TelemetryTask", 3072, NULL, 1, NULL, 0);
+}
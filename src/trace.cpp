@@ -0,0 +1,256 @@
+#include <esp_cpu.h>
+#include <esp_freertos_hooks.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+#include <atomic>
+#include <memory>
+
+#include "trace.h"
+#include "types.h"
+
+// -----------------------------------------------------------------------------
+// Event trace
+//
+// Each core appends to its own buffer, so recording is one atomic increment and
+// a 16 byte store. Timestamps are raw cycle counts; the cycle counters of the two
+// cores are not aligned and wrap every few seconds, so every core writes a
+// TRACE_SYNC record pairing its counter with esp_timer time before its first
+// record and at least every TRACE_SYNC_CYCLES (checked from the tick hook).
+// -----------------------------------------------------------------------------
+
+#if ENABLE_TRACING
+
+constexpr uint32_t TRACE_SYNC_CYCLES = 1UL << 30;
+constexpr uint8_t TRACE_CORES = 2;
+
+// Matches TraceEvent; used to select events in /trace/start
+static const char *const TRACE_EVENT_NAMES[TRACE_EVENT_COUNT] = {
+    "sync", "loop", "motor_ramp", "display", "mqtt_state", "scale_read", "target_reached", "settled",
+};
+
+// The loop span fills a buffer within milliseconds, so it is only captured on request
+constexpr uint32_t TRACE_DEFAULT_MASK = ((1UL << TRACE_EVENT_COUNT) - 1) & ~(1UL << TRACE_LOOP);
+
+struct TraceBuffer
+{
+    TraceRecord *records;
+    std::atomic<uint32_t> next;
+    std::atomic<uint32_t> dropped;
+    volatile uint32_t lastSync;
+    volatile bool synced;
+};
+
+static TraceBuffer buffers[TRACE_CORES];
+static std::atomic<uint32_t> activeMask{0}; // 0 = not capturing
+static bool hooksRegistered = false;
+
+static void IRAM_ATTR append(TraceBuffer &buffer, const TraceRecord &record)
+{
+    uint32_t index = buffer.next.fetch_add(1, std::memory_order_relaxed);
+    if (index >= TRACE_BUFFER_RECORDS)
+    {
+        buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    buffer.records[index] = record;
+}
+
+static void IRAM_ATTR syncIfDue(TraceBuffer &buffer, uint32_t cycles)
+{
+    if (buffer.synced && cycles - buffer.lastSync < TRACE_SYNC_CYCLES)
+    {
+        return;
+    }
+
+    uint64_t now = esp_timer_get_time();
+    buffer.lastSync = cycles;
+    buffer.synced = true;
+    append(buffer, {cycles, TRACE_SYNC, TRACE_INSTANT, 0, static_cast<uint32_t>(now), static_cast<uint32_t>(now >> 32)});
+}
+
+void IRAM_ATTR traceWrite(TraceEvent event, TraceKind kind, uint32_t arg0, uint32_t arg1)
+{
+    if ((activeMask.load(std::memory_order_relaxed) & (1UL << event)) == 0)
+    {
+        return;
+    }
+
+    uint32_t cycles = esp_cpu_get_cycle_count();
+    TraceBuffer &buffer = buffers[esp_cpu_get_core_id()];
+    syncIfDue(buffer, cycles);
+    append(buffer, {cycles, event, kind, 0, arg0, arg1});
+}
+
+// Keeps timestamps of a core decodable while it records nothing
+static void IRAM_ATTR traceTick()
+{
+    if (activeMask.load(std::memory_order_relaxed) == 0)
+    {
+        return;
+    }
+
+    syncIfDue(buffers[esp_cpu_get_core_id()], esp_cpu_get_cycle_count());
+}
+
+// Parse a comma separated list of event names; 0 if a name is unknown
+static uint32_t parseEventMask(const String &list)
+{
+    uint32_t mask = 0;
+    int start = 0;
+    while (start <= static_cast<int>(list.length()))
+    {
+        int end = list.indexOf(',', start);
+        if (end < 0)
+        {
+            end = list.length();
+        }
+
+        String name = list.substring(start, end);
+        name.trim();
+        bool found = false;
+        for (uint8_t i = 0; i < TRACE_EVENT_COUNT; i++)
+        {
+            if (name == TRACE_EVENT_NAMES[i])
+            {
+                mask |= 1UL << i;
+                found = true;
+            }
+        }
+        if (!found)
+        {
+            return 0;
+        }
+
+        start = end + 1;
+    }
+    return mask;
+}
+
+static bool traceStart(uint32_t mask)
+{
+    activeMask = 0;
+
+    for (uint8_t core = 0; core < TRACE_CORES; core++)
+    {
+        TraceBuffer &buffer = buffers[core];
+        if (buffer.records == nullptr)
+        {
+            // Only allocated once tracing is used
+            buffer.records = static_cast<TraceRecord *>(
+                heap_caps_malloc(TRACE_BUFFER_RECORDS * sizeof(TraceRecord), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+            if (buffer.records == nullptr)
+            {
+                LOGE("[TRACE] Not enough memory for trace buffers\n");
+                return false;
+            }
+        }
+        buffer.next = 0;
+        buffer.dropped = 0;
+        buffer.synced = false;
+    }
+
+    if (!hooksRegistered)
+    {
+        for (uint8_t core = 0; core < TRACE_CORES; core++)
+        {
+            esp_register_freertos_tick_hook_for_cpu(traceTick, core);
+        }
+        hooksRegistered = true;
+    }
+
+    activeMask = mask | (1UL << TRACE_SYNC);
+    LOGF("[TRACE] Capturing events 0x%02lx\n", static_cast<unsigned long>(mask));
+    return true;
+}
+
+static void fillHeader(TraceDumpHeader &header)
+{
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "CGTR", 4);
+    header.version = 1;
+    header.cores = TRACE_CORES;
+    header.recordSize = sizeof(TraceRecord);
+    header.cpuMhz = ESP.getCpuFreqMHz();
+    for (uint8_t core = 0; core < TRACE_CORES; core++)
+    {
+        header.counts[core] = buffers[core].records ? min(buffers[core].next.load(), TRACE_BUFFER_RECORDS) : 0;
+        header.dropped[core] = buffers[core].dropped;
+    }
+}
+
+// Copy the part of the dump starting at offset; the capture must be stopped
+static size_t readDump(const TraceDumpHeader &header, uint8_t *out, size_t maxLen, size_t offset)
+{
+    size_t copied = 0;
+    auto copy = [&](const void *data, size_t size) {
+        if (offset >= size)
+        {
+            offset -= size;
+            return;
+        }
+        size_t chunk = min(size - offset, maxLen - copied);
+        memcpy(out + copied, static_cast<const uint8_t *>(data) + offset, chunk);
+        copied += chunk;
+        offset = 0;
+    };
+
+    copy(&header, sizeof(header));
+    for (uint8_t core = 0; core < TRACE_CORES && copied < maxLen; core++)
+    {
+        if (header.counts[core] > 0)
+        {
+            copy(buffers[core].records, header.counts[core] * sizeof(TraceRecord));
+        }
+    }
+    return copied;
+}
+
+void setupTrace(AsyncWebServer &server)
+{
+    // /trace/start?events=scale_read,target_reached clears the buffers and starts a capture
+    server.on("/trace/start", HTTP_GET, [](AsyncWebServerRequest *request) {
+        uint32_t mask = TRACE_DEFAULT_MASK;
+        if (request->hasParam("events"))
+        {
+            mask = parseEventMask(request->getParam("events")->value());
+            if (mask == 0)
+            {
+                request->send(400, "text/plain", "Unknown trace event.");
+                return;
+            }
+        }
+
+        if (!traceStart(mask))
+        {
+            request->send(503, "text/plain", "Not enough memory.");
+            return;
+        }
+        request->send(200, "text/plain", "Tracing started.");
+    });
+
+    // Stops the capture and downloads it; convert with tools/trace2perfetto.py
+    server.on("/trace", HTTP_GET, [](AsyncWebServerRequest *request) {
+        activeMask = 0;
+
+        auto header = std::make_shared<TraceDumpHeader>();
+        fillHeader(*header);
+        size_t size = sizeof(TraceDumpHeader) + (header->counts[0] + header->counts[1]) * sizeof(TraceRecord);
+
+        AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", size,
+            [header](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+                return readDump(*header, buffer, maxLen, index);
+            });
+        response->addHeader("Content-Disposition", "attachment; filename=trace.bin");
+        request->send(response);
+    });
+}
+
+#else
+
+void setupTrace(AsyncWebServer &server)
+{
+    (void)server;
+}
+
+#endif
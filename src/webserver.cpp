@@ -3,42 +3,43 @@
 
 #include <ArduinoJson.h>
 #include <ESPAsyncWebServer.h>
-#include <HTTPClient.h>
 #include <Preferences.h>
-#include <Update.h>
 
+#include <algorithm>
+#include <vector>
+
+#include "api.h"
+#include "firmwarewriter.h"
 #include "mqtt.h"
+#include "ota.h"
 #include "pins.h"
+#include "presets.h"
+#include "remotecommand.h"
+#include "settings.h"
+#include "telemetry.h"
+#include "trace.h"
 #include "types.h"
 #include "version.h"
 #include "webserver.h"
+#include "webui_assets.h"
 
 // -----------------------------------------------------------------------------
 // External state & APIs provided by the rest of the application
 // -----------------------------------------------------------------------------
 
 extern volatile State state;
-extern PresetSelection selectedPreset;
-extern uint16_t presetSmall;
-extern uint16_t presetLarge;
 extern uint16_t remaining;
 extern float scaleFactor;
-extern bool webStart;
 
-extern void calibrateScale();
+extern String stateToString(State s);
+
 extern void savePreferences();
-extern void setPreset(PresetSelection selection);
 extern void setState(State s);
-extern void startGrinding(bool tare);
 
 // -----------------------------------------------------------------------------
 // Forward declarations
 // -----------------------------------------------------------------------------
 
-void WiFiStationConnected(WiFiEvent_t event, WiFiEventInfo_t info);
-void WiFiGotIP(WiFiEvent_t event, WiFiEventInfo_t info);
-void WiFiStationDisconnected(WiFiEvent_t event, WiFiEventInfo_t info);
-
 static void registerRootRoute();
 static void registerCalibrationRoute();
 static void registerSettingsRoutes();
@@ -61,226 +62,149 @@ AsyncWebServer server(80);
 
 static void registerRootRoute()
 {
-    server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
-        Preferences prefs;
-        prefs.begin("mqtt", true);
-        String mqttServer = prefs.getString("server", "");
-        uint16_t mqttPort = prefs.getInt("port", 1883);
-        String mqttUser = prefs.getString("user", "");
-        String mqttPass = prefs.getString("pass", "");
-        prefs.end();
+    // Pre-compressed assets from web/, served straight from flash
+    for (size_t i = 0; i < WEB_ASSET_COUNT; i++)
+    {
+        const WebAsset *asset = &WEB_ASSETS[i];
+        server.on(asset->path, HTTP_GET, [asset](AsyncWebServerRequest *request) {
+            if (request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value() == asset->etag)
+            {
+                request->send(304);
+                return;
+            }
 
-        String html = "<!DOCTYPE html><html><head><meta name='viewport' content='width=device-width, initial-scale=1'>"
-                      "<title>CoffeeGrinder</title><style>"
-                      "body { font-family: Arial, sans-serif; margin: 20px; background-color: #f4f4f4; }"
-                      "h1 { text-align: center; }"
-                      "form { max-width: 400px; margin: auto; background: #fff; padding: 20px; border-radius: 8px; box-shadow: 0 2px 4px rgba(0,0,0,0.2); }"
-                      "label { display: block; margin-top: 12px; }"
-                      "input[type='text'], input[type='number'], input[type='submit'] {"
-                      "width: 100%; padding: 10px; margin-top: 6px; box-sizing: border-box; border-radius: 4px;"
-                      "border: 1px solid #ccc; font-size: 1em; }"
-                      "input[type='submit'], button { background-color: #4CAF50; color: white; border: none; cursor: pointer; margin-top: 20px; }"
-                      "input[type='submit']:hover, button:hover { background-color: #45a049; }"
-                      ".segmented-control {"
-                      "  display: flex;"
-                      "  overflow: hidden;"
-                      "  border-radius: 4px;"
-                      "  border: 1px solid #ccc;"
-                      "  margin-top: 6px;"
-                      "}"
-                      ".segmented-control input[type='radio'] {"
-                      "  display: none;"
-                      "}"
-                      ".segmented-control label {"
-                      "  flex: 1;"
-                      "  text-align: center;"
-                      "  padding: 10px;"
-                      "  cursor: pointer;"
-                      "  background-color: #f4f4f4;"
-                      "  border-right: 1px solid #ccc;"
-                      "  margin: 0;"
-                      "}"
-                      ".segmented-control label:last-child {"
-                      "  border-right: none;"
-                      "}"
-                      ".segmented-control input[type='radio']:checked + label {"
-                      "  background-color: #4CAF50;"
-                      "  color: white;"
-                      "}"
-                      "</style></head><body><h1>CoffeeGrinder</h1>"
-                      "<form id='controlForm' style='max-width: 400px; margin: auto; background: #fff; padding: 20px; border-radius: 8px; box-shadow: 0 2px 4px rgba(0,0,0,0.2);'>"
-                      "<h3>Control</h3>"
-                      "<div style='display: flex; gap: 6px;'>"
-                      "<button type='button' style='flex:1; padding:10px; border-radius:4px; background-color:#4CAF50; color:white; border:none; cursor:pointer; font-size:1em;' onclick=\"sendAction('left')\">Left</button>"
-                      "<button type='button' style='flex:1; padding:10px; border-radius:4px; background-color:#4CAF50; color:white; border:none; cursor:pointer; font-size:1em;' onclick=\"sendAction('start')\">Start</button>"
-                      "<button type='button' style='flex:1; padding:10px; border-radius:4px; background-color:#4CAF50; color:white; border:none; cursor:pointer; font-size:1em;' onclick=\"sendAction('right')\">Right</button>"
-                      "</div>"
-                      "</form>"
-                      "<div style='height:20px;'></div>"
-                      "<form id='settingsForm'>"
-                      "<h3>Settings</h3>"
-                      "<label id='labelLeft' for='left'>Left Preset (Grams)</label>"
-                      "<input type='number' step='0.1' id='left' name='left' value='" + String(presetSmall / 10.0f, 1) + "'>"
-                      "<label id='labelRight' for='right'>Right Preset (Grams)</label>"
-                      "<input type='number' step='0.1' id='right' name='right' value='" + String(presetLarge / 10.0f, 1) + "'>"
-                      "<input type='submit' value='Save Settings'>"
-                      "</form>"
-                      "<div style='height:20px;'></div>"
-                      "<form id='mqttForm' style='max-width: 400px; margin: auto; background: #fff; padding: 20px; border-radius: 8px; box-shadow: 0 2px 4px rgba(0,0,0,0.2);'>"
-                      "<h3>MQTT Settings</h3>"
-                      "<label for='mqtt_server'>Server</label>"
-                      "<input type='text' id='mqtt_server' name='mqtt_server' value='" + mqttServer + "'>"
-                      "<label for='mqtt_port'>Port</label>"
-                      "<input type='number' id='mqtt_port' name='mqtt_port' value='" + String(mqttPort) + "'>"
-                      "<label for='mqtt_user'>Username</label>"
-                      "<input type='text' id='mqtt_user' name='mqtt_user' value='" + mqttUser + "'>"
-                      "<label for='mqtt_pass'>Password</label>"
-                      "<input type='password' id='mqtt_pass' name='mqtt_pass' style='width: 100%; padding: 10px; margin-top: 6px; box-sizing: border-box; border-radius: 4px; border: 1px solid #ccc; font-size: 1em;' value='" + mqttPass + "'>"
-                      "<input type='submit' value='Save MQTT Settings'>"
-                      "</form>"
-                      "<div style='height:20px;'></div>"
-                      "<form id='calibrationForm' style='max-width: 400px; margin: auto; background: #fff; padding: 20px; border-radius: 8px; box-shadow: 0 2px 4px rgba(0,0,0,0.2);'>"
-                      "<h3>Calibration</h3>"
-                      "<p>Current factor: <span style='float: right;'>" + String(scaleFactor, 2) + "</span></p>"
-                      "<input type='submit' value='Start Calibration'>"
-                      "</form>"
-                      "<div style='height:20px;'></div>"
-                      "<form id='restartForm' style='max-width: 400px; margin: auto; background: #fff; padding: 20px; border-radius: 8px; box-shadow: 0 2px 4px rgba(0,0,0,0.2);'>"
-                      "<h3>Restart</h3>"
-                      "<input type='submit' value='Restart ESP'>"
-                      "</form>"
-                      "<div id='toast' style='display:none; position:fixed; bottom:20px; left:50%; transform:translateX(-50%); background:#4CAF50; color:white; padding:10px 20px; border-radius:4px;'>Settings saved!</div>"
-                      "<script>"
-                      "function updateUnits() {"
-                      "  document.getElementById('labelLeft').innerText = 'Left Preset (Grams)';"
-                      "  document.getElementById('labelRight').innerText = 'Right Preset (Grams)';"
-                      "}"
-                      "document.getElementById('settingsForm').addEventListener('submit', function(e) {"
-                      "  e.preventDefault();"
-                      "  const left = document.getElementById('left').value;"
-                      "  const right = document.getElementById('right').value;"
-                      "  fetch(`/saveSettings?right=${right}&left=${left}`)"
-                      "    .then(() => showToast('Settings saved!'));"
-                      "});"
-                      "document.getElementById('calibrationForm').addEventListener('submit', function(e) {"
-                      "  e.preventDefault();"
-                      "  fetch('/calibrate')"
-                      "    .then(() => showToast('Calibration complete!'));"
-                      "});"
-                      "document.getElementById('restartForm').addEventListener('submit', function(e) {"
-                      "  e.preventDefault();"
-                      "  fetch('/restart')"
-                      "    .then(() => showToast('Calibration complete!'));"
-                      "});"
-                      "document.getElementById('mqttForm').addEventListener('submit', function(e) {"
-                      "  e.preventDefault();"
-                      "  const server = document.getElementById('mqtt_server').value;"
-                      "  const port = document.getElementById('mqtt_port').value;"
-                      "  const user = document.getElementById('mqtt_user').value;"
-                      "  const pass = document.getElementById('mqtt_pass').value;"
-                      "  fetch(`/mqtt?server=${server}&port=${port}&user=${user}&pass=${pass}`)"
-                      "    .then(() => showToast('MQTT settings saved!'));"
-                      "});"
-                      "function showToast(message) {"
-                      "  const toast = document.getElementById('toast');"
-                      "  toast.innerText = message;"
-                      "  toast.style.display = 'block';"
-                      "  setTimeout(() => { toast.style.display = 'none'; }, 2000);"
-                      "}"
-                      "function sendAction(cmd) {"
-                      "  fetch(`/action?cmd=${cmd}`)"
-                      "    .then(() => showToast(`Action '${cmd}' sent!`));"
-                      "}"
-                      "</script>"
-                      "<div style='text-align:center; color:#888; font-size:0.9em; margin-top:40px;'>Build: " CURRENT_VERSION "</div>"
-                      "</body></html>";
-        request->send(200, "text/html", html);
+            AsyncWebServerResponse *response = request->beginResponse_P(200, asset->contentType, asset->data, asset->length);
+            response->addHeader("Content-Encoding", "gzip");
+            response->addHeader("ETag", asset->etag);
+            response->addHeader("Cache-Control", "no-cache");
+            request->send(response);
+        });
+    }
+
+    // Values the static page used to have templated in
+    server.on("/config.json", HTTP_GET, [](AsyncWebServerRequest *request) {
+        String mqttServer;
+        uint16_t mqttPort;
+        String mqttUser;
+        mqttGetConfig(mqttServer, mqttPort, mqttUser);
+
+        JsonDocument doc;
+        doc["version"] = CURRENT_VERSION;
+        Preset preset;
+        doc["presets"]["left"] = presetGet(presetFavourite(SMALL), &preset) ? preset.target / 10.0f : 0.0f;
+        doc["presets"]["right"] = presetGet(presetFavourite(LARGE), &preset) ? preset.target / 10.0f : 0.0f;
+        doc["scaleFactor"] = scaleFactor;
+        doc["mqtt"]["server"] = mqttServer;
+        doc["mqtt"]["port"] = mqttPort ? mqttPort : 1883;
+        doc["mqtt"]["user"] = mqttUser;
+
+        AsyncResponseStream *response = request->beginResponseStream("application/json");
+        serializeJson(doc, *response);
+        request->send(response);
     });
 }
 
 static void registerCalibrationRoute()
 {
     server.on("/calibrate", HTTP_GET, [](AsyncWebServerRequest *request) {
-        calibrateScale();
-        request->send(200, "text/plain", "Calibration done!");
+        // Taring waits for the scale, so the main loop runs it
+        RemoteCommand command = {};
+        command.type = REMOTE_CALIBRATE;
+        if (!postRemoteCommand(command))
+        {
+            request->send(503, "text/plain", "Busy, try again");
+            return;
+        }
+        request->send(202, "text/plain", "Calibration started");
     });
 }
 
+// Favourite target in grams from a query parameter, in 0.1 g; 0 when the
+// parameter is absent, -1 when it is outside the preset range
+static long targetParam(AsyncWebServerRequest *request, const char *name)
+{
+    if (!request->hasParam(name))
+    {
+        return 0;
+    }
+
+    String raw = request->getParam(name)->value();
+    long target = lroundf(raw.toFloat() * 10.0f);
+    LOGF("[WEB] %s preset: %s -> %ld\n", name, raw.c_str(), target);
+    return target >= MIN_PRESET_WEIGHT && target <= MAX_PRESET_WEIGHT ? target : -1;
+}
+
+// Both targets are checked before either is stored
+static bool applyFavouriteTargets(AsyncWebServerRequest *request)
+{
+    long left = targetParam(request, "left");
+    long right = targetParam(request, "right");
+    if (left < 0 || right < 0)
+    {
+        request->send(422, "text/plain",
+                      "Preset must be between " + String(MIN_PRESET_WEIGHT / 10.0f, 1) + " and " +
+                          String(MAX_PRESET_WEIGHT / 10.0f, 1) + " g");
+        return false;
+    }
+
+    if (left > 0)
+    {
+        presetSetTarget(presetFavourite(SMALL), static_cast<uint16_t>(left));
+    }
+    if (right > 0)
+    {
+        presetSetTarget(presetFavourite(LARGE), static_cast<uint16_t>(right));
+    }
+    savePreferences();
+    return true;
+}
+
 static void registerSettingsRoutes()
 {
     server.on("/saveSettings", HTTP_GET, [](AsyncWebServerRequest *request) {
-        if (request->hasParam("left"))
+        if (applyFavouriteTargets(request))
         {
-            String rawLeft = request->getParam("left")->value();
-            LOGF("[WEB] Raw left preset: %s\n", rawLeft.c_str());
-            float val = rawLeft.toFloat();
-            LOGF("[WEB] Parsed left preset: %.2f\n", val);
-            if (val >= 0.1 && val <= 180.0)
-            {
-                presetSmall = static_cast<uint16_t>(val * 10.0f);
-                LOGF("[WEB] Stored presetSmall: %d\n", presetSmall);
-            }
+            request->send(200, "text/plain", "Settings saved. <a href='/'>Back</a>");
         }
-        if (request->hasParam("right"))
-        {
-            String rawRight = request->getParam("right")->value();
-            LOGF("[WEB] Raw right preset: %s\n", rawRight.c_str());
-            float val = rawRight.toFloat();
-            LOGF("[WEB] Parsed right preset: %.2f\n", val);
-            if (val >= 0.1 && val <= 180.0)
-            {
-                presetLarge = static_cast<uint16_t>(val * 10.0f);
-                LOGF("[WEB] Stored presetLarge: %d\n", presetLarge);
-            }
-        }
-        savePreferences();
-        request->send(200, "text/plain", "Settings saved. <a href='/'>Back</a>");
     });
 }
 
 static void registerPresetRoutes()
 {
     server.on("/setPreset", HTTP_GET, [](AsyncWebServerRequest *request) {
-        if (request->hasParam("left"))
-        {
-            presetSmall = request->getParam("left")->value().toFloat();
-        }
-        if (request->hasParam("right"))
+        if (applyFavouriteTargets(request))
         {
-            presetLarge = request->getParam("right")->value().toFloat();
+            request->send(200, "text/plain", "Presets updated");
         }
-        savePreferences();
-        request->send(200, "text/plain", "Presets updated");
     });
 }
 
 static void registerActionRoute()
 {
     server.on("/action", HTTP_GET, [](AsyncWebServerRequest *request) {
+        // Starting and selecting tare the scale, so the main loop runs them
+        RemoteCommand command = {};
+        bool queued = true;
         if (request->hasParam("cmd"))
         {
             String cmd = request->getParam("cmd")->value();
             if (cmd == "start")
             {
-                webStart = true;
-                if (state == IDLE)
-                {
-                    startGrinding(true);
-                }
-                else
-                {
-                    startGrinding(true);
-                }
-            }
-            else if (cmd == "left")
-            {
-                setPreset(SMALL);
+                command.type = REMOTE_START;
+                queued = postRemoteCommand(command);
             }
-            else if (cmd == "right")
+            else if (cmd == "left" || cmd == "right")
             {
-                setPreset(LARGE);
+                command.type = REMOTE_FAVOURITE;
+                command.button = cmd == "left" ? SMALL : LARGE;
+                queued = postRemoteCommand(command);
             }
         }
+        if (!queued)
+        {
+            request->send(503, "text/plain", "Busy, try again");
+            return;
+        }
         request->send(200, "text/plain", "Action executed");
     });
 }
@@ -302,7 +226,8 @@ static void registerMqttRoute()
         {
             prefs.putString("user", request->getParam("user")->value());
         }
-        if (request->hasParam("pass"))
+        // The UI never receives the stored password; an empty value keeps it
+        if (request->hasParam("pass") && request->getParam("pass")->value().length() > 0)
         {
             prefs.putString("pass", request->getParam("pass")->value());
         }
@@ -313,11 +238,58 @@ static void registerMqttRoute()
     });
 }
 
+// Log and push upload progress at most this often
+constexpr unsigned long UPLOAD_REPORT_INTERVAL_MS = 1000;
+
+static void reportUpload(const char *phase, const FirmwareWriteStats &stats, size_t total)
+{
+    uint32_t elapsed = max<uint32_t>(stats.elapsedMs, 1);
+    uint32_t rate = 1000ULL * stats.received / elapsed;
+    uint8_t progress = total ? min<size_t>(100, 100ULL * stats.received / total) : 0;
+
+    LOGF("[UPDATE] %s %u%%: %u bytes in %u ms, %u B/s, flash %u ms, %u stalls\n", phase, progress, stats.received, elapsed, rate,
+         stats.flashMs, stats.stalls);
+
+    char payload[160];
+    snprintf(payload, sizeof(payload),
+             "{\"update\":{\"phase\":\"%s\",\"progress\":%u,\"written\":%u,\"total\":%u,\"rate\":%u}}",
+             phase, progress, stats.received, total, rate);
+    telemetryBroadcastText(payload);
+}
+
+// Outcome of one /update request, kept in the request's _tempObject
+enum UploadResult : uint8_t
+{
+    UPLOAD_WRITING,
+    UPLOAD_REJECTED, // the motor may run, or the auto-update holds the flash
+    UPLOAD_REPLACED, // a newer upload took over the writer
+    UPLOAD_DONE,
+    UPLOAD_FAILED,
+};
+
+struct UploadState
+{
+    UploadResult result;
+};
+
+static UploadState *uploadState(AsyncWebServerRequest *request)
+{
+    return static_cast<UploadState *>(request->_tempObject);
+}
+
+// Accepts raw .bin and gzip-compressed .bin.gz images. Data is collected into
+// flash sectors and written by a separate task while the next one arrives.
+// An upload cut off before its final chunk releases the writer and the motor
+// lock when its connection closes; a new upload replaces one that stalled.
 static void registerUpdateRoutes()
 {
+    static BufferedFirmwareWriter uploadWriter;
+    // Request currently feeding uploadWriter
+    static AsyncWebServerRequest *activeUpload = nullptr;
+
     server.on("/update", HTTP_GET, [](AsyncWebServerRequest *request) {
         String html = "<form method='POST' action='/update' enctype='multipart/form-data'>"
-                      "<input type='file' name='update'>"
+                      "<input type='file' name='update' accept='.bin,.gz'>"
                       "<input type='submit' value='Update'>"
                       "</form>";
         request->send(200, "text/html", html);
@@ -325,136 +297,119 @@ static void registerUpdateRoutes()
 
     server.on("/update", HTTP_POST,
               [](AsyncWebServerRequest *request) {
-                  bool success = !Update.hasError();
-                  request->send(200, "text/plain", success ? "Update OK. Rebooting..." : "Update Failed!");
+                  UploadState *upload = uploadState(request);
+                  UploadResult result = upload ? upload->result : UPLOAD_FAILED;
+
+                  if (result == UPLOAD_REJECTED)
+                  {
+                      request->send(409, "text/plain", "Grinder busy, update refused.");
+                      return;
+                  }
+                  if (result == UPLOAD_REPLACED)
+                  {
+                      request->send(409, "text/plain", "Replaced by a newer upload.");
+                      return;
+                  }
+
+                  bool success = result == UPLOAD_DONE;
+                  request->send(200, "text/plain", success ? "Update OK. Rebooting..." : "Update Failed: " + String(uploadWriter.error()));
                   if (success)
                   {
+                      settingsFlush();
                       delay(3000);
                       ESP.restart();
                   }
               },
               [](AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
+                  static unsigned long lastReport = 0;
+
                   if (!index)
                   {
-                      setState(UPDATING);
-                      LOGF("Update Start: %s\n", filename.c_str());
-                      if (!Update.begin(UPDATE_SIZE_UNKNOWN))
+                      UploadState *upload = static_cast<UploadState *>(malloc(sizeof(UploadState)));
+                      if (!upload)
                       {
-                          Update.printError(Serial);
+                          return;
                       }
-                  }
-                  if (!Update.hasError())
-                  {
-                      if (Update.write(data, len) != len)
+                      request->_tempObject = upload; // freed with the request
+
+                      // Never flash while the motor may run, nor beside the auto-update
+                      bool otaRunning = state == UPDATING && activeUpload == nullptr;
+                      if (state == RUNNING || state == PULSING || state == MEASURING || otaRunning)
                       {
-                          Update.printError(Serial);
+                          upload->result = UPLOAD_REJECTED;
+                          LOGF("Update refused in state %s\n", stateToString(state).c_str());
+                          return;
                       }
+
+                      if (activeUpload != nullptr)
+                      {
+                          LOG("Update replaces a stalled upload");
+                          uploadState(activeUpload)->result = UPLOAD_REPLACED;
+                      }
+                      activeUpload = request;
+                      upload->result = UPLOAD_WRITING;
+
+                      request->onDisconnect([request]() {
+                          if (activeUpload != request)
+                          {
+                              return;
+                          }
+                          activeUpload = nullptr;
+                          uploadWriter.abort();
+                          reportUpload("failed", uploadWriter.stats(), request->contentLength());
+                          LOG("Update aborted, upload cut off");
+                          setState(IDLE);
+                      });
+
+                      setState(UPDATING);
+                      LOGF("Update Start: %s\n", filename.c_str());
+                      uploadWriter.begin();
+                      lastReport = millis();
+                  }
+
+                  UploadState *upload = uploadState(request);
+                  if (!upload || upload->result != UPLOAD_WRITING)
+                  {
+                      return;
                   }
+
+                  uploadWriter.write(data, len);
+
+                  if (millis() - lastReport >= UPLOAD_REPORT_INTERVAL_MS)
+                  {
+                      lastReport = millis();
+                      reportUpload("uploading", uploadWriter.stats(), request->contentLength());
+                  }
+
                   if (final)
                   {
-                      if (Update.end(true))
+                      activeUpload = nullptr;
+                      bool ok = uploadWriter.end();
+                      upload->result = ok ? UPLOAD_DONE : UPLOAD_FAILED;
+                      FirmwareWriteStats stats = uploadWriter.stats();
+                      reportUpload(ok ? "done" : "failed", stats, stats.received);
+                      if (ok)
                       {
-                          LOGF("Update Success: %u bytes\n", index + len);
+                          LOGF("Update Success: %u bytes written\n", stats.written);
                       }
                       else
                       {
-                          Update.printError(Serial);
+                          setState(IDLE);
                       }
                   }
               });
 }
 
+// The update itself runs in the OTA task; progress is pushed over /ws and MQTT
 static void registerAutoUpdateRoute()
 {
     server.on("/autoupdate", HTTP_GET, [](AsyncWebServerRequest *request) {
-        HTTPClient http;
-        http.begin("https://api.github.com/repos/danyial/CoffeeGrinder/releases/latest");
-        http.setFollowRedirects(HTTPC_STRICT_FOLLOW_REDIRECTS);
-        http.setUserAgent("ESP32");
-        http.setConnectTimeout(5000);
-
-        int httpCode = http.GET();
-        LOGF("HTTP Code: %d", httpCode);
-
-        if (httpCode < 0)
-        {
-            LOGF("ERROR: %s", http.errorToString(httpCode).c_str());
-        }
-
-        if (httpCode != 200)
-        {
-            request->send(500, "text/plain", "Failed to check for update.");
-            return;
-        }
-
-        JsonDocument doc;
-        DeserializationError error = deserializeJson(doc, http.getString());
-
-        if (error)
+        if (!otaStartUpdate())
         {
-            LOGF("Error: %s", error.c_str());
-            request->send(500, "text/plain", "Failed to parse release data.");
+            request->send(409, "text/plain", "Grinder busy, update not started.");
             return;
         }
-
-        String latest = doc["tag_name"] | "";
-        LOGF("Latest Version: %s", latest);
-
-        if (latest == CURRENT_VERSION)
-        {
-            request->send(200, "text/plain", "Already up to date.");
-            return;
-        }
-
-        String firmwareUrl;
-        for (JsonObject asset : doc["assets"].as<JsonArray>())
-        {
-            if (String(asset["name"].as<const char *>()).endsWith(".bin"))
-            {
-                firmwareUrl = asset["browser_download_url"].as<String>();
-                break;
-            }
-        }
-
-        LOGF("Firmware URL: %s", firmwareUrl);
-
-        if (firmwareUrl == "")
-        {
-            request->send(500, "text/plain", "Firmware .bin not found.");
-            return;
-        }
-
-        http.end();
-
-        http.begin(firmwareUrl);
-        int contentLength = http.GET();
-        (void)contentLength;
-        WiFiClient *stream = http.getStreamPtr();
-
-        if (!Update.begin(UPDATE_SIZE_UNKNOWN))
-        {
-            request->send(500, "text/plain", "Update.begin() failed.");
-            return;
-        }
-
-        size_t written = Update.writeStream(*stream);
-
-        if (!Update.end())
-        {
-            request->send(500, "text/plain", "Update failed: " + String(Update.errorString()));
-            return;
-        }
-
-        if (written > 0 && Update.isFinished())
-        {
-            request->send(200, "text/plain", "Update successful. Rebooting...");
-            delay(2000);
-            ESP.restart();
-        }
-        else
-        {
-            request->send(500, "text/plain", "Update failed or incomplete.");
-        }
+        request->send(202, "text/plain", "Update started.");
     });
 }
 
@@ -462,22 +417,16 @@ static void registerRestartRoute()
 {
     server.on("/restart", HTTP_GET, [](AsyncWebServerRequest *request) {
         request->send(200, "text/plain", "Restarting...");
+        settingsFlush();
         delay(1000);
         ESP.restart();
     });
 }
 
 // -----------------------------------------------------------------------------
-// Wi-Fi management
+// Server setup
 // -----------------------------------------------------------------------------
 
-void setupWiFiEvents()
-{
-    WiFi.onEvent(WiFiStationConnected, WiFiEvent_t::ARDUINO_EVENT_WIFI_STA_CONNECTED);
-    WiFi.onEvent(WiFiGotIP, WiFiEvent_t::ARDUINO_EVENT_WIFI_STA_GOT_IP);
-    WiFi.onEvent(WiFiStationDisconnected, WiFiEvent_t::ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
-}
-
 // Initialize and start the HTTP server with all routes
 void setupWebServer()
 {
@@ -490,20 +439,39 @@ void setupWebServer()
     registerUpdateRoutes();
     registerAutoUpdateRoute();
     registerRestartRoute();
+    setupTelemetry(server);
+    setupTrace(server);
+    registerApiRoutes(server);
 
     server.begin();
 }
 
-// Launch a captive portal access point for configuring Wi-Fi credentials
-void startConfigPortal()
-{
-    WiFi.mode(WIFI_AP);
-    WiFi.softAP("CoffeeGrinder");
+// -----------------------------------------------------------------------------
+// Captive config portal
+//
+// Networks are scanned in the background and cached, so page loads never wait
+// for a scan. Short per-channel dwell times keep the portal AP reachable while
+// the radio is away scanning.
+// -----------------------------------------------------------------------------
 
-    server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
-        int n = WiFi.scanNetworks();
+constexpr unsigned long PORTAL_SCAN_INTERVAL_MS = 30000;
+constexpr uint32_t PORTAL_SCAN_MS_PER_CHANNEL = 100;
+constexpr uint8_t PORTAL_MAX_NETWORKS = 20;
 
-        String html = R"rawliteral(
+struct ScannedNetwork
+{
+    String ssid;
+    int32_t rssi;
+    bool secure;
+};
+
+static std::vector<ScannedNetwork> scannedNetworks;
+static SemaphoreHandle_t scanMutex = nullptr;
+static unsigned long lastScanDone = 0;
+static volatile bool scanRunning = false;
+static volatile bool scanRequested = false;
+
+static const char PORTAL_HTML[] PROGMEM = R"rawliteral(
 <!DOCTYPE html>
 <html>
 <head>
@@ -532,28 +500,192 @@ void startConfigPortal()
 <body>
   <div class="container">
     <h1>Select WiFi</h1>
-    <form action="/save" method="post">
+    <form action="/save" method="post" id="form">
       <label for="ssid">Network</label>
-      <select name="ssid" id="ssid">
-)rawliteral";
-
-        for (int i = 0; i < n; ++i) {
-            html += "<option value=\"" + WiFi.SSID(i) + "\">" + WiFi.SSID(i) + "</option>";
-        }
-
-        html += R"rawliteral(
-      </select>
+      <select name="ssid" id="ssid"><option value="">Scanning...</option></select>
+      <input type="text" id="other" placeholder="Network name" style="display:none">
       <label for="p">Password</label>
       <input id="p" name="p" length=64 type="password" placeholder="Password">
+      <details>
+        <summary>Static IP (optional)</summary>
+        <label for="ip">Address</label>
+        <input id="ip" name="ip" type="text" placeholder="DHCP">
+        <label for="gateway">Gateway</label>
+        <input id="gateway" name="gateway" type="text">
+        <label for="subnet">Subnet mask</label>
+        <input id="subnet" name="subnet" type="text" placeholder="255.255.255.0">
+        <label for="dns">DNS</label>
+        <input id="dns" name="dns" type="text" placeholder="Gateway">
+      </details>
       <input type="submit" value="Save">
     </form>
   </div>
+  <script>
+    const ssid = document.getElementById('ssid');
+    const other = document.getElementById('other');
+
+    function toggleOther() {
+      other.style.display = ssid.value === '' ? 'block' : 'none';
+    }
+
+    // Set once the user chose an entry; refreshes then keep that choice
+    let picked = false;
+
+    function load() {
+      fetch('/networks.json').then((r) => r.json()).then((d) => {
+        const selected = ssid.value;
+        ssid.innerHTML = '';
+        d.networks.forEach((n) => {
+          ssid.add(new Option(`${n.ssid} (${n.rssi} dBm${n.secure ? '' : ', open'})`, n.ssid));
+        });
+        if (picked && selected && !d.networks.some((n) => n.ssid === selected)) {
+          ssid.add(new Option(`${selected} (not found)`, selected));
+        }
+        ssid.add(new Option('Other network...', ''));
+        if (picked) {
+          ssid.value = selected;
+        }
+        toggleOther();
+        if (d.networks.length === 0) {
+          setTimeout(load, 2000);
+        }
+      });
+    }
+
+    ssid.addEventListener('change', () => {
+      picked = true;
+      toggleOther();
+    });
+    document.getElementById('form').addEventListener('submit', () => {
+      if (ssid.value === '') {
+        ssid.name = '';
+        other.name = 'ssid';
+      }
+    });
+
+    load();
+    setInterval(load, 15000);
+  </script>
 </body>
 </html>
 )rawliteral";
-        request->send(200, "text/html", html);
+
+// Keep the strongest entry per SSID, strongest first
+static void storeScanResults(int16_t count)
+{
+    std::vector<ScannedNetwork> networks;
+    networks.reserve(count);
+
+    for (int16_t i = 0; i < count; i++)
+    {
+        String ssid = WiFi.SSID(i);
+        if (ssid.isEmpty())
+        {
+            continue;
+        }
+
+        int32_t rssi = WiFi.RSSI(i);
+        auto it = std::find_if(networks.begin(), networks.end(), [&ssid](const ScannedNetwork &n) { return n.ssid == ssid; });
+        if (it == networks.end())
+        {
+            networks.push_back({ssid, rssi, WiFi.encryptionType(i) != WIFI_AUTH_OPEN});
+        }
+        else if (rssi > it->rssi)
+        {
+            it->rssi = rssi;
+        }
+    }
+
+    std::sort(networks.begin(), networks.end(), [](const ScannedNetwork &a, const ScannedNetwork &b) { return a.rssi > b.rssi; });
+    if (networks.size() > PORTAL_MAX_NETWORKS)
+    {
+        networks.resize(PORTAL_MAX_NETWORKS);
+    }
+
+    xSemaphoreTake(scanMutex, portMAX_DELAY);
+    scannedNetworks.swap(networks);
+    lastScanDone = millis();
+    xSemaphoreGive(scanMutex);
+}
+
+static void portalScanTask(void *pvParameters)
+{
+    (void)pvParameters;
+
+    while (true)
+    {
+        scanRunning = true;
+        WiFi.scanNetworks(true, false, false, PORTAL_SCAN_MS_PER_CHANNEL);
+
+        int16_t count;
+        while ((count = WiFi.scanComplete()) == WIFI_SCAN_RUNNING)
+        {
+            vTaskDelay(pdMS_TO_TICKS(100));
+        }
+
+        if (count >= 0)
+        {
+            storeScanResults(count);
+            LOGF("[PORTAL] Found %d networks\n", count);
+        }
+        WiFi.scanDelete();
+        scanRunning = false;
+
+        unsigned long start = millis();
+        while (!scanRequested && millis() - start < PORTAL_SCAN_INTERVAL_MS)
+        {
+            vTaskDelay(pdMS_TO_TICKS(200));
+        }
+        scanRequested = false;
+    }
+}
+
+static void registerNetworksRoute()
+{
+    // ?refresh=1 starts a new scan; the response always comes from the cache
+    server.on("/networks.json", HTTP_GET, [](AsyncWebServerRequest *request) {
+        if (request->hasParam("refresh"))
+        {
+            scanRequested = true;
+        }
+
+        JsonDocument doc;
+        JsonArray networks = doc["networks"].to<JsonArray>();
+
+        xSemaphoreTake(scanMutex, portMAX_DELAY);
+        for (const ScannedNetwork &network : scannedNetworks)
+        {
+            JsonObject entry = networks.add<JsonObject>();
+            entry["ssid"] = network.ssid;
+            entry["rssi"] = network.rssi;
+            entry["secure"] = network.secure;
+        }
+        doc["age"] = lastScanDone ? millis() - lastScanDone : 0;
+        xSemaphoreGive(scanMutex);
+        doc["scanning"] = scanRunning;
+
+        AsyncResponseStream *response = request->beginResponseStream("application/json");
+        serializeJson(doc, *response);
+        request->send(response);
+    });
+}
+
+// Launch a captive portal access point for configuring Wi-Fi credentials
+void startConfigPortal()
+{
+    // Station mode stays enabled for scanning next to the AP
+    WiFi.mode(WIFI_AP_STA);
+    WiFi.softAP("CoffeeGrinder");
+
+    scanMutex = xSemaphoreCreateMutex();
+    xTaskCreatePinnedToCore(portalScanTask, "PortalScan", 4096, NULL, 1, NULL, 0);
+
+    server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
+        request->send(request->beginResponse_P(200, "text/html", reinterpret_cast<const uint8_t *>(PORTAL_HTML), strlen_P(PORTAL_HTML)));
     });
 
+    registerNetworksRoute();
+
     server.on("/save", HTTP_POST, [](AsyncWebServerRequest *request) {
         String ssid = request->arg("ssid");
         String pass = request->arg("p");
@@ -561,6 +693,13 @@ void startConfigPortal()
         prefs.begin("wifi", false);
         prefs.putString("ssid", ssid);
         prefs.putString("pass", pass);
+        // Empty fields fall back to DHCP; the cached AP belongs to the old network
+        for (const char *key : {"ip", "gateway", "subnet", "dns"})
+        {
+            prefs.putString(key, request->arg(key));
+        }
+        prefs.remove("bssid");
+        prefs.remove("channel");
         prefs.end();
         request->send(200, "text/plain", "WiFi settings saved. Restarting...");
         delay(1000);
@@ -569,56 +708,3 @@ void startConfigPortal()
 
     server.begin();
 }
-
-// Attempt to join the stored Wi-Fi network, or fall back to the config portal
-void startWifi()
-{
-    Preferences prefs;
-    prefs.begin("wifi", true);
-    String ssid = prefs.getString("ssid", "");
-    String pass = prefs.getString("pass", "");
-    prefs.end();
-
-    if (ssid.length() > 0) {
-        setupWiFiEvents();
-
-        LOGF("[WiFi] Connecting to SSID: %s\n", ssid.c_str());
-
-        WiFi.begin(ssid.c_str(), pass.c_str());
-        WiFi.setAutoReconnect(true);
-        WiFi.persistent(true);
-        
-        while (WiFi.status() != WL_CONNECTED) {
-            delay(500);
-            Serial.print(".");
-        }
-
-        LOG();
-    } else {
-        startConfigPortal();
-    }
-}
-
-// -----------------------------------------------------------------------------
-// Wi-Fi event handlers
-// -----------------------------------------------------------------------------
-
-void WiFiStationConnected(WiFiEvent_t event, WiFiEventInfo_t info)
-{
-    LOG("Connected to AP successfully!");
-}
-
-void WiFiGotIP(WiFiEvent_t event, WiFiEventInfo_t info)
-{
-    LOGF("[WiFi] Connected to %s\n", WiFi.SSID().c_str());
-    LOGF("[WiFi] IP Address: %s\n", WiFi.localIP().toString().c_str());
-}
-
-void WiFiStationDisconnected(WiFiEvent_t event, WiFiEventInfo_t info)
-{
-    LOG("Disconnected from WiFi access point");
-    LOGF("WiFi lost connection. Reason: %s", info.wifi_sta_disconnected.reason);
-    LOG("Trying to Reconnect");
-    
-    startWifi();
-}
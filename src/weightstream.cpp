@@ -0,0 +1,139 @@
+#include <atomic>
+
+#include "asyncmqtt.h"
+#include "types.h"
+#include "weightstream.h"
+
+// -----------------------------------------------------------------------------
+// Raw weight stream for offline analysis
+//
+// scaleTask pushes every sample into a single-producer/single-consumer ring;
+// mqttTask packs them into binary frames of STREAM_BATCH_SIZE samples and
+// publishes the frames zero-copy from two alternating buffers.
+// -----------------------------------------------------------------------------
+
+constexpr uint8_t STREAM_FORMAT_VERSION = 1;
+constexpr size_t STREAM_RING_SIZE = 128; // power of two
+
+extern AsyncMqtt mqttClient;
+extern String mqttIdentifier;
+extern volatile State state;
+
+static StreamSample ring[STREAM_RING_SIZE];
+static std::atomic<uint32_t> ringHead{0}; // written by scaleTask
+static std::atomic<uint32_t> ringTail{0}; // written by mqttTask
+static std::atomic<uint32_t> droppedSamples{0};
+
+static volatile bool streamEnabled = false;
+
+struct FrameBuffer
+{
+    uint8_t data[sizeof(StreamFrameHeader) + STREAM_BATCH_SIZE * sizeof(StreamSample)];
+    std::atomic<bool> busy{false};
+};
+
+static FrameBuffer frames[2];
+static uint8_t nextFrame = 0;
+static uint16_t frameSeq = 0;
+
+static bool isGrinding()
+{
+    return state == RUNNING || state == PULSING || state == MEASURING;
+}
+
+void setWeightStreamEnabled(bool enabled)
+{
+    streamEnabled = enabled;
+    LOGF("[STREAM] %s\n", enabled ? "enabled" : "disabled");
+}
+
+bool weightStreamEnabled()
+{
+    return streamEnabled;
+}
+
+// Called from scaleTask for every sample; drops when the consumer lags
+void streamPushSample(int32_t raw, float weight, uint16_t throttle)
+{
+    if (!streamEnabled || !isGrinding())
+    {
+        return;
+    }
+
+    uint32_t head = ringHead.load(std::memory_order_relaxed);
+    if (head - ringTail.load(std::memory_order_acquire) >= STREAM_RING_SIZE)
+    {
+        droppedSamples++;
+        return;
+    }
+
+    StreamSample &sample = ring[head % STREAM_RING_SIZE];
+    sample.timeMs = millis();
+    sample.raw = raw;
+    sample.weight = weight;
+    sample.throttle = throttle;
+
+    ringHead.store(head + 1, std::memory_order_release);
+}
+
+// Publish full batches, and the remainder once the grind is over
+void loopWeightStream()
+{
+    while (true)
+    {
+        uint32_t tail = ringTail.load(std::memory_order_relaxed);
+        uint32_t available = ringHead.load(std::memory_order_acquire) - tail;
+
+        if (available == 0 || (available < STREAM_BATCH_SIZE && isGrinding()))
+        {
+            return;
+        }
+
+        if (!mqttClient.connected())
+        {
+            // Nobody is listening; discard instead of publishing stale data later
+            ringTail.store(tail + available, std::memory_order_release);
+            return;
+        }
+
+        FrameBuffer &frame = frames[nextFrame];
+        if (frame.busy)
+        {
+            return;
+        }
+
+        uint8_t count = min<uint32_t>(available, STREAM_BATCH_SIZE);
+
+        StreamFrameHeader header;
+        header.version = STREAM_FORMAT_VERSION;
+        header.count = count;
+        header.seq = frameSeq;
+        memcpy(frame.data, &header, sizeof(header));
+
+        StreamSample *samples = reinterpret_cast<StreamSample *>(frame.data + sizeof(header));
+        for (uint8_t i = 0; i < count; i++)
+        {
+            samples[i] = ring[(tail + i) % STREAM_RING_SIZE];
+        }
+        ringTail.store(tail + count, std::memory_order_release);
+
+        frame.busy = true;
+        size_t length = sizeof(header) + count * sizeof(StreamSample);
+        bool queued = mqttClient.publishRef(("coffeegrinder/" + mqttIdentifier + "/stream").c_str(), frame.data, length, false, 0,
+                                            [&frame](bool) { frame.busy = false; });
+        if (!queued)
+        {
+            frame.busy = false;
+            droppedSamples += count;
+        }
+
+        frameSeq++;
+        nextFrame ^= 1;
+
+        uint32_t dropped = droppedSamples.exchange(0);
+        if (dropped)
+        {
+            LOGF("[STREAM] Dropped %u samples\n", dropped);
+        }
+    }
+}
@@ -0,0 +1,277 @@
+#include <Arduino.h>
+#include <Preferences.h>
+#include <WiFi.h>
+
+#include <atomic>
+#include <ctime>
+
+#include "boot.h"
+#include "types.h"
+#include "webserver.h"
+#include "wifimanager.h"
+
+// -----------------------------------------------------------------------------
+// Wi-Fi connection manager
+//
+// The event handlers only record what happened; wifiTask decides when to
+// (re)connect, so neither setup() nor the system event task ever waits for
+// the network. The BSSID and channel of the last good connection are kept in
+// NVS and used to rejoin without a full channel scan.
+// -----------------------------------------------------------------------------
+
+struct WifiConfig
+{
+    String ssid;
+    String pass;
+    uint8_t bssid[6];
+    uint8_t channel; // 0 = unknown, scan all channels
+    IPAddress ip;    // static address, 0.0.0.0 = DHCP
+    IPAddress gateway;
+    IPAddress subnet;
+    IPAddress dns;
+};
+
+static WifiConfig config;
+static WifiStats stats = {};
+
+static std::atomic<bool> connected{false};
+static std::atomic<bool> attemptFailed{false};
+static std::atomic<bool> cacheDirty{false};
+static uint8_t seenBssid[6];
+static uint8_t seenChannel = 0;
+static portMUX_TYPE seenMux = portMUX_INITIALIZER_UNLOCKED;
+
+static bool everConnected = false;
+static bool usedCache = false;
+static unsigned long attemptStart = 0;
+static unsigned long lostAt = 0;
+
+static void loadConfig()
+{
+    Preferences prefs;
+    prefs.begin("wifi", true);
+    config.ssid = prefs.getString("ssid", "");
+    config.pass = prefs.getString("pass", "");
+    config.channel = prefs.getUChar("channel", 0);
+    if (prefs.getBytes("bssid", config.bssid, sizeof(config.bssid)) != sizeof(config.bssid))
+    {
+        config.channel = 0;
+    }
+
+    // Static addressing is only used when address, gateway and mask are valid
+    if (!config.ip.fromString(prefs.getString("ip", "")) || !config.gateway.fromString(prefs.getString("gateway", "")) ||
+        !config.subnet.fromString(prefs.getString("subnet", "")))
+    {
+        config.ip = IPAddress();
+    }
+    if (!config.dns.fromString(prefs.getString("dns", "")))
+    {
+        config.dns = config.gateway;
+    }
+    prefs.end();
+}
+
+// Persist the access point we ended up on, only when it changed
+static void saveCache()
+{
+    uint8_t bssid[6];
+    portENTER_CRITICAL(&seenMux);
+    memcpy(bssid, seenBssid, sizeof(bssid));
+    uint8_t channel = seenChannel;
+    portEXIT_CRITICAL(&seenMux);
+
+    if (channel == config.channel && memcmp(bssid, config.bssid, sizeof(bssid)) == 0)
+    {
+        return;
+    }
+
+    memcpy(config.bssid, bssid, sizeof(bssid));
+    config.channel = channel;
+
+    Preferences prefs;
+    prefs.begin("wifi", false);
+    prefs.putBytes("bssid", bssid, sizeof(bssid));
+    prefs.putUChar("channel", channel);
+    prefs.end();
+
+    LOGF("[WiFi] Cached BSSID %02x:%02x:%02x:%02x:%02x:%02x on channel %u\n", bssid[0], bssid[1], bssid[2], bssid[3],
+         bssid[4], bssid[5], channel);
+}
+
+static void beginAttempt()
+{
+    stats.attempts++;
+    attemptStart = millis();
+    attemptFailed = false;
+
+    if (config.ip != IPAddress())
+    {
+        WiFi.config(config.ip, config.gateway, config.subnet, config.dns);
+    }
+
+    // Join the cached access point directly; fall back to a scan after a miss
+    usedCache = config.channel != 0;
+    if (usedCache)
+    {
+        WiFi.begin(config.ssid.c_str(), config.pass.c_str(), config.channel, config.bssid, true);
+    }
+    else
+    {
+        WiFi.begin(config.ssid.c_str(), config.pass.c_str());
+    }
+}
+
+static void wifiTask(void *pvParameters)
+{
+    (void)pvParameters;
+
+    unsigned long retryDelay = WIFI_RETRY_MIN_MS;
+    unsigned long nextAttempt = 0;
+    bool attempting = false;
+    bool wasConnected = false;
+
+    beginAttempt();
+    attempting = true;
+
+    while (true)
+    {
+        vTaskDelay(pdMS_TO_TICKS(100));
+        unsigned long now = millis();
+
+        if (connected)
+        {
+            if (!wasConnected)
+            {
+                uint32_t took = now - (everConnected ? lostAt : 0);
+                if (!everConnected)
+                {
+                    stats.bootConnectMs = took;
+                    bootMark(BOOT_WIFI_CONNECTED);
+                    LOGF("[WiFi] Connected %lu ms after boot (%s)\n", took, usedCache ? "cached AP" : "scan");
+                }
+                else
+                {
+                    stats.reconnectMs = took;
+                    stats.reconnects++;
+                    LOGF("[WiFi] Reconnected after %lu ms (%s)\n", took, usedCache ? "cached AP" : "scan");
+                }
+                everConnected = true;
+                wasConnected = true;
+                attempting = false;
+                retryDelay = WIFI_RETRY_MIN_MS;
+            }
+
+            if (cacheDirty.exchange(false))
+            {
+                saveCache();
+            }
+            continue;
+        }
+
+        if (wasConnected)
+        {
+            wasConnected = false;
+            lostAt = now;
+            nextAttempt = now; // first reconnect right away
+        }
+
+        if (attempting && (attemptFailed || now - attemptStart >= WIFI_ATTEMPT_TIMEOUT_MS))
+        {
+            attempting = false;
+            WiFi.disconnect();
+
+            if (usedCache)
+            {
+                // The cached AP may have moved; scan on the next attempt
+                config.channel = 0;
+                nextAttempt = now;
+            }
+            else
+            {
+                nextAttempt = now + retryDelay;
+                LOGW("[WiFi] Attempt failed, retrying in %lu ms\n", retryDelay);
+                retryDelay = min(retryDelay * 2, WIFI_RETRY_MAX_MS);
+            }
+        }
+
+        if (!attempting && static_cast<long>(now - nextAttempt) >= 0)
+        {
+            beginAttempt();
+            attempting = true;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Wi-Fi event handlers
+// -----------------------------------------------------------------------------
+
+void WiFiStationConnected(WiFiEvent_t event, WiFiEventInfo_t info)
+{
+    portENTER_CRITICAL(&seenMux);
+    memcpy(seenBssid, info.wifi_sta_connected.bssid, sizeof(seenBssid));
+    seenChannel = info.wifi_sta_connected.channel;
+    portEXIT_CRITICAL(&seenMux);
+
+    LOG("Connected to AP successfully!");
+}
+
+void WiFiGotIP(WiFiEvent_t event, WiFiEventInfo_t info)
+{
+    LOGF("[WiFi] Connected to %s\n", WiFi.SSID().c_str());
+    LOGF("[WiFi] IP Address: %s\n", WiFi.localIP().toString().c_str());
+
+    // Wall-clock time for grind event timestamps
+    configTime(0, 0, "pool.ntp.org");
+
+    cacheDirty = true;
+    connected = true;
+}
+
+// Never reconnects from here; wifiTask schedules the next attempt
+void WiFiStationDisconnected(WiFiEvent_t event, WiFiEventInfo_t info)
+{
+    LOGF("[WiFi] Disconnected, reason %u\n", info.wifi_sta_disconnected.reason);
+
+    connected = false;
+    attemptFailed = true;
+}
+
+static void setupWiFiEvents()
+{
+    WiFi.onEvent(WiFiStationConnected, WiFiEvent_t::ARDUINO_EVENT_WIFI_STA_CONNECTED);
+    WiFi.onEvent(WiFiGotIP, WiFiEvent_t::ARDUINO_EVENT_WIFI_STA_GOT_IP);
+    WiFi.onEvent(WiFiStationDisconnected, WiFiEvent_t::ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+}
+
+void startWifi()
+{
+    loadConfig();
+
+    if (config.ssid.length() == 0)
+    {
+        startConfigPortal();
+        return;
+    }
+
+    setupWiFiEvents();
+
+    LOGF("[WiFi] Connecting to SSID: %s%s\n", config.ssid.c_str(), config.ip != IPAddress() ? " (static IP)" : "");
+
+    // Reconnects are handled by wifiTask with backoff; avoid flash writes per attempt
+    WiFi.persistent(false);
+    WiFi.setAutoReconnect(false);
+    WiFi.mode(WIFI_STA);
+
+    xTaskCreatePinnedToCore(wifiTask, "WifiTask", 3072, NULL, 1, NULL, 0);
+}
+
+bool wifiConnected()
+{
+    return connected;
+}
+
+WifiStats wifiGetStats()
+{
+    return stats;
+}
@@ -0,0 +1,104 @@
+"""Embed the web UI into the firmware as gzip-compressed byte arrays.
+
+Runs as a PlatformIO pre-build script (see extra_scripts in platformio.ini)
+and can also be called directly: python tools/embed_web.py
+
+Every file below web/ becomes a WebAsset in include/webui_assets.h, served
+as-is with Content-Encoding: gzip. The ETag is derived from the content, so
+browsers revalidate cheaply and only download again after a firmware change.
+"""
+
+import gzip
+import hashlib
+import os
+
+CONTENT_TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".json": "application/json",
+    ".svg": "image/svg+xml",
+    ".ico": "image/x-icon",
+    ".png": "image/png",
+}
+
+
+def symbol_for(rel_path):
+    name = "".join(c if c.isalnum() else "_" for c in rel_path)
+    return "WEB_" + name.upper() + "_GZ"
+
+
+def url_for(rel_path):
+    url = "/" + rel_path.replace(os.sep, "/")
+    return "/" if url == "/index.html" else url
+
+
+def generate(project_dir):
+    web_dir = os.path.join(project_dir, "web")
+    out_path = os.path.join(project_dir, "include", "webui_assets.h")
+
+    assets = []
+    for root, _, files in os.walk(web_dir):
+        for name in sorted(files):
+            path = os.path.join(root, name)
+            rel_path = os.path.relpath(path, web_dir)
+            with open(path, "rb") as f:
+                raw = f.read()
+            # mtime=0 keeps the output reproducible between builds
+            data = gzip.compress(raw, compresslevel=9, mtime=0)
+            etag = '\\"' + hashlib.sha256(raw).hexdigest()[:16] + '\\"'
+            content_type = CONTENT_TYPES.get(os.path.splitext(name)[1], "application/octet-stream")
+            assets.append((rel_path, data, etag, content_type, len(raw)))
+
+    lines = [
+        "#pragma once",
+        "",
+        "// Generated by tools/embed_web.py from web/ - do not edit",
+        "",
+        "#include <Arduino.h>",
+        "",
+        "struct WebAsset",
+        "{",
+        "    const char *path;",
+        "    const char *contentType;",
+        "    const uint8_t *data;",
+        "    size_t length;",
+        "    const char *etag;",
+        "};",
+        "",
+    ]
+
+    for rel_path, data, _, _, raw_len in sorted(assets):
+        lines.append("// %s: %d bytes, %d gzipped" % (rel_path, raw_len, len(data)))
+        lines.append("static const uint8_t %s[] PROGMEM = {" % symbol_for(rel_path))
+        for i in range(0, len(data), 16):
+            lines.append("    " + ", ".join("0x%02x" % b for b in data[i:i + 16]) + ",")
+        lines.append("};")
+        lines.append("")
+
+    lines.append("static const WebAsset WEB_ASSETS[] = {")
+    for rel_path, data, etag, content_type, _ in sorted(assets):
+        symbol = symbol_for(rel_path)
+        lines.append('    {"%s", "%s", %s, sizeof(%s), "%s"},' % (url_for(rel_path), content_type, symbol, symbol, etag))
+    lines.append("};")
+    lines.append("")
+    lines.append("static const size_t WEB_ASSET_COUNT = sizeof(WEB_ASSETS) / sizeof(WEB_ASSETS[0]);")
+    lines.append("")
+
+    content = "\n".join(lines)
+    if os.path.exists(out_path):
+        with open(out_path) as f:
+            if f.read() == content:
+                return
+
+    with open(out_path, "w") as f:
+        f.write(content)
+    print("Embedded %d web assets into %s" % (len(assets), os.path.relpath(out_path, project_dir)))
+
+
+try:
+    Import("env")  # noqa: F821 - provided by PlatformIO
+    generate(env.subst("$PROJECT_DIR"))  # noqa: F821
+except NameError:
+    if __name__ == "__main__":
+        generate(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
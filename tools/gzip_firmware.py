@@ -0,0 +1,29 @@
+"""Write a gzip-compressed copy of the firmware next to firmware.bin.
+
+Runs as a PlatformIO post-build script for the release environment. The
+grinder accepts firmware.bin.gz through /update and the auto-update and
+inflates it while flashing, which roughly halves the transfer.
+"""
+
+import gzip
+import os
+
+Import("env")  # noqa: F821  (provided by PlatformIO)
+
+
+def compress_firmware(source, target, env):
+    firmware = str(target[0])
+    out_path = firmware + ".gz"
+
+    with open(firmware, "rb") as f:
+        data = f.read()
+
+    # mtime=0 keeps the output reproducible; no file name in the header
+    with open(out_path, "wb") as f:
+        f.write(gzip.compress(data, compresslevel=9, mtime=0))
+
+    ratio = 100.0 * os.path.getsize(out_path) / len(data)
+    print("Compressed %s: %d -> %d bytes (%.0f%%)" % (os.path.basename(out_path), len(data), os.path.getsize(out_path), ratio))
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.bin", compress_firmware)  # noqa: F821
@@ -0,0 +1,82 @@
+"""Convert a trace downloaded from /trace into Chrome trace JSON.
+
+    curl -o trace.bin http://<grinder>/trace
+    python tools/trace2perfetto.py trace.bin trace.json
+
+Open the result in https://ui.perfetto.dev or chrome://tracing. Each core is
+shown as one thread. Cycle counts are turned into microseconds using the
+TRACE_SYNC records every core writes (see src/trace.cpp); records before a
+core's first sync record are skipped.
+"""
+
+import json
+import struct
+import sys
+
+HEADER = struct.Struct("<4sBBHI2I2I")
+RECORD = struct.Struct("<IBBHII")
+
+# Same order as TraceEvent in include/trace.h
+EVENTS = ["sync", "loop", "motor_ramp", "display", "mqtt_state", "scale_read", "target_reached", "settled"]
+SYNC = 0
+BEGIN, END, INSTANT = 0, 1, 2
+PHASES = {BEGIN: "B", END: "E", INSTANT: "i"}
+
+
+def signed(value):
+    return value - (1 << 32) if value & 0x80000000 else value
+
+
+def convert(data):
+    magic, version, cores, record_size, cpu_mhz, count0, count1, dropped0, dropped1 = HEADER.unpack_from(data)
+    if magic != b"CGTR" or version != 1 or record_size != RECORD.size:
+        raise ValueError("not a CoffeeGrinder trace (version %d)" % version)
+
+    counts = [count0, count1][:cores]
+    dropped = [dropped0, dropped1][:cores]
+    events = [{"ph": "M", "name": "process_name", "pid": 0, "args": {"name": "CoffeeGrinder"}}]
+    offset = HEADER.size
+
+    for core, count in enumerate(counts):
+        events.append({"ph": "M", "name": "thread_name", "pid": 0, "tid": core, "args": {"name": "core %d" % core}})
+        if dropped[core]:
+            print("core %d: %d records dropped, buffer was full" % (core, dropped[core]), file=sys.stderr)
+
+        sync_cycles = None
+        sync_us = 0
+        for _ in range(count):
+            cycles, event, kind, _reserved, arg0, arg1 = RECORD.unpack_from(data, offset)
+            offset += RECORD.size
+
+            if event == SYNC:
+                sync_cycles = cycles
+                sync_us = arg0 | (arg1 << 32)
+                continue
+            if sync_cycles is None:
+                continue
+
+            ts = sync_us + ((cycles - sync_cycles) & 0xFFFFFFFF) / cpu_mhz
+            name = EVENTS[event] if event < len(EVENTS) else "event_%d" % event
+            entry = {"ph": PHASES.get(kind, "i"), "name": name, "pid": 0, "tid": core, "ts": ts}
+            if kind == INSTANT:
+                entry["s"] = "t"
+            if arg0 or arg1:
+                entry["args"] = {"arg0": signed(arg0), "arg1": signed(arg1)}
+            events.append(entry)
+
+    return {"traceEvents": events, "displayTimeUnit": "ms"}
+
+
+def main():
+    if len(sys.argv) != 3:
+        print("usage: trace2perfetto.py trace.bin trace.json", file=sys.stderr)
+        sys.exit(2)
+
+    with open(sys.argv[1], "rb") as f:
+        trace = convert(f.read())
+    with open(sys.argv[2], "w") as f:
+        json.dump(trace, f)
+
+
+if __name__ == "__main__":
+    main()